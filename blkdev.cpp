@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <string.h>
 #include "blkdev.h"
 #include <sys/types.h>
@@ -9,44 +10,250 @@
 #include <fcntl.h>
 #include <stdexcept>
 #include <errno.h>
+#include <algorithm>
+#include <thread>
 
-BlockDeviceSimulator::BlockDeviceSimulator(std::string fname) {
+const struct device_profile DEVICE_PROFILE_HDD = { "hdd", 100, 8000, 150, 1 };
+const struct device_profile DEVICE_PROFILE_SATA_SSD = { "ssd", 80, 20, 520, 32 };
+const struct device_profile DEVICE_PROFILE_NVME = { "nvme", 15, 0, 3000, 64 };
 
-	// if file doesn't exist, create it
-	if (access(fname.c_str(), F_OK) == -1) {
+// Sleeping is too coarse for the latency of fast devices, so the end of a wait is spun
+static void wait_until(std::chrono::steady_clock::time_point deadline) {
+	auto spin_time = std::chrono::microseconds(100);
+
+	if (deadline - std::chrono::steady_clock::now() > 2 * spin_time)
+		std::this_thread::sleep_until(deadline - spin_time);
+	while (std::chrono::steady_clock::now() < deadline)
+		std::this_thread::yield();
+}
+
+BlockDeviceSimulator::BlockDeviceSimulator() : read_only(false), fd(-1), size(0), filemap(NULL),
+	profile(NULL), free_slots(0), emulated_end(-1), recording(false), recorded_end(-1), recorded_reads(0), recorded_writes(0),
+	recorded_read_bytes(0), recorded_written_bytes(0), recorded_sequential(0), recorded_random(0), device_time_us(0) {
+}
+
+BlockDeviceSimulator::BlockDeviceSimulator(std::string fname, int size_, bool read_only_) : read_only(read_only_), size(size_),
+	profile(NULL), free_slots(0), emulated_end(-1), recording(false), recorded_end(-1), recorded_reads(0), recorded_writes(0),
+	recorded_read_bytes(0), recorded_written_bytes(0), recorded_sequential(0), recorded_random(0), device_time_us(0) {
+
+	// if file doesn't exist, create it (a read-only device has to find it)
+	if (!read_only && access(fname.c_str(), F_OK) == -1) {
 		fd = open(fname.c_str(), O_CREAT | O_RDWR | O_EXCL, 0664);
 		if (fd == -1)
 			throw std::runtime_error(
 				std::string("open-create failed: ") + strerror(errno));
 
-		if (lseek(fd, DEVICE_SIZE-1, SEEK_SET) == -1)
+		if (lseek(fd, size-1, SEEK_SET) == -1)
 			throw std::runtime_error("Could not seek");
 
 		::write(fd, "\0", 1);
 	} else {
-		fd = open(fname.c_str(), O_RDWR);
+		fd = open(fname.c_str(), read_only ? O_RDONLY : O_RDWR);
 		if (fd == -1) {
 			throw std::runtime_error(
 				std::string("open failed: ") + strerror(errno));
 		}
 	}
 
-	filemap = (unsigned char *)mmap(NULL, DEVICE_SIZE, PROT_READ | PROT_WRITE,
+	// Readers share the image and a writer keeps everyone else out, the lock goes away with the fd
+	if (flock(fd, (read_only ? LOCK_SH : LOCK_EX) | LOCK_NB) == -1) {
+		int error = errno;
+		close(fd);
+		throw std::runtime_error(error == EWOULDBLOCK ?
+			fname + " is in use by another process" : std::string("flock failed: ") + strerror(error));
+	}
+
+	filemap = (unsigned char *)mmap(NULL, size, read_only ? PROT_READ : PROT_READ | PROT_WRITE,
 				        MAP_SHARED, fd, 0);
 	if (filemap == (unsigned char *)-1)
 		throw std::runtime_error(strerror(errno));
 }
 
 BlockDeviceSimulator::~BlockDeviceSimulator() {
-	munmap(filemap, DEVICE_SIZE);
+	// Devices made of other devices have nothing mapped
+	if (filemap == NULL)
+		return;
+
+	munmap(filemap, size);
 	close(fd);
 }
 
+bool BlockDeviceSimulator::is_read_only() const {
+	return read_only;
+}
+
+int BlockDeviceSimulator::get_stripe_size() const {
+	return 0;
+}
+
+int BlockDeviceSimulator::get_member_count() const {
+	return 1;
+}
+
 void BlockDeviceSimulator::read(int addr, int size, char *ans) {
+	if (recording || profile != NULL) {
+		struct io_request request = {addr, size, ans};
+		record(&request, 1, false);
+		emulate(&request, 1);
+	}
+
 	memcpy(ans, filemap + addr, size);
 }
 
 void BlockDeviceSimulator::write(int addr, int size, const char *data) {
+	// The image isn't mapped for writing
+	if (read_only)
+		throw std::runtime_error("The device is read-only");
+
+	if (recording || profile != NULL) {
+		struct io_request request = {addr, size, (char *)data};
+		record(&request, 1, true);
+		emulate(&request, 1);
+	}
+
 	memcpy(filemap + addr, data, size);
 }
 
+
+void BlockDeviceSimulator::read_batch(const std::vector<struct io_request> &requests) {
+	record(requests.data(), requests.size(), false);
+	emulate(requests.data(), requests.size());
+
+	for (auto &request : requests)
+		memcpy(request.data, filemap + request.addr, request.size);
+}
+
+void BlockDeviceSimulator::write_batch(const std::vector<struct io_request> &requests) {
+	if (read_only)
+		throw std::runtime_error("The device is read-only");
+
+	record(requests.data(), requests.size(), true);
+	emulate(requests.data(), requests.size());
+
+	for (auto &request : requests)
+		memcpy(filemap + request.addr, request.data, request.size);
+}
+
+void BlockDeviceSimulator::prefetch(int addr, int size) {
+	advise(addr, size, MADV_WILLNEED);
+}
+
+void BlockDeviceSimulator::drop(int addr, int size) {
+	advise(addr, size, MADV_DONTNEED);
+	posix_fadvise(fd, addr, size, POSIX_FADV_DONTNEED);
+}
+
+void BlockDeviceSimulator::advise(int addr, int size, int advice) {
+	// madvise works on whole pages, so round the range out to them
+	long page_size = sysconf(_SC_PAGESIZE);
+	int start = addr - addr % page_size;
+	int end = addr + size;
+
+	if (end > this->size)
+		end = this->size;
+	if (start >= end)
+		return;
+
+	// The advice is only a hint, failing to give it doesn't affect the data
+	madvise(filemap + start, end - start, advice);
+}
+
+void BlockDeviceSimulator::set_profile(const struct device_profile *profile_) {
+	std::lock_guard<std::mutex> lock(model_lock);
+
+	// The profile should be set before requests are sent, the queue starts empty
+	profile = profile_;
+	free_slots = profile_ == NULL ? 0 : profile_->queue_depth;
+	busy_until = std::chrono::steady_clock::now();
+	emulated_end = -1;
+}
+
+const struct device_profile *BlockDeviceSimulator::find_profile(const std::string &name) {
+	for (const struct device_profile *known : { &DEVICE_PROFILE_HDD, &DEVICE_PROFILE_SATA_SSD, &DEVICE_PROFILE_NVME })
+		if (name == known->name)
+			return known;
+
+	return NULL;
+}
+
+void BlockDeviceSimulator::set_recording(bool enabled) {
+	recording = enabled;
+}
+
+bool BlockDeviceSimulator::is_recording() const {
+	return recording;
+}
+
+struct io_stats BlockDeviceSimulator::get_io_stats() {
+	struct io_stats stats = { recorded_reads, recorded_writes, recorded_read_bytes, recorded_written_bytes, recorded_sequential, recorded_random, 0 };
+
+	std::lock_guard<std::mutex> lock(model_lock);
+	stats.device_time_us = device_time_us;
+	return stats;
+}
+
+void BlockDeviceSimulator::reset_io_stats() {
+	recorded_reads = recorded_writes = 0;
+	recorded_read_bytes = recorded_written_bytes = 0;
+	recorded_sequential = recorded_random = 0;
+	recorded_end = -1;
+
+	std::lock_guard<std::mutex> lock(model_lock);
+	device_time_us = 0;
+}
+
+void BlockDeviceSimulator::record(const struct io_request *requests, size_t count, bool is_write) {
+	if (!recording)
+		return;
+
+	for (size_t i = 0; i < count; i++) {
+		// A request is sequential if it starts where the previous one ended
+		bool sequential = recorded_end.exchange(requests[i].addr + requests[i].size, std::memory_order_relaxed) == requests[i].addr;
+
+		(is_write ? recorded_writes : recorded_reads).fetch_add(1, std::memory_order_relaxed);
+		(is_write ? recorded_written_bytes : recorded_read_bytes).fetch_add(requests[i].size, std::memory_order_relaxed);
+		(sequential ? recorded_sequential : recorded_random).fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void BlockDeviceSimulator::emulate(const struct io_request *requests, size_t total) {
+	const struct device_profile *model = profile;
+
+	if (model == NULL)
+		return;
+
+	// The requests are sent in waves that fill the device's queue
+	for (size_t first = 0; first < total; first += model->queue_depth) {
+		int count = std::min(total - first, (size_t)model->queue_depth);
+		double latency_us = 0;
+		long bytes = 0;
+
+		// Wait for enough free slots in the queue, requests of other threads may be holding them
+		std::unique_lock<std::mutex> lock(model_lock);
+		slot_cond.wait(lock, [this, count]() { return free_slots >= count; });
+		free_slots -= count;
+
+		// The requests of a wave wait for their latency together
+		for (size_t i = first; i < first + count; i++) {
+			double penalty_us = requests[i].addr == emulated_end ? 0 : model->random_penalty_us;
+			latency_us = std::max(latency_us, model->latency_us + penalty_us);
+			emulated_end = requests[i].addr + requests[i].size;
+			bytes += requests[i].size;
+		}
+
+		// Then their transfers take their turn on the device's bandwidth, after the transfers before them
+		auto now = std::chrono::steady_clock::now();
+		auto start = std::max(now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(latency_us)), busy_until);
+		busy_until = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(bytes / model->bandwidth_mb_s));
+		auto done = busy_until;
+		device_time_us += std::chrono::duration<double, std::micro>(done - now).count();
+		lock.unlock();
+
+		wait_until(done);
+
+		lock.lock();
+		free_slots += count;
+		lock.unlock();
+		slot_cond.notify_all();
+	}
+}
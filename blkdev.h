@@ -1,21 +1,117 @@
 #ifndef __BLKDEVSIM__H__
 #define __BLKDEVSIM__H__
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <vector>
+#include <stdint.h>
 
 #define DEVICE_SIZE (1024 * 1024)
 
+// A single transfer of a batch, data is read into or written from
+struct io_request {
+	int addr;
+	int size;
+	char *data;
+};
+
+// The performance of an emulated device. Every request costs the latency (plus
+// the random penalty if it doesn't start where the previous one ended), up to
+// queue_depth requests wait for their latency together, and the transfers
+// share the bandwidth of the device.
+struct device_profile {
+	const char *name;
+	double latency_us;
+	double random_penalty_us;
+	double bandwidth_mb_s;
+	int queue_depth;
+};
+
+extern const struct device_profile DEVICE_PROFILE_HDD;
+extern const struct device_profile DEVICE_PROFILE_SATA_SSD;
+extern const struct device_profile DEVICE_PROFILE_NVME;
+
+struct io_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_bytes;
+	uint64_t written_bytes;
+	uint64_t sequential;
+	uint64_t random;
+	// The time the emulated device spent on the requests
+	double device_time_us;
+};
+
 class BlockDeviceSimulator {
 public:
-	BlockDeviceSimulator(std::string fname);
-	~BlockDeviceSimulator();
+	// A read-only device maps an existing image for reading only. Any number of
+	// read-only devices share an image, while a writable one has it to itself
+	BlockDeviceSimulator(std::string fname, int size_ = DEVICE_SIZE, bool read_only_ = false);
+	virtual ~BlockDeviceSimulator();
+
+	bool is_read_only() const;
+
+	// The width of a stripe and the amount of images the device is spread over, a
+	// single image has no stripes
+	virtual int get_stripe_size() const;
+	virtual int get_member_count() const;
+
+	virtual void read(int addr, int size, char *ans);
+	virtual void write(int addr, int size, const char *data);
 
-	void read(int addr, int size, char *ans);
-	void write(int addr, int size, const char *data);
+	// Transfer a batch of ranges, devices with several members may run them in parallel
+	virtual void read_batch(const std::vector<struct io_request> &requests);
+	virtual void write_batch(const std::vector<struct io_request> &requests);
+
+	// Hint that a range is about to be read, so it's paged in ahead of time
+	virtual void prefetch(int addr, int size);
+	// Hint that a range won't be read soon, so it's pages can be dropped
+	virtual void drop(int addr, int size);
+
+	// Emulate the speed of a real device, NULL completes requests at memory speed
+	virtual void set_profile(const struct device_profile *profile_);
+	// Find a profile by it's name (hdd, ssd or nvme), NULL if there is none
+	static const struct device_profile *find_profile(const std::string &name);
+
+	// Count the requests, they aren't counted unless recording is enabled
+	void set_recording(bool enabled);
+	bool is_recording() const;
+	virtual struct io_stats get_io_stats();
+	virtual void reset_io_stats();
+
+protected:
+	BlockDeviceSimulator();
+
+	// Devices made of other devices are read-only if their members are
+	bool read_only;
+
+	// Add the requests to the counters, if recording is enabled
+	void record(const struct io_request *requests, size_t count, bool is_write);
 
 private:
 	int fd;
+	int size;
 	unsigned char *filemap;
+
+	std::atomic<const struct device_profile *> profile;
+	std::mutex model_lock;
+	std::condition_variable slot_cond;
+	int free_slots;
+	std::chrono::steady_clock::time_point busy_until;
+	int emulated_end;
+
+	// The counters aren't locked, so recording doesn't serialize the requests of several threads
+	std::atomic<bool> recording;
+	std::atomic<int> recorded_end;
+	std::atomic<uint64_t> recorded_reads, recorded_writes, recorded_read_bytes, recorded_written_bytes, recorded_sequential, recorded_random;
+	// The time the emulated device spent, it's counted under the model lock
+	double device_time_us;
+
+	void advise(int addr, int size, int advice);
+	void emulate(const struct io_request *requests, size_t count);
 };
 
 #endif // __BLKDEVSIM__H__
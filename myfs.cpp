@@ -1,81 +1,278 @@
 #include "myfs.h"
 
 #include <string.h>
+#include <stddef.h>
+#include <algorithm>
 #include <iostream>
 #include <math.h>
 #include <sstream>
 
 #include "utils.h"
 #include "myfs_exception.h"
+#include "myfs_trace.h"
 
 const char *MyFs::MYFS_MAGIC = "MYFS";
 
-MyFs::MyFs(BlockDeviceSimulator *blkdevsim_) : blkdevsim(blkdevsim_), _current_dir_inode(1)
+MyFs::MyFs() : _trace(nullptr)
+{
+}
+
+MyFs::~MyFs()
+{
+}
+
+std::unique_ptr<MyFs> MyFs::mount(BlockDeviceSimulator *blkdevsim_, uint32_t block_size)
+{
+	struct myfs_header header;
+	std::unique_ptr<MyFs> myfs;
+
+	// A device holding myfs is mounted with the block size it was formatted with, other devices are formatted
+	blkdevsim_->read(0, sizeof(header), (char *)&header);
+	if (strncmp(header.magic, MYFS_MAGIC, sizeof(header.magic)) == 0 && header.version == CURR_VERSION)
+	{
+		block_size = header.block_shift < 32 ? 1u << header.block_shift : 0;
+	}
+
+	// Mount the device with the geometry of it's block size
+	if (!visit_geometry(block_size, [&](auto geometry) { myfs.reset(new MyFsVolume<decltype(geometry)>(blkdevsim_)); }))
+	{
+		throw MyFsException("There is no geometry for blocks of " + std::to_string(block_size) + " bytes!");
+	}
+
+	return myfs;
+}
+
+std::unique_ptr<MyFs> MyFs::format(BlockDeviceSimulator *blkdevsim_, uint32_t block_size)
+{
+	struct myfs_header header = {{0}};
+
+	// A read-only device can't be formatted
+	if (blkdevsim_->is_read_only())
+	{
+		throw MyFsException("A read-only device can't be formatted!");
+	}
+
+	// Leave the device as it is if it can't be formatted with the block size
+	if (!visit_geometry(block_size, [](auto geometry) {}))
+	{
+		throw MyFsException("There is no geometry for blocks of " + std::to_string(block_size) + " bytes!");
+	}
+
+	// Wipe the header, so the device is formatted with the block size when it's mounted
+	blkdevsim_->write(0, sizeof(header), (const char *)&header);
+
+	return mount(blkdevsim_, block_size);
+}
+
+template <typename Geometry>
+MyFsVolume<Geometry>::MyFsVolume(BlockDeviceSimulator *blkdevsim_) : blkdevsim(blkdevsim_), _read_only(blkdevsim_->is_read_only()), _current_dir_inode(1), _dirty_bytes(0), _dirty_blocks(0), _next_handle(1), _data_generation(0), _stop_reclaimer(false), _stop_flusher(false)
 {
 	struct myfs_header header;
+	struct myfs_info sys_info = {0};
+	std::vector<struct myfs_entry> entries;
+
+	// Page in the metadata blocks ahead of their first use
+	blkdevsim->prefetch(0, FIRST_DATA_BLOCK * BLOCK_SIZE);
+
 	blkdevsim->read(0, sizeof(header), (char *)&header);
 
 	if (strncmp(header.magic, MYFS_MAGIC, sizeof(header.magic)) != 0 ||
 		(header.version != CURR_VERSION))
 	{
+		// A read-only device can't be formatted
+		if (_read_only)
+		{
+			throw MyFsException("Did not find myfs instance on the read-only device!");
+		}
+
 		std::cout << "Did not find myfs instance on blkdev" << std::endl;
 		std::cout << "Creating..." << std::endl;
 		format();
 		std::cout << "Finished!" << std::endl;
+		header = get_header();
+	}
+	// The layout of the device depends on it's block size, so it's mounted only with the geometry of it's block size
+	else if (header.block_shift != Geometry::BLOCK_SHIFT)
+	{
+		throw MyFsException("The device has blocks of " + std::to_string(1u << header.block_shift) + " bytes, but it's mounted with blocks of " + std::to_string(BLOCK_SIZE) + " bytes!");
+	}
+	// The images have to be put together the way they were when the device was formatted
+	else if (header.stripe_size != (uint32_t)blkdevsim->get_stripe_size() || header.member_count != (uint32_t)blkdevsim->get_member_count())
+	{
+		throw MyFsException("The device was formatted with " + describe_striping(header.stripe_size, header.member_count) + ", but it's opened with " + describe_striping(blkdevsim->get_stripe_size(), blkdevsim->get_member_count()) + "!");
+	}
+	// If the file system wasn't unmounted cleanly, the free counters may be wrong, so count them again (a read-only
+	// mount only reports them, so it leaves them for the next writer)
+	else if (!(header.state & STATE_CLEAN) && !_read_only)
+	{
+		blkdevsim->read(sizeof(header), sizeof(sys_info), (char *)&sys_info);
+		sys_info.free_blocks = BLOCK_COUNT - sys_info.block_bitmap.count();
+		for (uint32_t i = 0; i < BLOCK_GROUP_COUNT; i++)
+		{
+			sys_info.group_free_blocks[i] = 0;
+			sys_info.group_dirs[i] = 0;
+		}
+		for (uint32_t i = FIRST_DATA_BLOCK; i < BLOCK_COUNT; i++)
+		{
+			sys_info.group_free_blocks[i / BLOCKS_PER_GROUP] += sys_info.block_bitmap.test(i) ? 0 : 1;
+		}
+
+		// Count the used entries of the initialized part of the inode table, and the dirs of every group
+		entries.resize(header.inode_table_blocks * BLOCK_SIZE / sizeof(struct myfs_entry));
+		blkdevsim->read(BLOCK_SIZE, header.inode_table_blocks * BLOCK_SIZE, (char *)entries.data());
+		sys_info.free_inodes = INODE_TABLE_ENTRIES;
+		for (auto &entry : entries)
+		{
+			sys_info.free_inodes -= entry.inode != 0 ? 1 : 0;
+			sys_info.group_dirs[entry.group] += entry.inode != 0 && entry.is_dir ? 1 : 0;
+		}
+
+		blkdevsim->write(sizeof(header), sizeof(sys_info), (const char *)&sys_info);
 	}
+
+	// Nothing changes under a read-only mount, so the entries are indexed once and there is nothing to do in the background
+	if (_read_only)
+	{
+		_inodes = get_file_entries();
+		return;
+	}
+
+	// Index the fingerprints of the block table for dedup
+	load_fingerprints();
+
+	// The file system is mounted until the destructor marks it as clean
+	header.state &= ~STATE_CLEAN;
+	set_header(&header);
+
+	// Start returning the blocks of removed files in the background
+	_reclaimer = std::thread(&MyFsVolume::reclaimer_loop, this);
+
+	// Start writing back the write-back cache in the background
+	_flusher = std::thread(&MyFsVolume::flusher_loop, this);
 }
 
-void MyFs::format()
+template <typename Geometry>
+MyFsVolume<Geometry>::~MyFsVolume()
 {
-	struct myfs_header header;
+	// A read-only mount didn't write anything or start the background threads
+	if (_read_only)
+	{
+		return;
+	}
+
+	// Write back the cache and stop the background threads, blocks that weren't reclaimed yet stay in the reclaim queue
+	{
+		std::lock_guard<std::recursive_mutex> lock(_lock);
+		try
+		{
+			write_back_all();
+		}
+		catch (const MyFsException &e)
+		{
+			std::cerr << e.what() << std::endl;
+		}
+		_stop_reclaimer = true;
+		_stop_flusher = true;
+	}
+	_reclaim_cond.notify_all();
+	_writeback_cond.notify_all();
+	_reclaimer.join();
+	_flusher.join();
+
+	// Everything was written, so the next mount can trust the free counters
+	struct myfs_header header = get_header();
+	header.state |= STATE_CLEAN;
+	set_header(&header);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::format()
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_FORMAT);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+
+	// A read-only mount can't be formatted
+	check_mount_writable();
+	struct myfs_header header = {{0}};
 	struct myfs_info sys_info = {0};
 
 	struct myfs_entry rootFolderEntry = {0};
 
-	struct myfs_entry empty_entry = {0};
+	// Go back to the live filesystem
+	_snapshot_name.clear();
+	_snapshot_entries.clear();
+	_current_dir_inode = 1;
+	_access_hints.clear();
+	_data_generation++;
+
+	// The cached contents and the open files belong to the files that are discarded
+	_dirty_files.clear();
+	_dirty_bytes = 0;
+	_dirty_blocks = 0;
+	_open_files.clear();
 
-	// Fill all 8 first blocks with 0
-	blkdevsim->write(0, (1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, std::string((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, 0).c_str());
+	// Only the first inode table block is initialized, the rest of the table is zeroed when it's needed
+	zero_block(1);
+
+	// The block table holds an entry for every block, so it's zeroed right away
+	for (uint32_t i = 1 + INODE_TABLE_BLOCKS; i < FIRST_DATA_BLOCK; i++)
+	{
+		zero_block(i);
+	}
+	load_fingerprints();
 
 	// put the header in place
 	strncpy(header.magic, MYFS_MAGIC, sizeof(header.magic));
 	header.version = CURR_VERSION;
-	blkdevsim->write(0, sizeof(header), (const char *)&header);
+	header.inode_table_blocks = 1;
+	header.block_shift = Geometry::BLOCK_SHIFT;
+	header.stripe_size = blkdevsim->get_stripe_size();
+	header.member_count = blkdevsim->get_member_count();
+	set_header(&header);
 
 	// Set the sys info after the header
 	sys_info.inode_count = 1;
-	sys_info.block_bitmap = 0b11111111; // Set all 8 first blocks as taken
+	sys_info.free_blocks = BLOCK_COUNT - FIRST_DATA_BLOCK;
+	sys_info.free_inodes = INODE_TABLE_ENTRIES - 1;
+
+	// Set all the metadata blocks as taken
+	for (uint32_t i = 0; i < FIRST_DATA_BLOCK; i++)
+	{
+		sys_info.block_bitmap.set(i);
+	}
 
-	// Set the root folder as first entry in the first entry in the inode table
+	// Count the free blocks of every group
+	for (uint32_t i = FIRST_DATA_BLOCK; i < BLOCK_COUNT; i++)
+	{
+		sys_info.group_free_blocks[i / BLOCKS_PER_GROUP]++;
+	}
+
+	// Set the root folder as first entry in the first entry in the inode table, it's in the first group
 	rootFolderEntry.inode = 1;
 	rootFolderEntry.is_dir = true;
+	sys_info.group_dirs[0] = 1;
 	init_dir(&rootFolderEntry, &rootFolderEntry, &sys_info);
 	blkdevsim->write(BLOCK_SIZE, sizeof(rootFolderEntry), (const char *)&rootFolderEntry);
 
-	// Set empty entry after the first entry for the next file to be created to be set there
-	blkdevsim->write(BLOCK_SIZE + sizeof(rootFolderEntry), sizeof(struct myfs_entry), (const char *)&empty_entry);
-
 	// Save the sys info
 	blkdevsim->write(sizeof(header), sizeof(sys_info), (const char *)&sys_info);
 }
 
-struct MyFs::myfs_entry MyFs::get_dir(const std::string &path_str)
+template <typename Geometry>
+struct MyFs::myfs_entry MyFsVolume<Geometry>::get_dir(std::string_view path_str)
 {
 	struct myfs_entry dir;
 	struct myfs_dir_entry dir_entry;
+	std::string_view dir_name;
 
-	// Get all dirs names
-	std::vector<std::string> dirs = Utils::Split(path_str, '/');
-	dir_entries entries;
-
-	// If the first dir of the path is the root folder set the dir as the entry of the first folder
-	if (dirs[0].length() == 0)
+	// If the path starts at the root folder set the dir as the entry of the first folder
+	if (!path_str.empty() && path_str[0] == '/')
 	{
 		// Get the first inode which is the root dir inode
 		dir = get_file_entry(1);
 
-		// Remove the first dir from the dirs list
-		dirs.erase(dirs.begin());
+		// Skip the root folder in the path
+		path_str.remove_prefix(1);
 	}
 	// Set initial dir as the current dir
 	else {
@@ -87,17 +284,20 @@ struct MyFs::myfs_entry MyFs::get_dir(const std::string &path_str)
 		}
 	}
 
-	// Go through the dir names in the dirs vector
-	for (std::string &dir_name : dirs)
+	// Go through the dir names of the path, they are viewed in place
+	while (Utils::NextToken(path_str, '/', dir_name))
 	{
-		// Get the dir entries of the current dir
-		entries = get_dir_entries(dir);
-
 		// Try to find the dir as a file in the current dir
-		dir_entry = Utils::SearchFile(dir_name, entries);
+		dir_entry = find_dir_entry(dir, dir_name);
 		if (dir_entry.inode == 0)
 		{
-			throw MyFsException("Unable to find the dir '" + dir_name + "'!");
+			throw MyFsException("Unable to find the dir '" + std::string(dir_name) + "'!");
+		}
+
+		// A file's content can't be read as dir records
+		if (dir_entry.type != ENTRY_TYPE_DIR)
+		{
+			throw MyFsException("'" + std::string(dir_name) + "' is not a dir!");
 		}
 
 		// Try to get the entry of the dir
@@ -111,732 +311,4293 @@ struct MyFs::myfs_entry MyFs::get_dir(const std::string &path_str)
 	return dir;
 }
 
-MyFs::dir_entries MyFs::get_dir_entries(MyFs::myfs_entry dir_entry)
+template <typename Geometry>
+MyFs::dir_entries MyFsVolume<Geometry>::get_dir_entries(MyFs::myfs_entry dir_entry)
 {
 	dir_entries entries_vector;
-	struct myfs_dir_entry *entries;
-	struct myfs_dir dir;
-	char *dir_data = new char[dir_entry.size];
-
-	// Get all the dir data
-	get_file(dir_entry, dir_data);
+	struct myfs_block block;
 
-	// Get the dir struct from the dir data
-	dir = *(struct myfs_dir *)dir_data;
+	// If the dir is indexed, go through the leaves chained after the index block
+	if (dir_entry.flags & ENTRY_FLAG_INDEXED_DIR)
+	{
+		// Read the index block
+		blkdevsim->read(dir_entry.first_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
 
-	// Set the entries pointer to point at the start of them
-	entries = (struct myfs_dir_entry *)(dir_data + sizeof(struct myfs_dir));
+		// While there is a next leaf, get it's entries
+		while (block.next_block)
+		{
+			blkdevsim->read(block.next_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
+			unpack_dir_entries(block.data, entries_vector);
+		}
 
-	// Push each entry of the dir into the vector of entries
-	for (int i = 0; i < dir.amount; i++)
-	{
-		entries_vector.push_back(entries[i]);
+		return entries_vector;
 	}
 
-	// Release the memory allocated for the dir data
-	delete[] dir_data;
+	// A dir that isn't indexed fits in it's first block
+	blkdevsim->read(dir_entry.first_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
+
+	// Parse the records of the dir
+	unpack_dir_entries(block.data, entries_vector);
 
 	return entries_vector;
 }
 
-std::string MyFs::change_directory(std::string path, std::string dir_name)
+uint32_t MyFs::unpack_dir_entries(const char *data, MyFs::dir_entries &entries)
 {
-	struct myfs_entry parent_dir, dir;
-	struct myfs_dir_entry dir_entry;
-	dir_entries entries;
+	struct myfs_dir_entry entry;
+	struct myfs_dir_record *record;
+	struct myfs_dir dir;
+	uint32_t record_pointer = sizeof(struct myfs_dir);
 
-	// If the user requested the root dir
-	if (path == "/" && dir_name.length() == 0)
-	{
-		_current_dir_inode = 1;
-		return "/";
-	}
+	// Get the dir struct from the dir data
+	dir = *(struct myfs_dir *)data;
 
-	// Get the parent dir entry
-	parent_dir = get_dir(path);
+	// Parse each record of the dir and push it's entry into the vector of entries
+	for (uint32_t i = 0; i < dir.amount; i++)
+	{
+		// Get the record's header
+		record = (struct myfs_dir_record *)(data + record_pointer);
 
-	// Get the parent dir's entries
-	entries = get_dir_entries(parent_dir);
+		// Set the entry properties, the name is right after the record's header
+		entry.inode = record->inode;
+		entry.type = record->type;
+		entry.name.assign(data + record_pointer + sizeof(struct myfs_dir_record), record->name_length);
+		entries.push_back(entry);
 
-	// Get the entry of the dir in the dir parent
-	dir_entry = Utils::SearchFile(dir_name, entries);
-	if (dir_entry.inode == 0)
-	{
-		throw MyFsException("Unable to find the dir '" + dir_name + "'!");
+		// Move to the next record
+		record_pointer += sizeof(struct myfs_dir_record) + record->name_length;
 	}
 
-	// Try to get the dir inode entry
-	dir = get_file_entry(dir_entry.inode);
-	if (dir.inode == 0)
-	{
-		throw MyFsException("An error occurred while searching the file's entry!");
-	}
-	// If the file isn't a dir, throw error 
-	else if (!dir.is_dir)
-	{
-		throw MyFsException("Unable to find the dir '" + dir_name + "'!");
-	}
+	return record_pointer;
+}
 
-	// Set it as the new current folder
-	_current_dir_inode = dir.inode;
+uint32_t MyFs::pack_dir_entries(char *data, const MyFs::dir_entries &entries)
+{
+	struct myfs_dir dir;
+	uint32_t record_pointer = sizeof(struct myfs_dir);
 
-	// If the dir is the root dir
-	if (dir.inode == 1)
+	// Set the dir struct at the start of the data
+	dir.amount = entries.size();
+	memcpy(data, &dir, sizeof(dir));
+
+	// Pack the records one after another
+	for (auto &entry : entries)
 	{
-		return "/";
+		record_pointer += pack_dir_entry(data + record_pointer, entry);
 	}
-	// If the requested dir is the current dir, get it's name
-	else if (dir_name == ".")
-	{
-		// Get the parent dir of the current dir
-		parent_dir = get_file_entry(Utils::SearchFile(std::string(".."), entries).inode);
-
-		// Get the parent dir's entries
-		entries = get_dir_entries(parent_dir);
 
-		// Get the entry of the dir in the dir parent
-		dir_entry = Utils::SearchFile(dir.inode, entries);
-		if (dir_entry.inode == 0)
-		{
-			throw MyFsException("Unable to find the dir '" + dir_name + "'!");
-		}
-	}
-	// If the requested dir is the previous dir
-	else if (dir_name == "..")
-	{
-		// Get the previous dir's entries
-		entries = get_dir_entries(dir);
+	return record_pointer;
+}
 
-		// Get the parent dir of the previous dir
-		parent_dir = get_file_entry(Utils::SearchFile(std::string(".."), entries).inode);
+uint32_t MyFs::pack_dir_entry(char *data, const struct MyFs::myfs_dir_entry &entry)
+{
+	struct myfs_dir_record record;
 
-		// Get the parent dir's entries
-		entries = get_dir_entries(parent_dir);
+	// Set the record's header
+	record.inode = entry.inode;
+	record.name_length = entry.name.length();
+	record.type = entry.type;
 
-		// Get the entry of the dir in the dir parent
-		dir_entry = Utils::SearchFile(dir.inode, entries);
-		if (dir_entry.inode == 0)
-		{
-			throw MyFsException("Unable to find the dir '" + dir_name + "'!");
-		}
-	}
+	// Copy the header and the name after it
+	memcpy(data, &record, sizeof(record));
+	memcpy(data + sizeof(record), entry.name.c_str(), entry.name.length());
 
-	return std::string(dir_entry.name);
+	return sizeof(record) + entry.name.length();
 }
 
-struct MyFs::myfs_entry MyFs::get_file_entry(const uint32_t inode)
+template <typename Geometry>
+struct MyFs::myfs_dir_entry MyFsVolume<Geometry>::find_dir_entry(const struct MyFs::myfs_entry &dir, std::string_view name)
 {
-	uint32_t entry_address = BLOCK_SIZE;
-	struct myfs_entry entry = {0};
+	struct myfs_block block;
 
-	for (uint32_t i = 0; i < (BLOCK_SIZE * INODE_TABLE_BLOCKS) / sizeof(struct myfs_entry); i++)
+	// If the dir isn't indexed, search the records of it's only block
+	if (!(dir.flags & ENTRY_FLAG_INDEXED_DIR))
 	{
-		// Get the entry from the current entry address
-		blkdevsim->read(entry_address, sizeof(struct myfs_entry), (char *)&entry);
+		blkdevsim->read(dir.first_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
+		return search_dir_records(block.data, name);
+	}
 
-		// If the inode matches the inode of the requested file, return the entry
-		if (entry.inode == inode)
-		{
-			return entry;
-		}
+	// Read the index block
+	blkdevsim->read(dir.first_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
 
-		// Set the address to point at the next entry
-		entry_address += sizeof(struct myfs_entry);
-	}
+	// Search the only leaf that can hold the name
+	blkdevsim->read(find_dir_leaf(&block, Utils::HashName(name)) * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
 
-	return entry;
+	return search_dir_records(block.data, name);
 }
 
-void MyFs::get_file(const myfs_entry file_entry, char *file_data)
+struct MyFs::myfs_dir_entry MyFs::search_dir_records(const char *data, std::string_view name)
 {
-	uint32_t file_pointer = 0;
-	struct myfs_block block;
+	struct myfs_dir_entry entry = {0};
+	struct myfs_dir_record *record;
+	struct myfs_dir dir;
+	uint32_t record_pointer = sizeof(struct myfs_dir);
 
-	// Set the next block to be taken as the first block of the file
-	block.next_block = file_entry.first_block;
+	// Get the dir struct from the dir data
+	dir = *(struct myfs_dir *)data;
 
-	// While there is a next block, keep on getting the blocks
-	do
+	// Compare the names right in the records, so nothing is copied until the entry is found
+	for (uint32_t i = 0; i < dir.amount; i++)
 	{
-		// Read the block
-		blkdevsim->read(block.next_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
+		record = (struct myfs_dir_record *)(data + record_pointer);
+		if (std::string_view(data + record_pointer + sizeof(struct myfs_dir_record), record->name_length) == name)
+		{
+			// Only the inode and the type are set, the caller has the name
+			entry.inode = record->inode;
+			entry.type = record->type;
+			return entry;
+		}
 
-		// Copy the data from the block into the file data
-		memcpy(file_data + file_pointer, block.data, file_entry.size - file_pointer < BLOCK_DATA_SIZE ? file_entry.size - file_pointer : BLOCK_DATA_SIZE);
+		// Move to the next record
+		record_pointer += sizeof(struct myfs_dir_record) + record->name_length;
+	}
 
-		// Increase data pointer for the next data block
-		file_pointer += BLOCK_DATA_SIZE;
-	} while (block.next_block);
+	// Return an empty dir entry if not found
+	return entry;
 }
 
-uint32_t MyFs::allocate_block(struct MyFs::myfs_block *block, struct MyFs::myfs_info *sys_info)
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::find_dir_leaf(const struct myfs_block *index_block, uint32_t hash)
 {
-	uint32_t block_index = 1 + INODE_TABLE_BLOCKS;
+	struct myfs_dir_index *index = (struct myfs_dir_index *)index_block->data;
+	struct myfs_dir_index_entry *index_entries = (struct myfs_dir_index_entry *)(index_block->data + sizeof(struct myfs_dir_index));
+	uint32_t low = 0, high = index->leaf_count;
 
-	// While the block is allocated, continue to the next block
-	while (block_index < sys_info->block_bitmap.size() && sys_info->block_bitmap.test(block_index))
+	// Binary search for the last leaf which starts at or before the hash (the first leaf starts at 0)
+	while (high - low > 1)
 	{
-		block_index++;
+		if (index_entries[(low + high) / 2].hash <= hash)
+		{
+			low = (low + high) / 2;
+		}
+		else
+		{
+			high = (low + high) / 2;
+		}
 	}
 
-	// If can't find an empty block, send error
-	if (block_index == sys_info->block_bitmap.size())
-	{
-		throw MyFsException("Hard drive full!");
-	}
+	return index_entries[low].block;
+}
 
-	// Allocate the block in the block's bitmap
-	sys_info->block_bitmap.set(block_index);
+template <typename Geometry>
+void MyFsVolume<Geometry>::build_dir_index(struct MyFs::myfs_entry *dir, MyFs::dir_entries entries, struct myfs_info *sys_info)
+{
+	uint32_t old_first_block = dir->first_block;
 
-	// Write the block struct to the newly allocated block
-	blkdevsim->write(block_index * BLOCK_SIZE, BLOCK_SIZE, (const char *)block);
+	// Write the index and it's leaves as a new chain
+	dir->first_block = write_dir_index(entries, &dir->size, group_first_block(dir->group), sys_info);
+	dir->flags |= ENTRY_FLAG_INDEXED_DIR;
 
-	return block_index;
+	// Update the dir's entry and release it's old blocks
+	update_entry(dir);
+	deallocate_block_chain(old_first_block, sys_info);
 }
 
-void MyFs::add_entry(struct MyFs::myfs_entry *file_entry)
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::write_dir_index(MyFs::dir_entries entries, uint32_t *size, uint32_t goal, struct myfs_info *sys_info)
 {
-	struct myfs_entry entry = {0};
-	uint32_t entry_table_pointer = BLOCK_SIZE;
-
-	// While we didn't find an empty entry
-	do
-	{
-		// Read the entry from the entries table
-		blkdevsim->read(entry_table_pointer, sizeof(entry), (char *)&entry);
+	std::vector<dir_entries> leaves(1);
+	std::vector<uint32_t> leaf_sizes(1, sizeof(struct myfs_dir));
+	struct myfs_dir_index index = {0};
+	struct myfs_dir_index_entry index_entry;
+	struct myfs_block block;
+	uint32_t record_size = 0, block_index = 0;
+	size_t moved_entries = 0;
 
-		// Point to the next entry
-		entry_table_pointer += sizeof(entry);
-	} while (entry.inode != 0 && (entry_table_pointer + sizeof(entry)) < (1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE);
+	// Sort the entries by their name's hash
+	std::stable_sort(entries.begin(), entries.end(), [](const struct myfs_dir_entry &a, const struct myfs_dir_entry &b) {
+		return Utils::HashName(a.name) < Utils::HashName(b.name);
+	});
 
-	// If the pointer is after the end of the table, throw error
-	if ((entry_table_pointer + sizeof(entry)) > (1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE)
+	// Fill the leaves one after another
+	for (auto &entry : entries)
 	{
-		throw MyFsException("Inode entries table is full!");
-	}
+		record_size = sizeof(struct myfs_dir_record) + entry.name.length();
 
-	// Write the new entry
-	blkdevsim->write(entry_table_pointer - sizeof(struct myfs_entry), sizeof(struct myfs_entry), (const char *)file_entry);
-}
+		// If the entry doesn't fit in the current leaf, start a new leaf
+		if (leaf_sizes.back() + record_size > BLOCK_DATA_SIZE)
+		{
+			leaves.push_back(dir_entries());
+			leaf_sizes.push_back(sizeof(struct myfs_dir));
 
-void MyFs::update_entry(struct MyFs::myfs_entry *file_entry)
-{
-	struct myfs_entry entry = {0};
-	uint32_t entry_table_pointer = BLOCK_SIZE;
+			// Move the entries with the same hash to the new leaf, so every hash is in a single leaf
+			dir_entries &prev_leaf = leaves[leaves.size() - 2];
+			for (moved_entries = 0; moved_entries < prev_leaf.size() && Utils::HashName(prev_leaf[prev_leaf.size() - 1 - moved_entries].name) == Utils::HashName(entry.name); moved_entries++);
+			if (moved_entries == prev_leaf.size())
+			{
+				throw MyFsException("Too many names with the same hash in the dir!");
+			}
+			leaves.back().assign(prev_leaf.end() - moved_entries, prev_leaf.end());
+			prev_leaf.erase(prev_leaf.end() - moved_entries, prev_leaf.end());
+			for (auto &moved_entry : leaves.back())
+			{
+				leaf_sizes[leaves.size() - 2] -= sizeof(struct myfs_dir_record) + moved_entry.name.length();
+				leaf_sizes.back() += sizeof(struct myfs_dir_record) + moved_entry.name.length();
+			}
+		}
 
-	// While we didn't find the entry in the table
-	do
+		// Add the entry to the current leaf
+		leaves.back().push_back(entry);
+		leaf_sizes.back() += record_size;
+	}
+
+	// If the index can't point at all the leaves, throw error
+	if (leaves.size() > MAX_DIR_INDEX_ENTRIES)
 	{
-		// Read the entry from the entries table
-		blkdevsim->read(entry_table_pointer, sizeof(entry), (char *)&entry);
+		throw MyFsException("Directory is full!");
+	}
 
-		// Point to the next entry
-		entry_table_pointer += sizeof(entry);
-	} while (entry.inode != file_entry->inode && (entry_table_pointer + sizeof(entry)) < (1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE);
+	// Set the index header
+	index.amount = entries.size();
+	index.leaf_count = leaves.size();
+	memset(&block, 0, sizeof(block));
+	memcpy(block.data, &index, sizeof(index));
 
-	// If the entry wasn't found, throw error
-	if (entry.inode != file_entry->inode)
+	// Write the leaves from the last one to the first one, so each leaf's next block is already known
+	for (int i = leaves.size() - 1; i >= 0; i--)
 	{
-		throw MyFsException("Inode entry wasn't found!");
+		// Set the index entry of the leaf, the first leaf holds all the hashes before the second one
+		index_entry.hash = i == 0 ? 0 : Utils::HashName(leaves[i].front().name);
+
+		// Pack the leaf and allocate it
+		struct myfs_block leaf_block = {{0}};
+		pack_dir_entries(leaf_block.data, leaves[i]);
+		leaf_block.next_block = block_index;
+		block_index = allocate_block(&leaf_block, goal, sys_info);
+
+		// Save the leaf in the index
+		index_entry.block = block_index;
+		memcpy(block.data + sizeof(index) + i * sizeof(index_entry), &index_entry, sizeof(index_entry));
 	}
 
-	// Write the new entry
-	blkdevsim->write(entry_table_pointer - sizeof(struct myfs_entry), sizeof(struct myfs_entry), (const char *)file_entry);
+	// Write the index block before the leaves
+	block.next_block = block_index;
+	*size = (1 + leaves.size()) * BLOCK_DATA_SIZE;
+
+	return allocate_block(&block, goal, sys_info);
 }
 
-void MyFs::update_file(struct MyFs::myfs_entry *file_entry, char *data, uint32_t size)
+template <typename Geometry>
+void MyFsVolume<Geometry>::add_indexed_dir_entry(struct MyFs::myfs_entry *dir, const struct MyFs::myfs_dir_entry &entry, struct myfs_info *sys_info)
 {
-	uint32_t data_pointer = size - (size % BLOCK_DATA_SIZE) + BLOCK_DATA_SIZE, block_index = 0, back_block_index = 0, deallocate_block_index = 0;
-	struct myfs_info sys_info = {0};
-	struct myfs_block block = {{0}};
-
-	// Get the file system info struct
-	blkdevsim->read(sizeof(myfs_header), sizeof(sys_info), (char *)&sys_info);
-
-	// If the file isn't allocated yet, allocate it
-	if (file_entry->first_block == 0 && size != 0)
+	struct myfs_block index_block, leaf_block, new_leaf_block = {{0}};
+	struct myfs_dir_index *index = (struct myfs_dir_index *)index_block.data;
+	struct myfs_dir_index_entry *index_entries = (struct myfs_dir_index_entry *)(index_block.data + sizeof(struct myfs_dir_index));
+	struct myfs_dir_index_entry new_index_entry;
+	uint32_t hash = Utils::HashName(entry.name), leaf_index = 0, leaf_size = 0, split_size = 0, leaf_position = 0;
+	size_t split = 0, middle = 0;
+	dir_entries entries, new_leaf_entries;
+
+	// If the dir's blocks are shared, they can't be changed in place, so rebuild the dir with the new entry in new blocks
+	if (is_block_chain_shared(dir->first_block))
 	{
-		// While we didn't reach the end of the data (backwards addition of the file)
-		do
-		{
-			// Go to the next block
-			data_pointer -= BLOCK_DATA_SIZE;
-
-			// Set the next block's index
-			block.next_block = block_index;
+		entries = get_dir_entries(*dir);
+		entries.push_back(entry);
+		build_dir_index(dir, entries, sys_info);
+		return;
+	}
 
-			// Copy the current block's data to the block's struct
-			memcpy(block.data, data + data_pointer, size - data_pointer < BLOCK_DATA_SIZE ? size - data_pointer : BLOCK_DATA_SIZE);
+	// Read the index block and the leaf that should hold the entry
+	blkdevsim->read(dir->first_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&index_block);
+	leaf_index = find_dir_leaf(&index_block, hash);
+	blkdevsim->read(leaf_index * BLOCK_SIZE, BLOCK_SIZE, (char *)&leaf_block);
 
-			// Allocate the block and get it's position
-			block_index = allocate_block(&block, &sys_info);
-		} while (data_pointer);
+	// Add the entry to the leaf's entries
+	leaf_size = unpack_dir_entries(leaf_block.data, entries) + sizeof(struct myfs_dir_record) + entry.name.length();
+	entries.push_back(entry);
 
-		// Set the first block as we received from the loop
-		file_entry->first_block = block_index;
-	}
-	// If the file has blocks on memory and has changed, rewrite all the blocks
-	else if (file_entry->first_block != 0 && size != 0)
+	// If the leaf is full, split it into two leaves
+	if (leaf_size > BLOCK_DATA_SIZE)
 	{
-		// Allocate blocks as much as the new file requires
-		for (int i = 0; i < Utils::CalcAmountOfBlocksForFile(size) - Utils::CalcAmountOfBlocksForFile(file_entry->size); i++)
+		// If the index is full, throw error
+		if (index->leaf_count == MAX_DIR_INDEX_ENTRIES)
 		{
-			// Go to the next block
-			data_pointer -= BLOCK_DATA_SIZE;
-
-			// Set the next block's index
-			block.next_block = block_index;
+			throw MyFsException("Directory is full!");
+		}
 
-			// Copy the current block's data to the block's struct
-			memcpy(block.data, data + data_pointer, size - data_pointer < BLOCK_DATA_SIZE ? size - data_pointer : BLOCK_DATA_SIZE);
+		// Sort the leaf's entries by their name's hash
+		std::stable_sort(entries.begin(), entries.end(), [](const struct myfs_dir_entry &a, const struct myfs_dir_entry &b) {
+			return Utils::HashName(a.name) < Utils::HashName(b.name);
+		});
 
-			// Allocate the block and get it's position
-			block_index = allocate_block(&block, &sys_info);
+		// Find the middle of the leaf by size
+		for (split = 0, split_size = sizeof(struct myfs_dir); split < entries.size() && split_size < leaf_size / 2; split++)
+		{
+			split_size += sizeof(struct myfs_dir_record) + entries[split].name.length();
 		}
 
-		// Save the back block index
-		back_block_index = block_index;
+		// Don't split the entries with the same hash, so every hash is in a single leaf
+		middle = split;
+		while (split < entries.size() && Utils::HashName(entries[split].name) == Utils::HashName(entries[split - 1].name))
+		{
+			split++;
+		}
+
+		// If there is no other hash after the middle, split before the middle instead
+		if (split == entries.size())
+		{
+			for (split = middle; split > 0 && Utils::HashName(entries[split].name) == Utils::HashName(entries[split - 1].name); split--);
+		}
+		if (split == 0 || split == entries.size())
+		{
+			throw MyFsException("Too many names with the same hash in the dir!");
+		}
+
+		// Move the second half of the entries to a new leaf chained after the leaf
+		new_leaf_entries.assign(entries.begin() + split, entries.end());
+		entries.erase(entries.begin() + split, entries.end());
+		pack_dir_entries(new_leaf_block.data, new_leaf_entries);
+		new_leaf_block.next_block = leaf_block.next_block;
+		leaf_block.next_block = allocate_block(&new_leaf_block, group_first_block(dir->group), sys_info);
+
+		// Add the new leaf to the index right after the leaf
+		new_index_entry.hash = Utils::HashName(new_leaf_entries.front().name);
+		new_index_entry.block = leaf_block.next_block;
+		for (leaf_position = 0; index_entries[leaf_position].block != leaf_index; leaf_position++);
+		memmove(index_entries + leaf_position + 2, index_entries + leaf_position + 1, (index->leaf_count - leaf_position - 1) * sizeof(new_index_entry));
+		index_entries[leaf_position + 1] = new_index_entry;
+		index->leaf_count++;
+		dir->size += BLOCK_DATA_SIZE;
+	}
+
+	// Rewrite the leaf
+	memset(leaf_block.data, 0, BLOCK_DATA_SIZE);
+	pack_dir_entries(leaf_block.data, entries);
+	overwrite_block(leaf_index, &leaf_block);
+
+	// Rewrite the index block with the new amount of entries
+	index->amount++;
+	overwrite_block(dir->first_block, &index_block);
+
+	// Update the dir's entry
+	update_entry(dir);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::remove_dir_entry(struct MyFs::myfs_entry *dir, std::string_view name, struct myfs_info *sys_info)
+{
+	dir_entries entries;
+	char *new_dir_data = nullptr;
+
+	// If the dir is indexed, remove the entry from it's leaf
+	if (dir->flags & ENTRY_FLAG_INDEXED_DIR)
+	{
+		remove_indexed_dir_entry(dir, name, sys_info);
+		return;
+	}
+
+	// Get the entries of the dir without the entry
+	entries = get_dir_entries(*dir);
+	entries.erase(std::remove_if(entries.begin(), entries.end(), [&name](const struct myfs_dir_entry &entry) {
+		return entry.name == name;
+	}), entries.end());
+
+	// Pack the rest of the entries and update the dir file
+	new_dir_data = new char[dir->size];
+	update_file(dir, new_dir_data, pack_dir_entries(new_dir_data, entries), sys_info);
+
+	// Release the memory allocated for the dir data
+	delete[] new_dir_data;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::remove_indexed_dir_entry(struct MyFs::myfs_entry *dir, std::string_view name, struct myfs_info *sys_info)
+{
+	struct myfs_block index_block, leaf_block;
+	struct myfs_dir_index *index = (struct myfs_dir_index *)index_block.data;
+	struct myfs_dir_index_entry *index_entries = (struct myfs_dir_index_entry *)(index_block.data + sizeof(struct myfs_dir_index));
+	uint32_t leaf_index = 0, leaf_position = 0;
+	dir_entries entries;
+
+	// Removes the entry from a vector of entries
+	auto remove_entry_by_name = [&name](dir_entries &entries_vector) {
+		entries_vector.erase(std::remove_if(entries_vector.begin(), entries_vector.end(), [&name](const struct myfs_dir_entry &entry) {
+			return entry.name == name;
+		}), entries_vector.end());
+	};
+
+	// If the dir's blocks are shared, they can't be changed in place, so rebuild the dir without the entry in new blocks
+	if (is_block_chain_shared(dir->first_block))
+	{
+		entries = get_dir_entries(*dir);
+		remove_entry_by_name(entries);
+		build_dir_index(dir, entries, sys_info);
+		return;
+	}
+
+	// Read the index block and the leaf that holds the entry
+	blkdevsim->read(dir->first_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&index_block);
+	leaf_index = find_dir_leaf(&index_block, Utils::HashName(name));
+	blkdevsim->read(leaf_index * BLOCK_SIZE, BLOCK_SIZE, (char *)&leaf_block);
+
+	// Remove the entry from the leaf's entries
+	unpack_dir_entries(leaf_block.data, entries);
+	remove_entry_by_name(entries);
+
+	// Find the position of the leaf in the index
+	for (leaf_position = 0; index_entries[leaf_position].block != leaf_index; leaf_position++);
+
+	// If the leaf is empty and it isn't the first leaf, unlink it from the chain and from the index
+	if (entries.empty() && leaf_position != 0)
+	{
+		// Link the previous leaf to the next leaf
+		set_next_block(index_entries[leaf_position - 1].block, leaf_block.next_block);
+
+		// Remove the leaf from the index
+		memmove(index_entries + leaf_position, index_entries + leaf_position + 1, (index->leaf_count - leaf_position - 1) * sizeof(struct myfs_dir_index_entry));
+		index->leaf_count--;
+		dir->size -= BLOCK_DATA_SIZE;
+
+		// Release only the leaf's block
+		release_blocks(leaf_index, 1, sys_info);
+	}
+	// Rewrite the leaf without the entry
+	else
+	{
+		memset(leaf_block.data, 0, BLOCK_DATA_SIZE);
+		pack_dir_entries(leaf_block.data, entries);
+		overwrite_block(leaf_index, &leaf_block);
+	}
+
+	// Rewrite the index block with the new amount of entries
+	index->amount--;
+	overwrite_block(dir->first_block, &index_block);
+
+	// Update the dir's entry
+	update_entry(dir);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::update_dir_entry(struct MyFs::myfs_entry *dir, const struct MyFs::myfs_dir_entry &entry, struct myfs_info *sys_info)
+{
+	struct myfs_block index_block, leaf_block;
+	uint32_t leaf_index = 0;
+	dir_entries entries;
+	char *new_dir_data = nullptr;
+
+	// Replaces the entry with the same name in a vector of entries
+	auto replace_entry = [&entry](dir_entries &entries_vector) {
+		for (auto &current_entry : entries_vector)
+		{
+			if (current_entry.name == entry.name)
+			{
+				current_entry = entry;
+			}
+		}
+	};
+
+	// If the dir isn't indexed, rewrite the dir with the updated entry
+	if (!(dir->flags & ENTRY_FLAG_INDEXED_DIR))
+	{
+		entries = get_dir_entries(*dir);
+		replace_entry(entries);
+
+		// Pack the entries and update the dir file
+		new_dir_data = new char[dir->size];
+		update_file(dir, new_dir_data, pack_dir_entries(new_dir_data, entries), sys_info);
+
+		// Release the memory allocated for the dir data
+		delete[] new_dir_data;
+		return;
+	}
+
+	// If the dir's blocks are shared, they can't be changed in place, so rebuild the dir in new blocks
+	if (is_block_chain_shared(dir->first_block))
+	{
+		entries = get_dir_entries(*dir);
+		replace_entry(entries);
+		build_dir_index(dir, entries, sys_info);
+		return;
+	}
+
+	// Read the index block and the leaf that holds the entry
+	blkdevsim->read(dir->first_block * BLOCK_SIZE, BLOCK_SIZE, (char *)&index_block);
+	leaf_index = find_dir_leaf(&index_block, Utils::HashName(entry.name));
+	blkdevsim->read(leaf_index * BLOCK_SIZE, BLOCK_SIZE, (char *)&leaf_block);
+
+	// Rewrite only the leaf with the updated entry, the size of the record doesn't change
+	unpack_dir_entries(leaf_block.data, entries);
+	replace_entry(entries);
+	pack_dir_entries(leaf_block.data, entries);
+	overwrite_block(leaf_index, &leaf_block);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::overwrite_block(uint32_t block_index, const struct myfs_block *block)
+{
+	struct myfs_block_info block_info = get_block_info(block_index);
+
+	// Overwrite the block
+	blkdevsim->write(block_index * BLOCK_SIZE, BLOCK_SIZE, (const char *)block);
+	_data_generation++;
+
+	// The content of the block changed so it's fingerprint is no longer valid
+	block_info.fingerprint = 0;
+	set_block_info(block_index, &block_info);
+}
+
+template <typename Geometry>
+std::string MyFsVolume<Geometry>::change_directory(std::string_view path, std::string_view dir_name)
+{
+	struct myfs_entry parent_dir, dir;
+	struct myfs_dir_entry dir_entry;
+	dir_entries entries;
+
+	// If the user requested the root dir
+	if (path == "/" && dir_name.length() == 0)
+	{
+		_current_dir_inode = 1;
+		return "/";
+	}
+
+	// Get the parent dir entry
+	parent_dir = get_dir(path);
+
+	// Get the entry of the dir in the dir parent
+	dir_entry = find_dir_entry(parent_dir, dir_name);
+	if (dir_entry.inode == 0)
+	{
+		throw MyFsException("Unable to find the dir '" + std::string(dir_name) + "'!");
+	}
+
+	// The entry was found by it's name, which isn't copied into it
+	dir_entry.name = dir_name;
+
+	// Try to get the dir inode entry
+	dir = get_file_entry(dir_entry.inode);
+	if (dir.inode == 0)
+	{
+		throw MyFsException("An error occurred while searching the file's entry!");
+	}
+	// If the file isn't a dir, throw error 
+	else if (!dir.is_dir)
+	{
+		throw MyFsException("Unable to find the dir '" + std::string(dir_name) + "'!");
+	}
+
+	// Set it as the new current folder
+	_current_dir_inode = dir.inode;
+
+	// If the dir is the root dir
+	if (dir.inode == 1)
+	{
+		return "/";
+	}
+	// If the requested dir is the current dir, get it's name
+	else if (dir_name == ".")
+	{
+		// Get the parent dir of the current dir
+		parent_dir = get_file_entry(find_dir_entry(parent_dir, "..").inode);
+
+		// Get the parent dir's entries
+		entries = get_dir_entries(parent_dir);
+
+		// Get the entry of the dir in the dir parent
+		dir_entry = Utils::SearchFile(dir.inode, entries);
+		if (dir_entry.inode == 0)
+		{
+			throw MyFsException("Unable to find the dir '" + std::string(dir_name) + "'!");
+		}
+	}
+	// If the requested dir is the previous dir
+	else if (dir_name == "..")
+	{
+		// Get the parent dir of the previous dir
+		parent_dir = get_file_entry(find_dir_entry(dir, "..").inode);
+
+		// Get the parent dir's entries
+		entries = get_dir_entries(parent_dir);
+
+		// Get the entry of the dir in the dir parent
+		dir_entry = Utils::SearchFile(dir.inode, entries);
+		if (dir_entry.inode == 0)
+		{
+			throw MyFsException("Unable to find the dir '" + std::string(dir_name) + "'!");
+		}
+	}
+
+	return dir_entry.name;
+}
+
+template <typename Geometry>
+std::unordered_map<uint32_t, struct MyFs::myfs_entry> MyFsVolume<Geometry>::get_file_entries()
+{
+	std::unordered_map<uint32_t, struct myfs_entry> inodes;
+	std::vector<struct myfs_entry> entries;
+
+	// If a snapshot is used, take it's copy of the inode table
+	if (!_snapshot_name.empty())
+	{
+		entries = _snapshot_entries;
+	}
+	// A read-only mount indexed the table when it was mounted
+	else if (_read_only && !_inodes.empty())
+	{
+		return _inodes;
+	}
+	// Otherwise read the initialized part of the inode table at once
+	else
+	{
+		entries.resize((get_header().inode_table_blocks * BLOCK_SIZE) / sizeof(struct myfs_entry));
+		blkdevsim->read(BLOCK_SIZE, entries.size() * sizeof(struct myfs_entry), (char *)entries.data());
+	}
+
+	// Index the used entries by their inode
+	inodes.reserve(entries.size());
+	for (auto &entry : entries)
+	{
+		if (entry.inode != 0)
+		{
+			inodes[entry.inode] = entry;
+		}
+	}
+
+	return inodes;
+}
+
+template <typename Geometry>
+struct MyFs::myfs_entry MyFsVolume<Geometry>::get_file_entry(const uint32_t inode)
+{
+	uint32_t entry_address = BLOCK_SIZE;
+	struct myfs_entry entry = {0};
+
+	// If a snapshot is used, search it's copy of the inode table
+	if (!_snapshot_name.empty())
+	{
+		for (auto &snapshot_entry : _snapshot_entries)
+		{
+			if (snapshot_entry.inode == inode)
+			{
+				return snapshot_entry;
+			}
+		}
+
+		return entry;
+	}
+
+	// A read-only mount looks the entry up in it's index
+	if (_read_only)
+	{
+		auto found = _inodes.find(inode);
+		return found != _inodes.end() ? found->second : entry;
+	}
+
+	for (uint32_t i = 0; i < (BLOCK_SIZE * get_header().inode_table_blocks) / sizeof(struct myfs_entry); i++)
+	{
+		// Get the entry from the current entry address
+		blkdevsim->read(entry_address, sizeof(struct myfs_entry), (char *)&entry);
+
+		// If the inode matches the inode of the requested file, return the entry
+		if (entry.inode == inode)
+		{
+			return entry;
+		}
+
+		// Set the address to point at the next entry
+		entry_address += sizeof(struct myfs_entry);
+	}
+
+	return entry;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::get_file(const myfs_entry file_entry, char *file_data)
+{
+	uint8_t hint = get_access_hint(file_entry.inode);
+	block_map blocks = get_block_map(file_entry.first_block, hint);
+
+	// Holes in the file aren't in the block chain, so they are read as zeros
+	memset(file_data, 0, file_entry.size);
+
+	// Read all the blocks in a single batch, so a striped device reads them in parallel
+	blkdevsim->read_batch(get_file_requests(file_entry, blocks, file_data));
+
+	// Dontneed files don't keep the blocks that were read
+	if (hint == ACCESS_DONTNEED)
+	{
+		drop_blocks(blocks);
+	}
+}
+
+template <typename Geometry>
+std::vector<struct io_request> MyFsVolume<Geometry>::get_file_requests(const myfs_entry &file_entry, const MyFs::block_map &blocks, char *file_data)
+{
+	uint32_t file_pointer = 0;
+	std::vector<struct io_request> requests;
+	struct io_request request;
+
+	// Read the data of every block right into it's position in the file (empty files have no blocks at all)
+	requests.reserve(blocks.size());
+	for (auto &mapped_block : blocks)
+	{
+		file_pointer = mapped_block.logical_block * BLOCK_DATA_SIZE;
+		if (file_pointer >= file_entry.size)
+		{
+			continue;
+		}
+
+		request.addr = mapped_block.block_index * BLOCK_SIZE;
+		request.size = file_entry.size - file_pointer < BLOCK_DATA_SIZE ? file_entry.size - file_pointer : BLOCK_DATA_SIZE;
+		request.data = file_data + file_pointer;
+		requests.push_back(request);
+	}
+
+	return requests;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::read_file_range(const myfs_entry file_entry, uint32_t offset, uint32_t size, char *data)
+{
+	read_file_range(file_entry, get_block_map(file_entry.first_block, get_access_hint(file_entry.inode)), offset, size, data);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::read_file_range(const myfs_entry &file_entry, const MyFs::block_map &blocks, uint32_t offset, uint32_t size, char *data)
+{
+	uint32_t block_start, range_start, range_end;
+	uint8_t hint = get_access_hint(file_entry.inode);
+
+	// Holes in the range aren't in the block chain, so they are read as zeros
+	memset(data, 0, size);
+
+	// Go through the allocated blocks of the file from the first block of the range
+	for (size_t i = find_mapped_block(blocks, offset / BLOCK_DATA_SIZE); i < blocks.size() && blocks[i].logical_block * BLOCK_DATA_SIZE < offset + size; i++)
+	{
+		const struct myfs_mapped_block &mapped_block = blocks[i];
+
+		// Get the part of the range that is inside the block
+		block_start = mapped_block.logical_block * BLOCK_DATA_SIZE;
+		range_start = std::max(offset, block_start);
+		range_end = std::min(offset + size, block_start + (uint32_t)BLOCK_DATA_SIZE);
+
+		// If the block is inside the range, read only the needed part of it
+		if (range_start < range_end)
+		{
+			blkdevsim->read(mapped_block.block_index * BLOCK_SIZE + (range_start - block_start), range_end - range_start, data + (range_start - offset));
+
+			// Dontneed files don't keep the blocks that were read
+			if (hint == ACCESS_DONTNEED)
+			{
+				blkdevsim->drop(mapped_block.block_index * BLOCK_SIZE, BLOCK_SIZE);
+			}
+		}
+	}
+}
+
+template <typename Geometry>
+MyFs::block_map MyFsVolume<Geometry>::get_block_map(uint32_t block_chain_head)
+{
+	return get_block_map(block_chain_head, ACCESS_NORMAL);
+}
+
+template <typename Geometry>
+MyFs::block_map MyFsVolume<Geometry>::get_block_map(uint32_t block_chain_head, uint8_t hint)
+{
+	block_map blocks;
+	struct myfs_mapped_block mapped_block;
+	struct myfs_readahead state = init_readahead(hint);
+	uint32_t block_trailer[2];
+	uint32_t block_index = block_chain_head;
+
+	// While we didn't reach the end of the block chain
+	while (block_index != 0)
+	{
+		// Read only the logical block number and the next block of the block
+		blkdevsim->read(block_index * BLOCK_SIZE + offsetof(struct myfs_block, logical_block), sizeof(block_trailer), (char *)block_trailer);
+
+		// Prefetch the blocks after the next block if the chain is in order
+		readahead(&state, block_index, block_trailer[1]);
+
+		// Save the block in the map
+		mapped_block.logical_block = block_trailer[0];
+		mapped_block.block_index = block_index;
+		blocks.push_back(mapped_block);
+
+		// Move to the next block
+		block_index = block_trailer[1];
+	}
+
+	return blocks;
+}
+
+template <typename Geometry>
+struct MyFs::myfs_readahead MyFsVolume<Geometry>::init_readahead(uint8_t hint)
+{
+	struct myfs_readahead state = {0};
+
+	// Files that are known to be read sequentially start with the biggest window
+	state.hint = hint;
+	state.window = hint == ACCESS_SEQUENTIAL ? READAHEAD_MAX_BLOCKS : READAHEAD_MIN_BLOCKS;
+
+	return state;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::readahead(struct MyFs::myfs_readahead *state, uint32_t block_index, uint32_t next_block)
+{
+	int32_t stride = (int32_t)next_block - (int32_t)block_index;
+	uint32_t start = 0, end = 0;
+
+	// Random files and the end of the chain have nothing to read ahead
+	if (state->hint == ACCESS_RANDOM || next_block == 0)
+	{
+		return;
+	}
+
+	// Count how many steps in a row the chain moved the same way
+	if (stride == state->stride)
+	{
+		state->run++;
+	}
+	else
+	{
+		state->stride = stride;
+		state->run = 1;
+	}
+
+	// Only chains laid out in order can be predicted, wait for a second step unless the file is sequential
+	if ((stride != 1 && stride != -1) || (state->run < 2 && state->hint != ACCESS_SEQUENTIAL))
+	{
+		return;
+	}
+
+	// If the next block was already prefetched, wait until the walk passes the prefetched blocks
+	if (next_block >= state->prefetched_start && next_block < state->prefetched_end)
+	{
+		return;
+	}
+
+	// Get the window of blocks from the next block in the direction of the chain
+	if (stride == 1)
+	{
+		start = next_block;
+		end = std::min(next_block + state->window, (uint32_t)BLOCK_COUNT);
+	}
+	else
+	{
+		start = next_block + 1 > FIRST_DATA_BLOCK + state->window ? next_block + 1 - state->window : FIRST_DATA_BLOCK;
+		end = next_block + 1;
+	}
+
+	// Prefetch the window and grow it for the next time
+	blkdevsim->prefetch(start * BLOCK_SIZE, (end - start) * BLOCK_SIZE);
+	state->prefetched_start = start;
+	state->prefetched_end = end;
+	state->window = std::min(state->window * 2, (uint32_t)READAHEAD_MAX_BLOCKS);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::drop_blocks(const MyFs::block_map &blocks)
+{
+	// Drop the cached pages of every block
+	for (auto &mapped_block : blocks)
+	{
+		blkdevsim->drop(mapped_block.block_index * BLOCK_SIZE, BLOCK_SIZE);
+	}
+}
+
+template <typename Geometry>
+uint8_t MyFsVolume<Geometry>::get_access_hint(uint32_t inode)
+{
+	auto hint = _access_hints.find(inode);
+
+	return hint == _access_hints.end() ? ACCESS_NORMAL : hint->second;
+}
+
+std::string MyFs::describe_striping(uint32_t stripe_size, uint32_t member_count)
+{
+	// A device that isn't striped is a single image
+	if (stripe_size == 0)
+	{
+		return "a single image";
+	}
+
+	return std::to_string(member_count) + " images in stripes of " + std::to_string(stripe_size) + " bytes";
+}
+
+template <typename Geometry>
+struct MyFs::myfs_header MyFsVolume<Geometry>::get_header()
+{
+	struct myfs_header header;
+
+	blkdevsim->read(0, sizeof(header), (char *)&header);
+
+	return header;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::set_header(const struct MyFs::myfs_header *header)
+{
+	blkdevsim->write(0, sizeof(struct myfs_header), (const char *)header);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::zero_block(uint32_t block_index)
+{
+	static const struct myfs_block empty_block = {{0}};
+
+	blkdevsim->write(block_index * BLOCK_SIZE, BLOCK_SIZE, (const char *)&empty_block);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::set_next_block(uint32_t block_index, uint32_t next_block)
+{
+	struct myfs_block_info block_info = get_block_info(block_index);
+
+	// Overwrite only the next block field of the block
+	blkdevsim->write(block_index * BLOCK_SIZE + offsetof(struct myfs_block, next_block), sizeof(next_block), (const char *)&next_block);
+
+	// The content of the block changed so it's fingerprint is no longer valid
+	block_info.fingerprint = 0;
+	set_block_info(block_index, &block_info);
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::allocate_block(struct myfs_block *block, uint32_t goal, struct myfs_info *sys_info)
+{
+	uint32_t block_index = 0;
+	struct myfs_block_info block_info = {0};
+
+	// If dedup is enabled, try to share an existing block with the same content. A block holds it's position in the
+	// file and the pointer to the next block of the chain, and a shared block has a single copy of them, so the
+	// whole block is compared: blocks are only shared by files whose content is the same from that block to the end,
+	// at the same offset, like copies of a file. Sharing identical data inside otherwise different files needs the
+	// chains kept outside the data blocks, which this layout doesn't have
+	if (sys_info->flags & FLAG_DEDUP)
+	{
+		block_info.fingerprint = Utils::Fingerprint((const char *)block, BLOCK_SIZE);
+
+		// If a block with the same content exists, take another reference to it
+		block_index = find_block(block, block_info.fingerprint);
+		if (block_index != 0)
+		{
+			block_info = get_block_info(block_index);
+			block_info.ref_count++;
+			set_block_info(block_index, &block_info);
+
+			// The existing block already points at the next block, so the reference the caller holds for the
+			// pointer of the new block isn't needed
+			if (block->next_block != 0)
+			{
+				block_info = get_block_info(block->next_block);
+				block_info.ref_count--;
+				set_block_info(block->next_block, &block_info);
+			}
+
+			return block_index;
+		}
+	}
+
+	// Write the block to a new block
+	block_index = allocate_new_block(block, goal, sys_info);
+
+	// Save the block's fingerprint so other blocks with the same content can share it
+	if (block_info.fingerprint != 0)
+	{
+		block_info.ref_count = 1;
+		set_block_info(block_index, &block_info);
+	}
+
+	return block_index;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::allocate_new_block(struct myfs_block *block, uint32_t goal, struct myfs_info *sys_info)
+{
+	uint32_t block_index = reserve_block(goal, sys_info);
+
+	// Write the block struct to the newly allocated block
+	blkdevsim->write(block_index * BLOCK_SIZE, BLOCK_SIZE, (const char *)block);
+
+	return block_index;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::reserve_block(uint32_t goal, struct myfs_info *sys_info)
+{
+	uint32_t block_index = find_free_block(goal, BLOCK_COUNT, sys_info);
+	struct myfs_block_info block_info = {0};
+
+	// If there is no empty block after the goal, look from the first data block
+	if (block_index == 0)
+	{
+		block_index = find_free_block(FIRST_DATA_BLOCK, goal, sys_info);
+	}
+
+	// If can't find an empty block, or the free blocks are kept for the write-back cache, send error
+	if (block_index == 0 || sys_info->free_blocks <= _dirty_blocks)
+	{
+		throw MyFsException("Hard drive full!");
+	}
+
+	// Allocate the block in the block's bitmap
+	mark_block_used(block_index, sys_info);
+
+	// The block is referenced only by it's new owner
+	block_info.ref_count = 1;
+	set_block_info(block_index, &block_info);
+
+	return block_index;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::find_free_block(uint32_t start, uint32_t end, const struct myfs_info *sys_info)
+{
+	// While the block is allocated, continue to the next block
+	for (uint32_t block_index = start; block_index < end; block_index++)
+	{
+		// Groups without free blocks are skipped as a whole
+		if (sys_info->group_free_blocks[block_index / BLOCKS_PER_GROUP] == 0)
+		{
+			block_index = (block_index / BLOCKS_PER_GROUP + 1) * BLOCKS_PER_GROUP - 1;
+			continue;
+		}
+
+		if (!sys_info->block_bitmap.test(block_index))
+		{
+			return block_index;
+		}
+	}
+
+	return 0;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::mark_block_used(uint32_t block_index, struct myfs_info *sys_info)
+{
+	sys_info->block_bitmap.set(block_index);
+	sys_info->free_blocks--;
+	sys_info->group_free_blocks[block_index / BLOCKS_PER_GROUP]--;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::mark_block_free(uint32_t block_index, struct myfs_info *sys_info)
+{
+	sys_info->block_bitmap.reset(block_index);
+	sys_info->free_blocks++;
+	sys_info->group_free_blocks[block_index / BLOCKS_PER_GROUP]++;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::group_first_block(uint16_t group)
+{
+	// The first group starts with the metadata blocks
+	return std::max(group * BLOCKS_PER_GROUP, (uint32_t)FIRST_DATA_BLOCK);
+}
+
+template <typename Geometry>
+uint16_t MyFsVolume<Geometry>::find_dir_group(uint16_t parent_group, const struct myfs_info *sys_info)
+{
+	uint32_t average_free_blocks = sys_info->free_blocks / BLOCK_GROUP_COUNT;
+	uint16_t group = 0, best_group = parent_group;
+	bool found = false;
+
+	// Spread the dirs: take the group with the fewest dirs out of the groups with at least the average amount of
+	// free blocks, starting after the parent's group so the sub dirs of a dir don't all go to the same group
+	for (uint32_t i = 1; i <= BLOCK_GROUP_COUNT; i++)
+	{
+		group = (parent_group + i) % BLOCK_GROUP_COUNT;
+		if (sys_info->group_free_blocks[group] < average_free_blocks || sys_info->group_free_blocks[group] == 0)
+		{
+			continue;
+		}
+
+		if (!found || sys_info->group_dirs[group] < sys_info->group_dirs[best_group])
+		{
+			best_group = group;
+			found = true;
+		}
+	}
+
+	return best_group;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::unshare_blocks(struct MyFs::myfs_entry *file_entry, uint32_t last_logical_block, struct myfs_info *sys_info)
+{
+	block_map blocks = get_block_map(file_entry->first_block);
+	struct myfs_block_info block_info;
+	struct myfs_block block;
+	size_t first_shared = 0, last_copied = 0;
+	uint32_t block_index = 0;
+
+	// Find the first shared block, every block after it is reachable from the other owners too
+	for (first_shared = 0; first_shared < blocks.size() && get_block_info(blocks[first_shared].block_index).ref_count == 1; first_shared++);
+
+	// If none of the needed blocks is shared, they can be changed in place
+	if (first_shared == blocks.size() || blocks[first_shared].logical_block > last_logical_block)
+	{
+		return;
+	}
+
+	// Find the last needed block
+	for (last_copied = first_shared; last_copied + 1 < blocks.size() && blocks[last_copied + 1].logical_block <= last_logical_block; last_copied++);
+
+	// The copies share the rest of the chain, so it gets another reference
+	if (last_copied + 1 < blocks.size())
+	{
+		block_index = blocks[last_copied + 1].block_index;
+		block_info = get_block_info(block_index);
+		block_info.ref_count++;
+		set_block_info(block_index, &block_info);
+	}
+
+	// Copy the shared blocks from the last one to the first one, so each copy's next block is already known
+	for (size_t i = last_copied + 1; i > first_shared; i--)
+	{
+		blkdevsim->read(blocks[i - 1].block_index * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
+		block.next_block = block_index;
+		block_index = allocate_new_block(&block, group_first_block(file_entry->group), sys_info);
+	}
+
+	// Link the copies instead of the shared blocks
+	if (first_shared == 0)
+	{
+		file_entry->first_block = block_index;
+	}
+	else
+	{
+		set_next_block(blocks[first_shared - 1].block_index, block_index);
+	}
+
+	// Drop the file's reference to the shared blocks
+	deallocate_block_chain(blocks[first_shared].block_index, sys_info);
+
+	// Update the file entry in the inode entries table
+	update_entry(file_entry);
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::find_block(const struct myfs_block *block, uint64_t fingerprint)
+{
+	struct myfs_block candidate;
+
+	// Go through the used blocks with the same fingerprint
+	auto range = _fingerprints.equal_range(fingerprint);
+	for (auto found = range.first; found != range.second; found++)
+	{
+		// Make sure the content really matches and it's not a hash collision
+		blkdevsim->read(found->second * BLOCK_SIZE, BLOCK_SIZE, (char *)&candidate);
+		if (memcmp(&candidate, block, BLOCK_SIZE) == 0)
+		{
+			return found->second;
+		}
+	}
+
+	return 0;
+}
+
+template <typename Geometry>
+struct MyFs::myfs_block_info MyFsVolume<Geometry>::get_block_info(uint32_t block_index)
+{
+	struct myfs_block_info block_info = {0};
+
+	// Read the block's entry from the block table
+	blkdevsim->read((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE + block_index * sizeof(block_info), sizeof(block_info), (char *)&block_info);
+
+	return block_info;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::set_block_info(uint32_t block_index, const struct MyFs::myfs_block_info *block_info)
+{
+	// Overwrite the block's entry in the block table
+	blkdevsim->write((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE + block_index * sizeof(struct myfs_block_info), sizeof(struct myfs_block_info), (const char *)block_info);
+	index_fingerprint(block_index, block_info);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::index_fingerprint(uint32_t block_index, const struct MyFs::myfs_block_info *block_info)
+{
+	// Only used blocks can be shared
+	uint64_t fingerprint = block_info->ref_count != 0 ? block_info->fingerprint : 0;
+	uint64_t &indexed = _block_fingerprints[block_index];
+
+	if (indexed == fingerprint)
+	{
+		return;
+	}
+
+	// Remove the block from it's old fingerprint
+	if (indexed != 0)
+	{
+		auto range = _fingerprints.equal_range(indexed);
+		for (auto found = range.first; found != range.second; found++)
+		{
+			if (found->second == block_index)
+			{
+				_fingerprints.erase(found);
+				break;
+			}
+		}
+	}
+
+	// And add it to the new one
+	if (fingerprint != 0)
+	{
+		_fingerprints.emplace(fingerprint, block_index);
+	}
+	indexed = fingerprint;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::load_fingerprints()
+{
+	std::vector<struct myfs_block_info> block_table(BLOCK_COUNT);
+
+	_fingerprints.clear();
+	_block_fingerprints.assign(BLOCK_COUNT, 0);
+
+	// Read the whole block table, and index every used data block that has a fingerprint
+	blkdevsim->read((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, block_table.size() * sizeof(struct myfs_block_info), (char *)block_table.data());
+	for (uint32_t i = FIRST_DATA_BLOCK; i < BLOCK_COUNT; i++)
+	{
+		index_fingerprint(i, &block_table[i]);
+	}
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::add_entry(struct MyFs::myfs_entry *file_entry, struct myfs_info *sys_info)
+{
+	struct myfs_entry entry = {0};
+	struct myfs_header header = get_header();
+	uint32_t entry_table_pointer = BLOCK_SIZE;
+
+	// While we didn't find an empty entry in the initialized part of the table
+	do
+	{
+		// Read the entry from the entries table
+		blkdevsim->read(entry_table_pointer, sizeof(entry), (char *)&entry);
+
+		// Point to the next entry
+		entry_table_pointer += sizeof(entry);
+	} while (entry.inode != 0 && entry_table_pointer < (1 + header.inode_table_blocks) * (uint32_t)BLOCK_SIZE);
+
+	// If the initialized part is full, initialize the next block of the table
+	if (entry.inode != 0)
+	{
+		// If the whole table is used, throw error
+		if (header.inode_table_blocks == INODE_TABLE_BLOCKS)
+		{
+			throw MyFsException("Inode entries table is full!");
+		}
+
+		// The new entry is the first entry of the block
+		zero_block(1 + header.inode_table_blocks);
+		entry_table_pointer = (1 + header.inode_table_blocks) * BLOCK_SIZE + sizeof(entry);
+		header.inode_table_blocks++;
+		set_header(&header);
+	}
+	sys_info->free_inodes--;
+
+	// Write the new entry
+	blkdevsim->write(entry_table_pointer - sizeof(struct myfs_entry), sizeof(struct myfs_entry), (const char *)file_entry);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::update_entry(struct MyFs::myfs_entry *file_entry)
+{
+	struct myfs_entry entry = {0};
+	uint32_t entry_table_pointer = BLOCK_SIZE;
+
+	// While we didn't find the entry in the table
+	do
+	{
+		// Read the entry from the entries table
+		blkdevsim->read(entry_table_pointer, sizeof(entry), (char *)&entry);
+
+		// Point to the next entry
+		entry_table_pointer += sizeof(entry);
+	} while (entry.inode != file_entry->inode && entry_table_pointer < (1 + get_header().inode_table_blocks) * (uint32_t)BLOCK_SIZE);
+
+	// If the entry wasn't found, throw error
+	if (entry.inode != file_entry->inode)
+	{
+		throw MyFsException("Inode entry wasn't found!");
+	}
+
+	// Write the new entry, the handles of the file have to load it again
+	blkdevsim->write(entry_table_pointer - sizeof(struct myfs_entry), sizeof(struct myfs_entry), (const char *)file_entry);
+	invalidate_handles(file_entry->inode);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::remove_entry(uint32_t inode, struct myfs_info *sys_info)
+{
+	struct myfs_entry entry = {0}, empty_entry = {0};
+	uint32_t entry_table_pointer = BLOCK_SIZE;
+
+	// While we didn't find the entry in the table
+	do
+	{
+		// Read the entry from the entries table
+		blkdevsim->read(entry_table_pointer, sizeof(entry), (char *)&entry);
+
+		// Point to the next entry
+		entry_table_pointer += sizeof(entry);
+	} while (entry.inode != inode && entry_table_pointer < (1 + get_header().inode_table_blocks) * (uint32_t)BLOCK_SIZE);
+
+	// If the entry wasn't found, throw error
+	if (entry.inode != inode)
+	{
+		throw MyFsException("Inode entry wasn't found!");
+	}
+
+	// Clear the entry so it can be used by a new file
+	blkdevsim->write(entry_table_pointer - sizeof(struct myfs_entry), sizeof(struct myfs_entry), (const char *)&empty_entry);
+	sys_info->free_inodes++;
+	sys_info->group_dirs[entry.group] -= entry.is_dir ? 1 : 0;
+
+	// The access hint and the cached content belonged to the removed file, and it's handles can't be used anymore
+	_access_hints.erase(inode);
+	discard_dirty(inode);
+	invalidate_handles(inode);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::truncate_file(struct MyFs::myfs_entry *file_entry, uint32_t size, struct myfs_info *sys_info)
+{
+	uint32_t new_blocks = Utils::CalcAmountOfBlocksForFile<Geometry>(size), last_block = 0;
+	block_map blocks;
+	struct myfs_block_info block_info;
+	std::string zeros;
+
+	// If the file grows, the new part is a hole so only the size changes
+	if (size >= file_entry->size)
+	{
+		file_entry->size = size;
+		update_entry(file_entry);
+		return;
+	}
+
+	// Copy the shared blocks that are kept, so the other owners of them aren't affected
+	if (new_blocks != 0)
+	{
+		unshare_blocks(file_entry, new_blocks - 1, sys_info);
+	}
+
+	// Find the last allocated block that is kept
+	blocks = get_block_map(file_entry->first_block);
+	for (last_block = 0; last_block < blocks.size() && blocks[last_block].logical_block < new_blocks; last_block++);
+
+	// If no block is kept, reclaim the whole chain
+	if (last_block == 0)
+	{
+		reclaim_block_chain(file_entry->first_block, sys_info);
+		file_entry->first_block = 0;
+	}
+	else
+	{
+		// Cut the chain after the last kept block and reclaim the rest of it
+		if (last_block < blocks.size())
+		{
+			set_next_block(blocks[last_block - 1].block_index, 0);
+			reclaim_block_chain(blocks[last_block].block_index, sys_info);
+		}
+
+		// Clear the part of the last kept block after the new end, so it's read as zeros if the file grows again
+		if (blocks[last_block - 1].logical_block == new_blocks - 1 && size % BLOCK_DATA_SIZE != 0)
+		{
+			zeros.assign(BLOCK_DATA_SIZE - size % BLOCK_DATA_SIZE, 0);
+			blkdevsim->write(blocks[last_block - 1].block_index * BLOCK_SIZE + size % BLOCK_DATA_SIZE, zeros.size(), zeros.c_str());
+			_data_generation++;
+
+			// The content of the block changed so it's fingerprint is no longer valid
+			block_info = get_block_info(blocks[last_block - 1].block_index);
+			block_info.fingerprint = 0;
+			set_block_info(blocks[last_block - 1].block_index, &block_info);
+		}
+	}
+
+	// Set the size of the file
+	file_entry->size = size;
+
+	// Update the file entry in the inode entries table
+	update_entry(file_entry);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::update_file(struct MyFs::myfs_entry *file_entry, char *data, uint32_t size, struct myfs_info *sys_info_ptr)
+{
+	uint32_t deallocate_block_index = 0;
+	int old_blocks = Utils::CalcAmountOfBlocksForFile<Geometry>(file_entry->size), new_blocks = Utils::CalcAmountOfBlocksForFile<Geometry>(size);
+	struct myfs_info *sys_info = sys_info_ptr;
+	struct myfs_block_info block_info = {0};
+	block_map old_chain = get_block_map(file_entry->first_block);
+	std::vector<struct myfs_block> blocks, old_content;
+	std::vector<struct io_request> requests;
+
+	// If no sys info passed, get it
+	if (sys_info == nullptr)
+	{
+		// Allocate the struct
+		sys_info = new struct myfs_info();
+
+		// Get the file system info struct
+		blkdevsim->read(sizeof(struct myfs_header), sizeof(struct myfs_info), (char *)sys_info);
+	}
+
+	// If the file can't be rewritten in place (it's empty, it's going to be empty, it has holes, it's blocks
+	// are shared with other files or dedup is enabled), write a new block chain and release the old one
+	if (old_blocks == 0 || new_blocks == 0 || (sys_info->flags & FLAG_DEDUP) ||
+		is_block_chain_shared(file_entry->first_block) || old_chain.size() != (size_t)old_blocks)
+	{
+		deallocate_block_index = file_entry->first_block;
+
+		// Write the new content
+		file_entry->first_block = write_block_chain(data, size, 0, group_first_block(file_entry->group), sys_info);
+
+		// Release the old content
+		deallocate_block_chain(deallocate_block_index, sys_info);
+	}
+	// If the file has blocks on memory and has changed, rewrite all the blocks
+	else
+	{
+		// The old and the new content have the first blocks in common
+		blocks.resize(std::min(old_blocks, new_blocks));
+		old_content.resize(blocks.size());
+
+		// Set the common blocks, each keeps it's place in the chain
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			// Copy the block's data and clear the rest of it
+			memset(&blocks[i], 0, sizeof(struct myfs_block));
+			memcpy(blocks[i].data, data + i * BLOCK_DATA_SIZE, size - i * BLOCK_DATA_SIZE < BLOCK_DATA_SIZE ? size - i * BLOCK_DATA_SIZE : BLOCK_DATA_SIZE);
+			blocks[i].logical_block = i;
+			blocks[i].next_block = i + 1 < old_chain.size() ? old_chain[i + 1].block_index : 0;
+
+			// Read the old block in the batch
+			requests.push_back({(int)(old_chain[i].block_index * BLOCK_SIZE), BLOCK_SIZE, (char *)&old_content[i]});
+		}
+		blkdevsim->read_batch(requests);
+		requests.clear();
+
+		// If the file grows, append the rest of the content as a new chain, right after the last block if there is room
+		if (new_blocks > old_blocks)
+		{
+			blocks.back().next_block = write_block_chain(data + old_blocks * BLOCK_DATA_SIZE, size - old_blocks * BLOCK_DATA_SIZE, old_blocks, old_chain.back().block_index + 1, sys_info);
+		}
+		// If the file shrinks, cut the chain and save the rest of it for de-allocation
+		else if (new_blocks < old_blocks)
+		{
+			deallocate_block_index = blocks.back().next_block;
+			blocks.back().next_block = 0;
+		}
+
+		// Overwrite only the blocks that changed, so rewriting a mostly identical file writes only the differences
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			if (memcmp(&blocks[i], &old_content[i], sizeof(struct myfs_block)) == 0)
+			{
+				continue;
+			}
+
+			// Overwrite the block in the batch
+			requests.push_back({(int)(old_chain[i].block_index * BLOCK_SIZE), BLOCK_SIZE, (char *)&blocks[i]});
+
+			// The content of the block changed so it's fingerprint is no longer valid
+			block_info.ref_count = 1;
+			set_block_info(old_chain[i].block_index, &block_info);
+		}
+
+		// Write the changed blocks in a single batch, so a striped device writes them in parallel
+		if (!requests.empty())
+		{
+			blkdevsim->write_batch(requests);
+			_data_generation++;
+		}
+
+		// If there are unused allocated blocks, de-allocate them
+		deallocate_block_chain(deallocate_block_index, sys_info);
+	}
+
+	// Set the size of the file
+	file_entry->size = size;
+
+	// Update the file entry in the inode entries table
+	update_entry(file_entry);
+
+	// If no sys info was passed, write it to the disk
+	if (sys_info_ptr == nullptr)
+	{
+		// Overwrite the file system info structure
+		blkdevsim->write(sizeof(struct myfs_header), sizeof(struct myfs_info), (const char *)sys_info);
+
+		// Release memory
+		delete sys_info;
+	}
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::write_block_chain(const char *data, uint32_t size, uint32_t first_logical_block, uint32_t goal, struct myfs_info *sys_info)
+{
+	uint32_t block_index = 0, block_size = 0, run_start = 0;
+	struct myfs_block block;
+	std::vector<struct myfs_block> blocks;
+	std::vector<uint32_t> block_indexes;
+	std::vector<struct io_request> requests;
+
+	// Without dedup the blocks don't depend on each other, so they are reserved in order and written in a single batch
+	if (!(sys_info->flags & FLAG_DEDUP))
+	{
+		// Copy the blocks that aren't holes
+		for (uint32_t i = 0; i < (uint32_t)Utils::CalcAmountOfBlocksForFile<Geometry>(size); i++)
+		{
+			block_size = size - i * BLOCK_DATA_SIZE < BLOCK_DATA_SIZE ? size - i * BLOCK_DATA_SIZE : BLOCK_DATA_SIZE;
+			if (Utils::IsZero(data + i * BLOCK_DATA_SIZE, block_size))
+			{
+				continue;
+			}
+
+			memset(&block, 0, sizeof(block));
+			block.logical_block = first_logical_block + i;
+			memcpy(block.data, data + i * BLOCK_DATA_SIZE, block_size);
+			blocks.push_back(block);
+		}
+
+		// Check there is room for all the blocks before any of them is reserved, so nothing is left half written
+		if (blocks.size() + _dirty_blocks > sys_info->free_blocks)
+		{
+			throw MyFsException("Hard drive full!");
+		}
+
+		// Place the blocks in the first run of free blocks from the goal that holds all of them, or in the first free
+		// blocks from the goal if there is none
+		run_start = blocks.empty() ? 0 : find_free_run(blocks.size(), goal, sys_info);
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			block_indexes.push_back(reserve_block(run_start != 0 ? run_start : goal, sys_info));
+		}
+
+		// Chain the blocks, the chain goes forward on the device
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			blocks[i].next_block = i + 1 < blocks.size() ? block_indexes[i + 1] : 0;
+			requests.push_back({(int)(block_indexes[i] * BLOCK_SIZE), BLOCK_SIZE, (char *)&blocks[i]});
+		}
+		blkdevsim->write_batch(requests);
+
+		return blocks.empty() ? 0 : block_indexes[0];
+	}
+
+	// Go through the blocks from the last one to the first one, so each block's next block is already known
+	for (int i = Utils::CalcAmountOfBlocksForFile<Geometry>(size) - 1; i >= 0; i--)
+	{
+		block_size = size - i * BLOCK_DATA_SIZE < BLOCK_DATA_SIZE ? size - i * BLOCK_DATA_SIZE : BLOCK_DATA_SIZE;
+
+		// Blocks of zeros are left as holes
+		if (Utils::IsZero(data + i * BLOCK_DATA_SIZE, block_size))
+		{
+			continue;
+		}
+
+		// Set the next block's index and the block's position in the file
+		memset(&block, 0, sizeof(block));
+		block.next_block = block_index;
+		block.logical_block = first_logical_block + i;
+
+		// Copy the current block's data to the block's struct
+		memcpy(block.data, data + i * BLOCK_DATA_SIZE, block_size);
+
+		// Allocate the block and get it's position
+		block_index = allocate_block(&block, goal, sys_info);
+	}
+
+	return block_index;
+}
+
+template <typename Geometry>
+bool MyFsVolume<Geometry>::is_block_chain_shared(uint32_t block_chain_head)
+{
+	uint32_t block_index = block_chain_head;
+
+	// While we didn't reach the end of the block chain
+	while (block_index != 0)
+	{
+		// If the block has more than one reference, the rest of the chain is shared
+		if (get_block_info(block_index).ref_count > 1)
+		{
+			return true;
+		}
+
+		// Read the next block field of the current block and move to the next block
+		blkdevsim->read(block_index * BLOCK_SIZE + offsetof(struct myfs_block, next_block), sizeof(block_index), (char *)&block_index);
+	}
+
+	return false;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::deallocate_block_chain(uint32_t block_chain_head, struct myfs_info *sys_info)
+{
+	uint32_t block_index = block_chain_head;
+
+	// Release the blocks until the end of the chain
+	while (block_index != 0)
+	{
+		block_index = release_blocks(block_index, BLOCK_COUNT, sys_info);
+	}
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::release_blocks(uint32_t block_chain_head, uint32_t max_blocks, struct myfs_info *sys_info)
+{
+	uint32_t block_index = block_chain_head;
+	struct myfs_block_info block_info;
+	struct myfs_block block;
+
+	// While we didn't reach the end of the block chain or the maximum amount of blocks
+	for (uint32_t i = 0; i < max_blocks && block_index != 0; i++)
+	{
+		// Drop the reference to the current block
+		block_info = get_block_info(block_index);
+		block_info.ref_count--;
+
+		// If the block is still referenced, the rest of the chain is still in use
+		if (block_info.ref_count != 0)
+		{
+			set_block_info(block_index, &block_info);
+			return 0;
+		}
+
+		// Read the current block
+		blkdevsim->read(block_index * BLOCK_SIZE, sizeof(block), (char *)&block);
+
+		// De-allocate the block
+		block_info.fingerprint = 0;
+		set_block_info(block_index, &block_info);
+		mark_block_free(block_index, sys_info);
+		_data_generation++;
+
+		// Move to the next block
+		block_index = block.next_block;
+	}
+
+	// Return the rest of the chain which wasn't released
+	return block_index;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::reclaim_block_chain(uint32_t block_chain_head, struct myfs_info *sys_info)
+{
+	// Empty chains have nothing to reclaim
+	if (block_chain_head == 0)
+	{
+		return;
+	}
+
+	// If the reclaim queue is full, release the chain right away
+	if (sys_info->reclaim_count == RECLAIM_QUEUE_SIZE)
+	{
+		deallocate_block_chain(block_chain_head, sys_info);
+		return;
+	}
+
+	// Add the chain to the reclaim queue and wake up the reclaimer
+	sys_info->reclaim_queue[sys_info->reclaim_count++] = block_chain_head;
+	_reclaim_cond.notify_one();
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::reclaimer_loop()
+{
+	std::unique_lock<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+	uint32_t *block_chain_head = nullptr;
+
+	while (!_stop_reclaimer)
+	{
+		// Get the file system info struct
+		blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+		// If there is nothing to reclaim, wait for a chain to be queued
+		if (sys_info.reclaim_count == 0)
+		{
+			_reclaim_cond.wait(lock);
+			continue;
+		}
+
+		// Release a batch of blocks from the last queued chain, and keep the rest of it in the queue
+		block_chain_head = &sys_info.reclaim_queue[sys_info.reclaim_count - 1];
+		*block_chain_head = release_blocks(*block_chain_head, RECLAIM_BATCH_BLOCKS, &sys_info);
+		if (*block_chain_head == 0)
+		{
+			sys_info.reclaim_count--;
+		}
+
+		// Overwrite the file system info structure
+		blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+
+		// Let other operations run between the batches
+		lock.unlock();
+		std::this_thread::yield();
+		lock.lock();
+	}
+}
+
+template <typename Geometry>
+bool MyFsVolume<Geometry>::cache_content(const struct MyFs::myfs_entry &file_entry, const std::string &content)
+{
+	struct myfs_info sys_info = {0};
+	uint32_t dirty_blocks = _dirty_blocks + Utils::CalcAmountOfBlocksForFile<Geometry>(content.size());
+	auto dirty = _dirty_files.find(file_entry.inode);
+
+	// Content that doesn't fit in the cache is written right away
+	if (content.size() > WRITEBACK_MAX_BYTES)
+	{
+		return false;
+	}
+
+	// The blocks of all the cached contents are kept free for their write back, other allocations leave them alone
+	if (dirty != _dirty_files.end())
+	{
+		dirty_blocks -= Utils::CalcAmountOfBlocksForFile<Geometry>(dirty->second.content.size());
+	}
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+	if (dirty_blocks > sys_info.free_blocks)
+	{
+		return false;
+	}
+
+	// Replace the cached content, the file stays as old as the first content that wasn't written back
+	if (dirty == _dirty_files.end())
+	{
+		dirty = _dirty_files.emplace(file_entry.inode, myfs_dirty_file{std::string(), std::chrono::steady_clock::now(), false}).first;
+		_writeback_cond.notify_one();
+	}
+	_dirty_bytes += content.size() - dirty->second.content.size();
+	_dirty_blocks = dirty_blocks;
+	dirty->second.content = content;
+	dirty->second.failed = false;
+
+	// If the cache is over it's limit, write back the oldest files until it isn't
+	while (_dirty_bytes > WRITEBACK_MAX_BYTES)
+	{
+		// Files that failed are left for the next operation on them, if all of them failed the cache stays over it's limit
+		auto oldest = _dirty_files.end();
+		for (auto current = _dirty_files.begin(); current != _dirty_files.end(); current++)
+		{
+			if (!current->second.failed && (oldest == _dirty_files.end() || current->second.dirtied < oldest->second.dirtied))
+			{
+				oldest = current;
+			}
+		}
+		if (oldest == _dirty_files.end())
+		{
+			break;
+		}
+
+		// The content is already cached, so a failure to write back another file doesn't fail this one, it's marked like the flusher does
+		try
+		{
+			struct myfs_entry oldest_entry = get_file_entry(oldest->first);
+			write_back(&oldest_entry, nullptr);
+		}
+		catch (const MyFsException &)
+		{
+			oldest->second.failed = true;
+		}
+	}
+
+	return true;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::discard_dirty(uint32_t inode)
+{
+	auto dirty = _dirty_files.find(inode);
+
+	// Files that aren't cached have nothing to discard
+	if (dirty == _dirty_files.end())
+	{
+		return;
+	}
+
+	_dirty_bytes -= dirty->second.content.size();
+	_dirty_blocks -= Utils::CalcAmountOfBlocksForFile<Geometry>(dirty->second.content.size());
+	_dirty_files.erase(dirty);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::write_back(struct MyFs::myfs_entry *file_entry, struct myfs_info *sys_info)
+{
+	auto dirty = _dirty_files.find(file_entry->inode);
+
+	// Files that aren't cached are already on the device
+	if (dirty == _dirty_files.end())
+	{
+		return;
+	}
+
+	// The blocks kept free for the content are the ones it's written to
+	std::string &content = dirty->second.content;
+	_dirty_blocks -= Utils::CalcAmountOfBlocksForFile<Geometry>(content.size());
+
+	// Allocate the file's blocks and write the content, the whole content is known so the blocks are placed together
+	try
+	{
+		update_file(file_entry, &content[0], content.size(), sys_info);
+	}
+	catch (...)
+	{
+		// The content stays cached with it's blocks kept free, so it's written back again later
+		_dirty_blocks += Utils::CalcAmountOfBlocksForFile<Geometry>(content.size());
+		throw;
+	}
+
+	// The content is on the device, so it leaves the cache
+	_dirty_bytes -= content.size();
+	_dirty_files.erase(dirty);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::retry_write_back(struct MyFs::myfs_entry *file_entry)
+{
+	auto dirty = _dirty_files.find(file_entry->inode);
+
+	// If the flusher failed to write back the file, write it back again so the error reaches the caller
+	if (dirty != _dirty_files.end() && dirty->second.failed)
+	{
+		write_back(file_entry, nullptr);
+	}
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::write_back_all()
+{
+	struct myfs_info sys_info = {0};
+	struct myfs_entry file;
+	std::vector<std::pair<std::chrono::steady_clock::time_point, uint32_t>> inodes;
+	std::string error;
+
+	// Nothing to write back
+	if (_dirty_files.empty())
+	{
+		return;
+	}
+
+	// Write back the files in the order they were dirtied
+	for (auto &dirty : _dirty_files)
+	{
+		inodes.push_back(std::make_pair(dirty.second.dirtied, dirty.first));
+	}
+	std::sort(inodes.begin(), inodes.end());
+
+	// Get the file system info struct once for all the files
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	// A file that fails stays cached, and the rest of the files are still written back
+	for (auto &inode : inodes)
+	{
+		try
+		{
+			file = get_file_entry(inode.second);
+			write_back(&file, &sys_info);
+		}
+		catch (const MyFsException &e)
+		{
+			error = error.empty() ? e.what() : error;
+		}
+	}
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+
+	// Report the first failure once the files that could be written are saved
+	if (!error.empty())
+	{
+		throw MyFsException(error);
+	}
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::flusher_loop()
+{
+	std::unique_lock<std::recursive_mutex> lock(_lock);
+	std::chrono::steady_clock::time_point expires;
+	struct myfs_entry file;
+	uint32_t inode = 0;
+
+	while (!_stop_flusher)
+	{
+		// Find the oldest file, files that failed are left for the next operation on them
+		auto oldest = _dirty_files.end();
+		for (auto dirty = _dirty_files.begin(); dirty != _dirty_files.end(); dirty++)
+		{
+			if (!dirty->second.failed && (oldest == _dirty_files.end() || dirty->second.dirtied < oldest->second.dirtied))
+			{
+				oldest = dirty;
+			}
+		}
+
+		// If nothing is waiting to be written back, wait for a file to be dirtied
+		if (oldest == _dirty_files.end())
+		{
+			_writeback_cond.wait(lock);
+			continue;
+		}
+
+		// Wait until the oldest file was dirty for long enough, it may be written back by someone else meanwhile
+		expires = oldest->second.dirtied + std::chrono::milliseconds(WRITEBACK_DELAY_MS);
+		if (std::chrono::steady_clock::now() < expires)
+		{
+			_writeback_cond.wait_until(lock, expires);
+			continue;
+		}
+
+		// Write back the file, if it fails the content stays cached and the next sync or operation on the file tries
+		// again and gets the error
+		inode = oldest->first;
+		try
+		{
+			file = get_file_entry(inode);
+			write_back(&file, nullptr);
+		}
+		catch (const MyFsException &)
+		{
+			auto failed = _dirty_files.find(inode);
+			if (failed != _dirty_files.end())
+			{
+				failed->second.failed = true;
+			}
+		}
+
+		// Let other operations run between the files
+		lock.unlock();
+		std::this_thread::yield();
+		lock.lock();
+	}
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::check_new_name(const struct MyFs::myfs_entry &dir, std::string_view file_name)
+{
+	// If the name can't be saved in a record, throw error
+	if (file_name.length() == 0 || file_name.length() > MAX_NAME_LENGTH || file_name.find('/') != std::string_view::npos)
+	{
+		throw MyFsException("Invalid file name '" + std::string(file_name) + "'!");
+	}
+
+	// If a file with the file name already exists throw error
+	if (find_dir_entry(dir, file_name).inode != 0)
+	{
+		throw MyFsException("File with the name '" + std::string(file_name) + "' already exists!");
+	}
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::add_dir_entry(struct MyFs::myfs_entry *dir, struct MyFs::myfs_entry *file_entry, std::string_view file_name, struct myfs_info *sys_info)
+{
+	struct myfs_dir_entry file_dir_entry;
+	struct myfs_dir *dir_ptr;
+	char *new_dir_data = nullptr;
+	dir_entries entries;
+
+	// Make sure the name can be added to the dir
+	check_new_name(*dir, file_name);
+
+	// Set the dir entry properties
+	file_dir_entry.inode = file_entry->inode;
+	file_dir_entry.type = file_entry->is_dir ? ENTRY_TYPE_DIR : ENTRY_TYPE_FILE;
+	file_dir_entry.name = file_name;
+
+	// If the dir is indexed, add the entry to it's leaf
+	if (dir->flags & ENTRY_FLAG_INDEXED_DIR)
+	{
+		add_indexed_dir_entry(dir, file_dir_entry, sys_info);
+		return;
+	}
+
+	// If the dir grows too big, switch it to an indexed dir
+	if (dir->size + sizeof(struct myfs_dir_record) + file_name.length() > INDEXED_DIR_THRESHOLD)
+	{
+		entries = get_dir_entries(*dir);
+		entries.push_back(file_dir_entry);
+		build_dir_index(dir, entries, sys_info);
+		return;
+	}
+
+	// Read the existing dir data into the new dir data array
+	new_dir_data = new char[dir->size + sizeof(struct myfs_dir_record) + file_name.length()];
+	get_file(*dir, new_dir_data);
+
+	// Increase the file amount
+	dir_ptr = (struct myfs_dir *)new_dir_data;
+	dir_ptr->amount++;
+
+	// Append the entry's record
+	pack_dir_entry(new_dir_data + dir->size, file_dir_entry);
+
+	// Update the dir file
+	update_file(dir, new_dir_data, dir->size + sizeof(struct myfs_dir_record) + file_name.length(), sys_info);
+
+	// Release the memory allocated for the dir data
+	delete[] new_dir_data;
+}
+
+template <typename Geometry>
+struct MyFs::myfs_entry MyFsVolume<Geometry>::allocate_file(bool is_dir, uint16_t group, struct myfs_info *sys_info_ptr)
+{
+	struct myfs_entry file_entry = {0};
+	struct myfs_info *sys_info = sys_info_ptr;
+
+	// If no sys info passed, get it
+	if (sys_info == nullptr)
+	{
+		// Allocate the struct
+		sys_info = new struct myfs_info();
+
+		// Get the file system info struct
+		blkdevsim->read(sizeof(struct myfs_header), sizeof(struct myfs_info), (char *)sys_info);
+	}
+
+	// Increase the inode counter
+	sys_info->inode_count += 1;
+
+	// Set file's properties
+	file_entry.inode = sys_info->inode_count;
+	file_entry.is_dir = is_dir;
+	file_entry.group = group;
+
+	// Count the dirs of every group, so new dirs go to the groups with the fewest
+	if (is_dir)
+	{
+		sys_info->group_dirs[group]++;
+	}
+
+	// Add the entry to inode table
+	add_entry(&file_entry, sys_info);
+
+	// If no sys info was passed, write it to the disk
+	if (sys_info_ptr == nullptr)
+	{
+		// Overwrite the file system info structure
+		blkdevsim->write(sizeof(struct myfs_header), sizeof(struct myfs_info), (const char *)sys_info);
+
+		// Release memory
+		delete sys_info;
+	}
+
+	return file_entry;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::init_dir(struct MyFs::myfs_entry *dir_entry, struct MyFs::myfs_entry *prev_dir_entry, struct myfs_info *sys_info)
+{
+	struct myfs_dir dir = {0};
+	struct myfs_dir_entry current_dir = {0}, prev_dir = {0};
+	struct myfs_block block = {{0}};
+	uint32_t dir_size = sizeof(dir);
+
+	// Set the folder to have 2 entries(current folder and prev folder)
+	dir.amount = 2;
+
+	// Set current dir entry properties
+	current_dir.inode = dir_entry->inode;
+	current_dir.type = ENTRY_TYPE_DIR;
+	current_dir.name = ".";
+
+	// Set prev dir entry properties
+	prev_dir.inode = prev_dir_entry->inode;
+	prev_dir.type = ENTRY_TYPE_DIR;
+	prev_dir.name = "..";
+
+	// Copy all dir data
+	memcpy(block.data, &dir, sizeof(dir));
+	dir_size += pack_dir_entry(block.data + dir_size, current_dir);
+	dir_size += pack_dir_entry(block.data + dir_size, prev_dir);
+
+	// Allocate the block for the dir in it's group
+	dir_entry->first_block = allocate_block(&block, group_first_block(dir_entry->group), sys_info);
+	dir_entry->size = dir_size;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::create_dir(std::string_view path, std::string_view dir_name)
+{
+	struct myfs_entry parent_dir, dir;
+	struct myfs_info sys_info = {0};
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	// Get the dir from the path
+	parent_dir = get_dir(path);
+
+	// Check the name before anything is allocated for the dir
+	check_new_name(parent_dir, dir_name);
+
+	// Allocate the dir in a group of it's own, so the dirs are spread over the device
+	dir = allocate_file(true, find_dir_group(parent_dir.group, &sys_info), &sys_info);
+
+	// Initialize the directory
+	init_dir(&dir, &parent_dir, &sys_info);
+
+	// Update the dir's entry
+	update_entry(&dir);
+
+	// Add a dir entry for the dir in the parent dir file
+	add_dir_entry(&parent_dir, &dir, dir_name, &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::create_file(std::string_view path, std::string_view file_name)
+{
+	struct myfs_entry dir, file;
+	struct myfs_info sys_info = {0};
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	// Get the dir from the path
+	dir = get_dir(path);
+
+	// Check the name before anything is allocated for the file
+	check_new_name(dir, file_name);
+
+	// Allocate the file, it's placed in the group of it's dir
+	file = allocate_file(false, dir.group, &sys_info);
+
+	// Add a dir entry for the file in the dir file
+	add_dir_entry(&dir, &file, file_name, &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+}
+
+template <typename Geometry>
+struct MyFs::myfs_entry MyFsVolume<Geometry>::find_file(std::string_view path, std::string_view file_name)
+{
+	struct myfs_dir_entry file_entry;
+	struct myfs_entry dir, file;
+
+	// Get the dir from the path
+	dir = get_dir(path);
+
+	// Try to find the file dir entry
+	file_entry = find_dir_entry(dir, file_name);
+
+	// If the file isn't found, throw error
+	if (file_entry.inode == 0)
+	{
+		throw MyFsException("Unable to find the file '" + std::string(file_name) + "'!");
+	}
+
+	// Try to get the file entry
+	file = get_file_entry(file_entry.inode);
+	if (file.inode == 0)
+	{
+		throw MyFsException("An error occurred while searching the file's entry!");
+	}
+
+	// If the file is a dir, throw error
+	if (file.is_dir)
+	{
+		throw MyFsException("Unable to find the file '" + std::string(file_name) + "'!");
+	}
+
+	return file;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::write_file(std::string_view path, std::string_view file_name, const std::string &content)
+{
+	struct myfs_entry file;
+
+	// Find the file's entry
+	file = find_file(path, file_name);
+
+	// Keep the content in the write-back cache if it fits
+	if (cache_content(file, content))
+	{
+		return;
+	}
+
+	// Update the file with it's new content, which replaces the cached one
+	discard_dirty(file.inode);
+	update_file(&file, (char *)content.c_str(), content.size(), nullptr);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::write_file_range(struct MyFs::myfs_entry *file_entry, uint32_t offset, const char *data, uint32_t size, struct myfs_info *sys_info)
+{
+	uint32_t end = offset + size, block_start = 0, range_start = 0, range_end = 0, block_index = 0;
+	size_t map_pointer = 0;
+	char *file_data = nullptr;
+	block_map blocks;
+	struct myfs_mapped_block mapped_block;
+	struct myfs_block_info block_info = {0};
+	struct myfs_block block;
+
+	// Writing nothing doesn't change the file
+	if (size == 0)
+	{
+		return;
+	}
+
+	// If the range only adds whole blocks after the end of the file, link a new chain after the last block
+	if (offset % BLOCK_DATA_SIZE == 0 && offset >= file_entry->size)
+	{
+		append_blocks(file_entry, offset, data, size, sys_info);
+		return;
+	}
+
+	// If dedup is enabled, rewrite the whole file with the range in it, so the new blocks are deduplicated
+	if (sys_info->flags & FLAG_DEDUP)
+	{
+		file_data = new char[std::max(end, file_entry->size)];
+
+		// Get the current content, anything after the end of the file is zeros
+		memset(file_data, 0, std::max(end, file_entry->size));
+		get_file(*file_entry, file_data);
+
+		// Put the range in the content and rewrite the file
+		memcpy(file_data + offset, data, size);
+		update_file(file_entry, file_data, std::max(end, file_entry->size), sys_info);
+
+		// Release the memory allocated for the file data
+		delete[] file_data;
+		return;
+	}
+
+	// Copy the shared blocks that are going to change, so the other owners of them aren't affected
+	unshare_blocks(file_entry, (end - 1) / BLOCK_DATA_SIZE, sys_info);
+
+	// Get the allocated blocks of the file
+	blocks = get_block_map(file_entry->first_block);
+
+	// Go through the logical blocks of the range
+	for (uint32_t logical_block = offset / BLOCK_DATA_SIZE; logical_block <= (end - 1) / BLOCK_DATA_SIZE; logical_block++)
+	{
+		// Get the part of the range that is inside the block
+		block_start = logical_block * BLOCK_DATA_SIZE;
+		range_start = std::max(offset, block_start);
+		range_end = std::min(end, block_start + (uint32_t)BLOCK_DATA_SIZE);
+
+		// Skip the allocated blocks before the logical block
+		while (map_pointer < blocks.size() && blocks[map_pointer].logical_block < logical_block)
+		{
+			map_pointer++;
+		}
+
+		// If the block is allocated, overwrite the range inside it
+		if (map_pointer < blocks.size() && blocks[map_pointer].logical_block == logical_block)
+		{
+			blkdevsim->write(blocks[map_pointer].block_index * BLOCK_SIZE + (range_start - block_start), range_end - range_start, data + (range_start - offset));
+			_data_generation++;
+
+			// The content of the block changed so it's fingerprint is no longer valid
+			block_info.ref_count = 1;
+			set_block_info(blocks[map_pointer].block_index, &block_info);
+		}
+		// If the block is a hole and the range has data, fill the hole
+		else if (!Utils::IsZero(data + (range_start - offset), range_end - range_start))
+		{
+			// Set the block to be linked before the next allocated block
+			memset(&block, 0, sizeof(block));
+			memcpy(block.data + (range_start - block_start), data + (range_start - offset), range_end - range_start);
+			block.logical_block = logical_block;
+			block.next_block = map_pointer < blocks.size() ? blocks[map_pointer].block_index : 0;
+
+			// Allocate the block, right after the previous allocated block if it's free
+			block_index = allocate_block(&block, map_pointer == 0 ? group_first_block(file_entry->group) : blocks[map_pointer - 1].block_index + 1, sys_info);
+
+			// Link the block after the previous allocated block, or as the first block
+			if (map_pointer == 0)
+			{
+				file_entry->first_block = block_index;
+			}
+			else
+			{
+				set_next_block(blocks[map_pointer - 1].block_index, block_index);
+			}
+
+			// Add the block to the map
+			mapped_block.logical_block = logical_block;
+			mapped_block.block_index = block_index;
+			blocks.insert(blocks.begin() + map_pointer, mapped_block);
+		}
+	}
+
+	// Set the size of the file
+	file_entry->size = std::max(end, file_entry->size);
+
+	// Update the file entry in the inode entries table
+	update_entry(file_entry);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::append_blocks(struct MyFs::myfs_entry *file_entry, uint32_t offset, const char *data, uint32_t size, struct myfs_info *sys_info)
+{
+	block_map blocks = get_block_map(file_entry->first_block);
+	uint32_t block_chain_head = 0;
+
+	// The last block's next block changes, so it can't be shared with other files
+	if (!blocks.empty())
+	{
+		unshare_blocks(file_entry, blocks.back().logical_block, sys_info);
+		blocks = get_block_map(file_entry->first_block);
+	}
+
+	// Write the new blocks after the last block if there is room, they are deduplicated if dedup is enabled
+	block_chain_head = write_block_chain(data, size, offset / BLOCK_DATA_SIZE, blocks.empty() ? group_first_block(file_entry->group) : blocks.back().block_index + 1, sys_info);
+
+	// Link the new blocks after the last block, or as the first block
+	if (block_chain_head != 0 && blocks.empty())
+	{
+		file_entry->first_block = block_chain_head;
+	}
+	else if (block_chain_head != 0)
+	{
+		set_next_block(blocks.back().block_index, block_chain_head);
+	}
+
+	// Set the size of the file
+	file_entry->size = offset + size;
+
+	// Update the file entry in the inode entries table
+	update_entry(file_entry);
+}
+
+template <typename Geometry>
+std::string MyFsVolume<Geometry>::read_file(std::string_view path, std::string_view file_name)
+{
+	std::string content;
+	struct myfs_entry file;
+
+	// Find the file's entry
+	file = find_file(path, file_name);
+	retry_write_back(&file);
+
+	// Content that wasn't written back is read from the cache
+	auto dirty = _dirty_files.find(file.inode);
+	if (dirty != _dirty_files.end())
+	{
+		return dirty->second.content;
+	}
+
+	// Get the file's content right into the string
+	content.resize(file.size);
+	if (file.size != 0)
+	{
+		get_file(file, &content[0]);
+	}
+
+	// Return the string with the content
+	return content;
+}
+
+template <typename Geometry>
+std::string MyFsVolume<Geometry>::read_file(std::string_view path, std::string_view file_name, std::unique_lock<std::recursive_mutex> &lock)
+{
+	std::string content;
+	struct myfs_entry file;
+	uint8_t hint = ACCESS_NORMAL;
+	uint64_t data_generation = 0;
+	block_map blocks;
+	std::vector<struct io_request> requests;
+
+	// Find the file's blocks while the file system is locked, content that wasn't written back is read from the cache
+	file = find_file(path, file_name);
+	retry_write_back(&file);
+	auto dirty = _dirty_files.find(file.inode);
+	if (dirty != _dirty_files.end())
+	{
+		return dirty->second.content;
+	}
+	hint = get_access_hint(file.inode);
+	blocks = get_block_map(file.first_block, hint);
+	data_generation = _data_generation;
+
+	// Holes in the file aren't in the block chain, so they are read as zeros
+	content.resize(file.size);
+	if (file.size != 0)
+	{
+		requests = get_file_requests(file, blocks, &content[0]);
+	}
+
+	// Read the data without the lock, so reads of other files overlap with this one
+	lock.unlock();
+	blkdevsim->read_batch(requests);
+	lock.lock();
+
+	// If a block was rewritten or released during the read, the content may be torn, so read it again locked
+	if (data_generation != _data_generation)
+	{
+		return read_file(path, file_name);
+	}
+
+	// Dontneed files don't keep the blocks that were read
+	if (hint == ACCESS_DONTNEED)
+	{
+		drop_blocks(blocks);
+	}
+
+	// Return the string with the content
+	return content;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::create_file(const std::string &path_str, bool directory)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_CREATE_FILE, path_str, directory);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+
+	// Snapshots are read-only
+	check_writable();
+
+	// Split the path into the dir and the file name
+	split_path(path_str, path, file_name);
+
+	if (!directory)
+	{
+		// Create the file
+		create_file(path, file_name);
+	} else {
+		// Create the dir
+		create_dir(path, file_name);
+	}
+}
+
+template <typename Geometry>
+std::string MyFsVolume<Geometry>::get_content(const std::string &path_str)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_GET_CONTENT, path_str);
+	std::unique_lock<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+
+	// Split the path into the dir and the file name
+	split_path(path_str, path, file_name);
+
+	// Read the content of the file
+	return read_file(path, file_name, lock);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::set_content(const std::string &path_str, const std::string &content)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_SET_CONTENT, path_str, trace_content(content));
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+
+	// Snapshots are read-only
+	check_writable();
+
+	// Split the path into the dir and the file name
+	split_path(path_str, path, file_name);
+
+	// Write the content into the file
+	write_file(path, file_name, content);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::sync()
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_SYNC);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+
+	// Write back the whole cache
+	write_back_all();
+}
+
+MyFs::FileReader::FileReader(MyFs &myfs, const std::string &path_str) : _myfs(myfs), _path(path_str), _offset(0)
+{
+	// Find the file's entry, it's kept by inode so the file can be renamed while it's read
+	struct myfs_entry file = _myfs.begin_read(path_str);
+
+	_inode = file.inode;
+	_size = file.size;
+}
+
+uint32_t MyFs::FileReader::read(char *buffer, uint32_t size)
+{
+	// The chunk is traced as a read of the range of the file
+	MyFsTraceScope trace(_myfs._trace, MyFsTrace::TRACE_READ_CONTENT, _path, _offset, size);
+
+	// Read the chunk and move after it
+	size = _myfs.read_chunk(_inode, _offset, size, buffer, &_size);
+	_offset += size;
+
+	return size;
+}
+
+bool MyFs::FileReader::eof() const
+{
+	return _offset >= _size;
+}
+
+template <typename Geometry>
+struct MyFs::myfs_entry MyFsVolume<Geometry>::begin_read(const std::string &path_str)
+{
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+
+	// Find the file's entry
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	if (file.is_dir)
+	{
+		throw MyFsException("'" + std::string(file_name) + "' is a dir!");
+	}
+
+	// Read the content from the device, so it can be read in chunks
+	write_back(&file, nullptr);
+
+	return file;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::read_chunk(uint32_t inode, uint32_t offset, uint32_t size, char *buffer, uint32_t *file_size)
+{
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_entry file;
+
+	// Get the current entry of the file, with the content that was set since the last chunk
+	file = get_file_entry(inode);
+	if (file.inode == 0)
+	{
+		throw MyFsException("The file was removed while it was read!");
+	}
+	write_back(&file, nullptr);
+	*file_size = file.size;
+
+	// Cut the chunk at the end of the file
+	if (offset >= file.size)
+	{
+		return 0;
+	}
+	size = std::min(size, file.size - offset);
+
+	read_file_range(file, offset, size, buffer);
+
+	return size;
+}
+
+MyFs::FileWriter::FileWriter(MyFs &myfs, const std::string &path_str) : _myfs(myfs), _path(path_str), _offset(0), _closed(false)
+{
+	// Opening the file is traced as emptying it
+	MyFsTraceScope trace(_myfs._trace, MyFsTrace::TRACE_TRUNCATE, path_str, 0u);
+
+	// Empty the file, the content is appended to it and replaces the cached one
+	_inode = _myfs.begin_write(path_str);
+
+	// The content is collected into whole blocks before it's written
+	_block_data_size = _myfs.get_block_data_size();
+	_buffer.reserve(_block_data_size);
+}
+
+MyFs::FileWriter::~FileWriter()
+{
+	// Errors can't be reported from the destructor, call close to get them
+	try
+	{
+		close();
+	}
+	catch (...)
+	{
+	}
+}
+
+void MyFs::FileWriter::write(const char *data, uint32_t size)
+{
+	uint32_t chunk_size = 0;
+
+	if (_closed)
+	{
+		throw MyFsException("The file writer was closed!");
+	}
+
+	while (size != 0)
+	{
+		// Fill the current block
+		chunk_size = std::min(size, (uint32_t)(_block_data_size - _buffer.size()));
+		_buffer.insert(_buffer.end(), data, data + chunk_size);
+		data += chunk_size;
+		size -= chunk_size;
+
+		// Write the block once it's full
+		if (_buffer.size() == _block_data_size)
+		{
+			flush(_buffer.size());
+		}
+	}
+}
+
+void MyFs::FileWriter::close()
+{
+	if (_closed)
+	{
+		return;
+	}
+	_closed = true;
+
+	// Write the last part of the content
+	flush(_buffer.size());
+}
+
+void MyFs::FileWriter::flush(uint32_t size)
+{
+	if (size == 0)
+	{
+		return;
+	}
+
+	// The block is traced as a write of the range of the file
+	MyFsTraceScope trace(_myfs._trace, MyFsTrace::TRACE_WRITE_CONTENT, _path, _offset, trace_content(_buffer.data(), size));
+
+	// Append the block to the file
+	_myfs.write_chunk(_inode, _offset, _buffer.data(), size);
+	_offset += size;
+	_buffer.clear();
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::begin_write(const std::string &path_str)
+{
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+	struct myfs_info sys_info = {0};
+
+	// Snapshots are read-only
+	check_writable();
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	// Find the file's entry
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	if (file.is_dir)
+	{
+		throw MyFsException("'" + std::string(file_name) + "' is a dir!");
+	}
+
+	// Empty the file, the cached content is replaced too
+	discard_dirty(file.inode);
+	truncate_file(&file, 0, &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+
+	return file.inode;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::write_chunk(uint32_t inode, uint32_t offset, const char *data, uint32_t size)
+{
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_entry file;
+	struct myfs_info sys_info = {0};
+
+	// Snapshots are read-only
+	check_writable();
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	// Get the current entry of the file, with the content that was set since the last block
+	file = get_file_entry(inode);
+	if (file.inode == 0)
+	{
+		throw MyFsException("The file was removed while it was written!");
+	}
+	write_back(&file, &sys_info);
+
+	// Append the block to the file
+	write_file_range(&file, offset, data, size, &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+}
+
+MyFs::Batch::Batch(MyFs &myfs) : _myfs(myfs)
+{
+}
+
+void MyFs::Batch::create_file(const std::string &path_str, bool directory)
+{
+	struct myfs_batch_operation operation;
+
+	// Save the create, nothing is checked until the commit
+	operation.path = path_str;
+	operation.is_create = true;
+	operation.is_dir = directory;
+	_operations.push_back(operation);
+}
+
+void MyFs::Batch::set_content(const std::string &path_str, const std::string &content)
+{
+	struct myfs_batch_operation operation;
+
+	// Save the write, nothing is checked until the commit
+	operation.path = path_str;
+	operation.is_create = false;
+	operation.is_dir = false;
+	operation.content = content;
+	_operations.push_back(operation);
+}
+
+void MyFs::Batch::commit()
+{
+	std::vector<struct myfs_batch_operation> operations;
+
+	// The batch is emptied whether the commit succeeds or not
+	operations.swap(_operations);
+	MyFsTraceScope trace(_myfs._trace, MyFsTrace::TRACE_COMMIT_BATCH, operations);
+	_myfs.commit_batch(operations);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::commit_batch(const std::vector<struct MyFs::myfs_batch_operation> &operations)
+{
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_batch_state state;
+	struct myfs_header header = get_header();
+	struct myfs_dir_entry new_dir_entry;
+	std::vector<char> block_table(BLOCK_TABLE_BLOCKS * BLOCK_SIZE), dir_data;
+	std::vector<uint32_t> old_chains, written_inodes(operations.size(), 0);
+	std::string_view path, file_name;
+	uint32_t inode = 0, dir_size = 0;
+	uint16_t group = 0;
+
+	// Snapshots are read-only
+	check_writable();
+
+	// The batch works on the files as they are on the device
+	write_back_all();
+
+	// Read the file system info and the initialized part of the inode table once for the whole batch
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(state.sys_info), (char *)&state.sys_info);
+	state.table_blocks = header.inode_table_blocks;
+	state.table.resize(state.table_blocks * BLOCK_SIZE / sizeof(struct myfs_entry));
+	blkdevsim->read(BLOCK_SIZE, state.table.size() * sizeof(struct myfs_entry), (char *)state.table.data());
+	state.free_slot = 0;
+	for (size_t i = 0; i < state.table.size(); i++)
+	{
+		if (state.table[i].inode != 0)
+		{
+			state.slots[state.table[i].inode] = i;
+		}
+	}
+
+	// Apply the operations to the copies in memory, so a failing operation leaves the device untouched
+	for (size_t i = 0; i < operations.size(); i++)
+	{
+		const struct myfs_batch_operation &operation = operations[i];
+
+		// Find the dir of the file, it may be a dir created by the batch
+		split_path(operation.path, path, file_name);
+		struct myfs_batch_dir &dir = get_batch_dir(&state, resolve_batch_dir(&state, path));
+
+		if (operation.is_create)
+		{
+			// If the name can't be saved in a record or already exists, throw error
+			if (file_name.length() == 0 || file_name.length() > MAX_NAME_LENGTH)
+			{
+				throw MyFsException("Invalid file name '" + std::string(file_name) + "'!");
+			}
+			if (dir.names.count(std::string(file_name)) != 0)
+			{
+				throw MyFsException("File with the name '" + std::string(file_name) + "' already exists!");
+			}
+
+			// Allocate the file's entry, a new dir goes to a group of it's own and a new file to the group of it's dir
+			group = state.table[dir.slot].group;
+			inode = allocate_batch_entry(&state, operation.is_dir, operation.is_dir ? find_dir_group(group, &state.sys_info) : group);
+
+			// A new dir starts with the entries of itself and it's parent
+			if (operation.is_dir)
+			{
+				struct myfs_batch_dir &new_dir = state.dirs[inode];
+				new_dir.slot = state.slots[inode];
+				new_dir.entries.push_back({inode, ENTRY_TYPE_DIR, "."});
+				new_dir.entries.push_back({state.table[dir.slot].inode, ENTRY_TYPE_DIR, ".."});
+				new_dir.names["."] = 0;
+				new_dir.names[".."] = 1;
+				new_dir.changed = true;
+				state.changed_dirs.push_back(inode);
+			}
+
+			// Add the file to it's dir
+			new_dir_entry.inode = inode;
+			new_dir_entry.type = operation.is_dir ? ENTRY_TYPE_DIR : ENTRY_TYPE_FILE;
+			new_dir_entry.name = file_name;
+			dir.names[std::string(file_name)] = dir.entries.size();
+			dir.entries.push_back(new_dir_entry);
+			if (!dir.changed)
+			{
+				dir.changed = true;
+				state.changed_dirs.push_back(state.table[dir.slot].inode);
+			}
+		}
+		else
+		{
+			// If the file isn't found, throw error
+			auto found = dir.names.find(std::string(file_name));
+			if (found == dir.names.end() || dir.entries[found->second].type != ENTRY_TYPE_FILE)
+			{
+				throw MyFsException("Unable to find the file '" + std::string(file_name) + "'!");
+			}
+
+			// Only the last content of every file is written
+			written_inodes[i] = dir.entries[found->second].inode;
+			state.contents[written_inodes[i]] = &operation.content;
+		}
+	}
+
+	// Save the block table, the only thing on the device that is changed before the batch is published
+	blkdevsim->read((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, block_table.size(), block_table.data());
+
+	try
+	{
+		// Write the content of every file as a new block chain, in the order of the operations
+		for (size_t i = 0; i < operations.size(); i++)
+		{
+			// Skip the creates and the contents that were replaced by a later operation
+			if (written_inodes[i] == 0 || state.contents[written_inodes[i]] != &operations[i].content)
+			{
+				continue;
+			}
+
+			struct myfs_entry &file = state.table[state.slots[written_inodes[i]]];
+			old_chains.push_back(file.first_block);
+			file.first_block = write_block_chain(operations[i].content.data(), operations[i].content.size(), 0, group_first_block(file.group), &state.sys_info);
+			file.size = operations[i].content.size();
+		}
+
+		// Write every changed dir once, with all of it's new entries
+		for (uint32_t dir_inode : state.changed_dirs)
+		{
+			struct myfs_batch_dir &dir = state.dirs[dir_inode];
+			struct myfs_entry &dir_entry = state.table[dir.slot];
+			old_chains.push_back(dir_entry.first_block);
+
+			// Get the size of the dir's records
+			dir_size = sizeof(struct myfs_dir);
+			for (auto &entry : dir.entries)
+			{
+				dir_size += sizeof(struct myfs_dir_record) + entry.name.length();
+			}
+
+			// Big dirs are written as an index, small ones as their records
+			if ((dir_entry.flags & ENTRY_FLAG_INDEXED_DIR) || dir_size > INDEXED_DIR_THRESHOLD)
+			{
+				dir_entry.first_block = write_dir_index(dir.entries, &dir_entry.size, group_first_block(dir_entry.group), &state.sys_info);
+				dir_entry.flags |= ENTRY_FLAG_INDEXED_DIR;
+			}
+			else
+			{
+				dir_data.assign(dir_size, 0);
+				pack_dir_entries(dir_data.data(), dir.entries);
+				dir_entry.first_block = write_block_chain(dir_data.data(), dir_size, 0, group_first_block(dir_entry.group), &state.sys_info);
+				dir_entry.size = dir_size;
+			}
+		}
+	}
+	catch (...)
+	{
+		// Nothing points at the new blocks and the bitmap wasn't written, so only the block table has to be restored
+		blkdevsim->write((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, block_table.size(), block_table.data());
+		load_fingerprints();
+		throw;
+	}
+
+	// Nothing can fail from here on, so release the replaced chains
+	for (uint32_t old_chain : old_chains)
+	{
+		deallocate_block_chain(old_chain, &state.sys_info);
+	}
+
+	// Publish the batch: the inode table, the header if the table grew, and the file system info
+	blkdevsim->write(BLOCK_SIZE, state.table.size() * sizeof(struct myfs_entry), (const char *)state.table.data());
+	if (state.table_blocks != header.inode_table_blocks)
+	{
+		header.inode_table_blocks = state.table_blocks;
+		set_header(&header);
+	}
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(state.sys_info), (const char *)&state.sys_info);
+
+	// The table was written as a whole, so the handles of the written files are marked here
+	for (uint32_t written_inode : written_inodes)
+	{
+		invalidate_handles(written_inode);
+	}
+}
+
+template <typename Geometry>
+struct MyFs::myfs_batch_dir &MyFsVolume<Geometry>::get_batch_dir(struct myfs_batch_state *state, uint32_t inode)
+{
+	auto found = state->dirs.find(inode);
+	auto slot = state->slots.find(inode);
+
+	// Every dir is read only once
+	if (found != state->dirs.end())
+	{
+		return found->second;
+	}
+
+	// If the dir has no entry, throw error
+	if (slot == state->slots.end() || !state->table[slot->second].is_dir)
+	{
+		throw MyFsException("An error occurred while searching the dir's entry!");
+	}
+
+	// Read the dir's entries and index them by name
+	struct myfs_batch_dir &dir = state->dirs[inode];
+	dir.slot = slot->second;
+	dir.entries = get_dir_entries(state->table[dir.slot]);
+	dir.changed = false;
+	for (size_t i = 0; i < dir.entries.size(); i++)
+	{
+		dir.names[dir.entries[i].name] = i;
+	}
+
+	return dir;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::resolve_batch_dir(struct myfs_batch_state *state, std::string_view path)
+{
+	std::vector<std::string> dirs = Utils::Split(path, '/');
+	uint32_t inode = _current_dir_inode;
+
+	// If the first dir of the path is the root folder start from the root dir
+	if (!dirs.empty() && dirs[0].length() == 0)
+	{
+		inode = 1;
+		dirs.erase(dirs.begin());
+	}
+
+	// Go through the dir names, like get_dir but on the batch's copies of the dirs
+	for (std::string &dir_name : dirs)
+	{
+		struct myfs_batch_dir &dir = get_batch_dir(state, inode);
+		auto found = dir.names.find(dir_name);
+		if (found == dir.names.end())
+		{
+			throw MyFsException("Unable to find the dir '" + dir_name + "'!");
+		}
+
+		// A file's content can't be read as dir records
+		if (dir.entries[found->second].type != ENTRY_TYPE_DIR)
+		{
+			throw MyFsException("'" + dir_name + "' is not a dir!");
+		}
+
+		inode = dir.entries[found->second].inode;
+	}
+
+	return inode;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::allocate_batch_entry(struct myfs_batch_state *state, bool is_dir, uint16_t group)
+{
+	struct myfs_entry file_entry = {0};
+
+	// Find the next empty slot, the slots before it were already used
+	while (state->free_slot < state->table.size() && state->table[state->free_slot].inode != 0)
+	{
+		state->free_slot++;
+	}
+
+	// If the initialized part is full, initialize the next block of the table
+	if (state->free_slot == state->table.size())
+	{
+		// If the whole table is used, throw error
+		if (state->table_blocks == INODE_TABLE_BLOCKS)
+		{
+			throw MyFsException("Inode entries table is full!");
+		}
+
+		state->table_blocks++;
+		state->table.resize(state->table_blocks * BLOCK_SIZE / sizeof(struct myfs_entry));
+	}
+
+	// Set file's properties
+	state->sys_info.inode_count += 1;
+	file_entry.inode = state->sys_info.inode_count;
+	file_entry.is_dir = is_dir;
+	file_entry.group = group;
+	state->sys_info.group_dirs[group] += is_dir ? 1 : 0;
+
+	// Save the entry in it's slot
+	state->table[state->free_slot] = file_entry;
+	state->slots[file_entry.inode] = state->free_slot;
+	state->sys_info.free_inodes--;
+
+	return file_entry.inode;
+}
+
+template <typename Geometry>
+std::string MyFsVolume<Geometry>::change_directory(const std::string &path_str)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_CHANGE_DIRECTORY, path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, dir_name;
+
+	// Split the path into the parent dir and the dir name
+	split_path(path_str, path, dir_name);
+
+	// Change directory
+	return change_directory(path, dir_name);
+}
+
+template <typename Geometry>
+MyFs::dir_list MyFsVolume<Geometry>::list_dir(const std::string &path_str)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_LIST_DIR, path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+
+	// Get the dir from the path and list it with all the inodes at hand
+	return read_dir_plus(get_dir(path_str), get_file_entries());
+}
+
+template <typename Geometry>
+MyFs::dir_list MyFsVolume<Geometry>::list_dir(uint32_t dir_inode)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_LIST_DIR_INODE, dir_inode);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::unordered_map<uint32_t, struct myfs_entry> inodes = get_file_entries();
+
+	// Get the dir's entry from the inodes that were already read
+	auto dir = inodes.find(dir_inode);
+	if (dir == inodes.end() || !dir->second.is_dir)
+	{
+		throw MyFsException("Unable to find the dir's inode entry!");
+	}
+
+	return read_dir_plus(dir->second, inodes);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::walk_tree(const std::string &path_str, MyFs::tree_visitor visitor)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_WALK_TREE, path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+
+	// Read the inode table once for the whole walk
+	walk_dir_tree(get_dir(path_str), 0, get_file_entries(), visitor);
+}
+
+template <typename Geometry>
+MyFs::dir_list MyFsVolume<Geometry>::read_dir_plus(const struct MyFs::myfs_entry &dir, const std::unordered_map<uint32_t, struct MyFs::myfs_entry> &inodes)
+{
+	struct dir_list_entry dir_entry;
+	dir_entries entries;
+	dir_list ans;
+
+	// Get the entries of the folder
+	entries = get_dir_entries(dir);
+	ans.reserve(entries.size());
+
+	// For each entry create a dir list item
+	for (auto &entry : entries)
+	{
+		// Get the file entry of the dir entry for the file's size
+		auto file_entry = inodes.find(entry.inode);
+		if (file_entry == inodes.end())
+		{
+			throw MyFsException("Unable to get the file's inode entry!");
+		}
+
+		// Set dir entry properties, the type is saved in the dir's record
+		dir_entry.name = entry.name;
+		dir_entry.is_dir = entry.type == ENTRY_TYPE_DIR;
+		dir_entry.file_size = file_entry->second.size;
+
+		// Files in the write-back cache have the size of their cached content
+		auto dirty = _dirty_files.find(entry.inode);
+		if (dirty != _dirty_files.end())
+		{
+			dir_entry.file_size = dirty->second.content.size();
+		}
+		dir_entry.inode = entry.inode;
+
+		// Add dir entry
+		ans.push_back(dir_entry);
+	}
 
-		// Reset data pointer so we can start using the already allocated blocks
-		data_pointer = 0;
+	return ans;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::walk_dir_tree(const struct MyFs::myfs_entry &dir, uint32_t depth, const std::unordered_map<uint32_t, struct MyFs::myfs_entry> &inodes, const MyFs::tree_visitor &visitor)
+{
+	dir_list dlist = read_dir_plus(dir, inodes);
 
-		// Set the first block to be read
-		block_index = file_entry->first_block;
+	// The dot entries aren't part of the tree
+	dlist.erase(std::remove_if(dlist.begin(), dlist.end(), [](const struct dir_list_entry &entry) { return entry.name == "." || entry.name == ".."; }), dlist.end());
 
-		// Go through the allocated blocks of the file
-		for (int i = 0; i < std::min(Utils::CalcAmountOfBlocksForFile(file_entry->size), Utils::CalcAmountOfBlocksForFile(size)); i++)
+	for (size_t i = 0; i < dlist.size(); i++)
+	{
+		visitor(dlist[i], depth, i == dlist.size() - 1);
+
+		// Enter sub dirs by their inode, without going through their path
+		if (dlist[i].is_dir)
 		{
-			// Read the current block
-			blkdevsim->read(block_index * BLOCK_SIZE, sizeof(block), (char *)&block);
+			walk_dir_tree(inodes.at(dlist[i].inode), depth + 1, inodes, visitor);
+		}
+	}
+}
 
-			// Copy the current block's data to the block's struct
-			memcpy(block.data, data + data_pointer, size - data_pointer < BLOCK_DATA_SIZE ? size - data_pointer : BLOCK_DATA_SIZE);
 
-			// If we found the last block, set it's next block as the back block
-			if (block.next_block == 0)
-			{
-				block.next_block = back_block_index;
-			}
-			// If we reached the last block, set it as last block and save next block
-			else if (data_pointer + BLOCK_DATA_SIZE >= size)
-			{
-				// Save next block
-				deallocate_block_index = block.next_block;
+template <typename Geometry>
+void MyFsVolume<Geometry>::set_dedup(bool enabled)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_SET_DEDUP, enabled);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
 
-				block.next_block = 0;
-			}
+	// The flag is kept on the device, snapshots don't keep it
+	check_mount_writable();
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-			// Overwrite the current block
-			blkdevsim->write(block_index * BLOCK_SIZE, sizeof(block), (char *)&block);
+	// Set or clear the dedup flag
+	if (enabled)
+	{
+		sys_info.flags |= FLAG_DEDUP;
+	}
+	else
+	{
+		sys_info.flags &= ~FLAG_DEDUP;
+	}
 
-			// Move to the next block's data
-			data_pointer += BLOCK_DATA_SIZE;
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+}
 
-			// Set the next block
-			block_index = block.next_block;
-		}
+template <typename Geometry>
+bool MyFsVolume<Geometry>::is_dedup_enabled()
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_IS_DEDUP_ENABLED);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
 
-		// If there are unused allocated blocks, de-allocate them
-		if (deallocate_block_index != 0)
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	return sys_info.flags & FLAG_DEDUP;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::set_trace(MyFsTrace *trace)
+{
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+
+	// Operations that already started aren't traced
+	_trace = trace;
+}
+
+void MyFs::split_path(std::string_view path_str, std::string_view &path, std::string_view &file_name)
+{
+	std::string_view rest = path_str;
+
+	// If the path has dirs in it
+	if (path_str.find('/') != std::string_view::npos)
+	{
+		// The file name is the last token of the path
+		while (Utils::NextToken(rest, '/', file_name))
 		{
-			deallocate_block_chain(deallocate_block_index);
 		}
+
+		// Get the path without the file name
+		path = path_str.substr(0, path_str.size() - file_name.length());
+	}
+	else
+	{
+		path = "./";
+		file_name = path_str;
 	}
+}
 
-	// Set the size of the file
-	file_entry->size = size;
+template <typename Geometry>
+std::string MyFsVolume<Geometry>::read_content(const std::string &path_str, uint32_t offset, uint32_t size)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_READ_CONTENT, path_str, offset, size);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	std::string content;
+	struct myfs_entry file;
+
+	// Find the file's entry
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	retry_write_back(&file);
+
+	// Content that wasn't written back is read from the cache
+	auto dirty = _dirty_files.find(file.inode);
+	if (dirty != _dirty_files.end())
+	{
+		return offset >= dirty->second.content.size() ? content : dirty->second.content.substr(offset, size);
+	}
 
-	// Update the file entry in the inode entries table
-	update_entry(file_entry);
+	// Cut the range at the end of the file
+	if (offset >= file.size)
+	{
+		return content;
+	}
+	size = std::min(size, file.size - offset);
 
-	// Overwrite the file system info structure
-	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+	// Read the range
+	content.resize(size);
+	read_file_range(file, offset, size, &content[0]);
+
+	return content;
 }
 
-void MyFs::deallocate_block_chain(uint32_t block_chain_head)
+template <typename Geometry>
+void MyFsVolume<Geometry>::write_content(const std::string &path_str, uint32_t offset, const std::string &content)
 {
-	uint32_t block_index = block_chain_head;
-	struct myfs_info sys_info;
-	struct myfs_block block;
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_WRITE_CONTENT, path_str, offset, trace_content(content));
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+	struct myfs_info sys_info = {0};
+
+	// Snapshots are read-only
+	check_writable();
 
 	// Get the file system info struct
 	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-	// While we didn't reach the end of the block chain
-	while (block_index != 0)
+	// Find the file's entry, the range is written over the content that was set before it
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	write_back(&file, &sys_info);
+
+	// Write the range
+	write_file_range(&file, offset, content.c_str(), content.size(), &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::seek_data(const std::string &path_str, uint32_t offset)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_SEEK_DATA, path_str, offset);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+
+	// Find the file's entry, it's blocks are allocated only once it's written back
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	write_back(&file, nullptr);
+
+	// Find the first allocated block that ends after the offset
+	for (auto &mapped_block : get_block_map(file.first_block))
 	{
-		// Read the current block
-		blkdevsim->read(block_index * BLOCK_SIZE, sizeof(block), (char *)&block);
+		if ((mapped_block.logical_block + 1) * BLOCK_DATA_SIZE > offset)
+		{
+			return std::min(file.size, std::max(offset, (uint32_t)(mapped_block.logical_block * BLOCK_DATA_SIZE)));
+		}
+	}
 
-		// De-allocate the block
-		sys_info.block_bitmap.reset(block_index);
+	return file.size;
+}
 
-		// Move to the next block
-		block_index = block.next_block;
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::seek_hole(const std::string &path_str, uint32_t offset)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_SEEK_HOLE, path_str, offset);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+
+	// Find the file's entry, it's blocks are allocated only once it's written back
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	write_back(&file, nullptr);
+
+	// Go through the allocated blocks while they cover the offset
+	for (auto &mapped_block : get_block_map(file.first_block))
+	{
+		// If the block is after the offset, the offset is in a hole
+		if (mapped_block.logical_block * BLOCK_DATA_SIZE > offset)
+		{
+			break;
+		}
+
+		// If the block covers the offset, the hole can start only after it
+		offset = std::max(offset, (uint32_t)((mapped_block.logical_block + 1) * BLOCK_DATA_SIZE));
+	}
+
+	return std::min(offset, file.size);
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::open(const std::string &path_str)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_OPEN, path_str, (uint32_t)0);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_open_file file;
+
+	// Find the file's entry, the map is loaded on the first use of the handle
+	split_path(path_str, path, file_name);
+	file.entry = find_file(path, file_name);
+	file.stale = true;
+
+	// The handle is recorded as the result of the operation
+	_open_files[_next_handle] = file;
+	trace.set_result(_next_handle);
+
+	return _next_handle++;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::close(uint32_t handle)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_CLOSE, handle);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+
+	// If the handle isn't open, throw error
+	if (_open_files.erase(handle) == 0)
+	{
+		throw MyFsException("Invalid file handle!");
+	}
+}
+
+template <typename Geometry>
+std::string MyFsVolume<Geometry>::read_content(uint32_t handle, uint32_t offset, uint32_t size)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_READ_CONTENT_HANDLE, handle, offset, size);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_open_file &file = get_open_file(handle);
+	std::string content;
+
+	// Content that wasn't written back is read from the cache
+	retry_write_back(&file.entry);
+	auto dirty = _dirty_files.find(file.entry.inode);
+	if (dirty != _dirty_files.end())
+	{
+		return offset >= dirty->second.content.size() ? content : dirty->second.content.substr(offset, size);
+	}
+
+	// Cut the range at the end of the file
+	if (offset >= file.entry.size)
+	{
+		return content;
+	}
+	size = std::min(size, file.entry.size - offset);
+
+	// Read the range through the map of the handle
+	content.resize(size);
+	read_file_range(file.entry, file.blocks, offset, size, &content[0]);
+
+	return content;
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::write_content(uint32_t handle, uint32_t offset, const std::string &content)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_WRITE_CONTENT_HANDLE, handle, offset, trace_content(content));
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+
+	// Snapshots are read-only
+	check_writable();
+	struct myfs_open_file &file = get_open_file(handle);
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	// If the range is in the file's blocks and they aren't deduplicated, the entry and the block chain don't change
+	if (!(sys_info.flags & FLAG_DEDUP) && _dirty_files.count(file.entry.inode) == 0 && overwrite_file_range(file, offset, content.c_str(), content.size()))
+	{
+		return;
 	}
 
+	// Write the range over the content that was set before it, the change marks the handle as stale
+	write_back(&file.entry, &sys_info);
+	write_file_range(&file.entry, offset, content.c_str(), content.size(), &sys_info);
+
 	// Overwrite the file system info structure
 	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
 }
 
-void MyFs::add_dir_entry(struct MyFs::myfs_entry *dir, struct MyFs::myfs_entry *file_entry, std::string file_name)
+template <typename Geometry>
+struct MyFs::myfs_open_file &MyFsVolume<Geometry>::get_open_file(uint32_t handle)
 {
-	struct myfs_dir_entry file_dir_entry = {0};
-	struct myfs_dir *dir_ptr;
-	char *new_dir_data = new char[dir->size + sizeof(struct myfs_dir_entry)];
+	auto found = _open_files.find(handle);
 
-	// If a file with the file name already exists throw error
-	if (Utils::SearchFile(file_name, get_dir_entries(*dir)).inode != 0)
+	// If the handle isn't open, throw error
+	if (found == _open_files.end())
 	{
-		throw MyFsException("File with the name '" + file_name + "' already exists!");
+		throw MyFsException("Invalid file handle!");
 	}
 
-	// Set the dir entry properties
-	file_dir_entry.inode = file_entry->inode;
-	strcpy(file_dir_entry.name, file_name.c_str());
+	// If the file changed since the handle was used, load it's entry and map again
+	if (found->second.stale)
+	{
+		found->second.entry = get_file_entry(found->second.entry.inode);
+		if (found->second.entry.inode == 0)
+		{
+			_open_files.erase(found);
+			throw MyFsException("The file of the handle was removed!");
+		}
 
-	// Read the existing dir data into the new dir data array
-	get_file(*dir, new_dir_data);
+		found->second.blocks = get_block_map(found->second.entry.first_block);
+		found->second.stale = false;
+	}
 
-	// Increase the file amount
-	dir_ptr = (struct myfs_dir *)new_dir_data;
-	dir_ptr->amount++;
+	return found->second;
+}
 
-	memcpy(new_dir_data + dir->size, &file_dir_entry, sizeof(file_dir_entry));
+template <typename Geometry>
+void MyFsVolume<Geometry>::invalidate_handles(uint32_t inode)
+{
+	// The handles of the file load it's entry and map again on their next use
+	for (auto &open_file : _open_files)
+	{
+		if (open_file.second.entry.inode == inode)
+		{
+			open_file.second.stale = true;
+		}
+	}
+}
 
-	// Update the dir file
-	update_file(dir, new_dir_data, dir->size + sizeof(struct myfs_dir_entry));
+template <typename Geometry>
+bool MyFsVolume<Geometry>::overwrite_file_range(const struct MyFs::myfs_open_file &file, uint32_t offset, const char *data, uint32_t size)
+{
+	uint32_t end = offset + size, block_start = 0, range_start = 0, range_end = 0;
+	size_t first = find_mapped_block(file.blocks, offset / BLOCK_DATA_SIZE), last = 0;
+	struct myfs_block_info block_info = {0};
+
+	// Writing nothing doesn't change the file, and a range after the end of the file changes it's size
+	if (size == 0 || end > file.entry.size)
+	{
+		return size == 0;
+	}
+
+	// Every block of the range has to be allocated, the map is sorted so they are one after another in it
+	last = first + (end - 1) / BLOCK_DATA_SIZE - offset / BLOCK_DATA_SIZE;
+	if (last >= file.blocks.size() || file.blocks[last].logical_block != (end - 1) / BLOCK_DATA_SIZE)
+	{
+		return false;
+	}
+
+	// A block with another reference is shared along with the blocks after it, so they have to be copied first
+	for (size_t i = 0; i <= last; i++)
+	{
+		if (get_block_info(file.blocks[i].block_index).ref_count != 1)
+		{
+			return false;
+		}
+	}
+
+	// Overwrite the range inside every block
+	for (size_t i = first; i <= last; i++)
+	{
+		block_start = file.blocks[i].logical_block * BLOCK_DATA_SIZE;
+		range_start = std::max(offset, block_start);
+		range_end = std::min(end, block_start + (uint32_t)BLOCK_DATA_SIZE);
+		blkdevsim->write(file.blocks[i].block_index * BLOCK_SIZE + (range_start - block_start), range_end - range_start, data + (range_start - offset));
+
+		// The content of the block changed so it's fingerprint is no longer valid
+		block_info.ref_count = 1;
+		set_block_info(file.blocks[i].block_index, &block_info);
+	}
+	_data_generation++;
+
+	return true;
 }
 
-struct MyFs::myfs_entry MyFs::allocate_file(bool is_dir, struct MyFs::myfs_info *sys_info_ptr)
+size_t MyFs::find_mapped_block(const MyFs::block_map &blocks, uint32_t logical_block)
 {
-	struct myfs_entry file_entry = {0};
-	struct myfs_info *sys_info = sys_info_ptr;
+	// The map is sorted by logical block, so the first block at or after the logical block is found by a binary search
+	return std::lower_bound(blocks.begin(), blocks.end(), logical_block, [](const struct myfs_mapped_block &mapped_block, uint32_t logical_block) {
+		return mapped_block.logical_block < logical_block;
+	}) - blocks.begin();
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::set_access_hint(const std::string &path_str, uint8_t hint)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_SET_ACCESS_HINT, path_str, hint);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+
+	// Check the hint is known
+	if (hint > ACCESS_DONTNEED)
+	{
+		throw MyFsException("Invalid access hint!");
+	}
+
+	// Find the file's entry
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+
+	// Save the hint by the file's inode, files without a hint are normal
+	if (hint == ACCESS_NORMAL)
+	{
+		_access_hints.erase(file.inode);
+	}
+	else
+	{
+		_access_hints[file.inode] = hint;
+	}
+
+	// Drop the blocks the file already has in the cache
+	if (hint == ACCESS_DONTNEED)
+	{
+		drop_blocks(get_block_map(file.first_block, ACCESS_RANDOM));
+	}
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::get_free_blocks()
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_GET_FREE_BLOCKS);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+
+	// The cached contents take blocks only once they are written back
+	write_back_all();
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	return sys_info.free_blocks;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::get_free_inodes()
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_GET_FREE_INODES);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+	return sys_info.free_inodes;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::get_block_size()
+{
+	return BLOCK_SIZE;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::get_block_data_size()
+{
+	return BLOCK_DATA_SIZE;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::get_fragments(const std::string &path_str)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_GET_FRAGMENTS, path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+
+	// Find the file's entry, it's blocks are allocated only once it's written back
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	write_back(&file, nullptr);
+
+	return count_fragments(get_block_map(file.first_block));
+}
+
+template <typename Geometry>
+struct MyFs::defrag_progress MyFsVolume<Geometry>::defrag(MyFs::defrag_callback progress, uint32_t max_blocks_per_second)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_DEFRAG, max_blocks_per_second);
+	std::unique_lock<std::recursive_mutex> lock(_lock);
+	struct defrag_progress state = {0};
+	struct myfs_info sys_info = {0};
+	std::vector<uint32_t> inodes;
+	uint32_t blocks_moved = 0;
+
+	// Snapshots are read-only
+	check_writable();
+
+	// Only blocks that are allocated can be relocated
+	write_back_all();
+
+	// Take the files that exist when the defrag starts
+	for (auto &entry : get_file_entries())
+	{
+		inodes.push_back(entry.first);
+	}
+	std::sort(inodes.begin(), inodes.end());
+	state.files_total = inodes.size();
+
+	for (uint32_t inode : inodes)
+	{
+		// Get the file system info struct
+		blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
+
+		// Relocate the file's blocks
+		blocks_moved = defrag_file(inode, &sys_info);
+
+		// Overwrite the file system info structure
+		blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+
+		// Update the progress
+		state.files_done++;
+		state.files_moved += blocks_moved != 0 ? 1 : 0;
+		state.blocks_moved += blocks_moved;
+
+		// Let other operations run between the files
+		lock.unlock();
+		if (progress && !progress(state))
+		{
+			return state;
+		}
+		if (max_blocks_per_second != 0 && blocks_moved != 0)
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)blocks_moved * 1000000 / max_blocks_per_second));
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+		lock.lock();
+
+		// A snapshot may have been taken into use while the lock was released
+		check_writable();
+	}
+
+	return state;
+}
+
+uint32_t MyFs::count_fragments(const MyFs::block_map &blocks)
+{
+	uint32_t fragments = blocks.empty() ? 0 : 1;
+
+	// Every block that doesn't follow the block before it starts a new fragment
+	for (size_t i = 1; i < blocks.size(); i++)
+	{
+		if (blocks[i].block_index != blocks[i - 1].block_index + 1)
+		{
+			fragments++;
+		}
+	}
+
+	return fragments;
+}
+
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::defrag_file(uint32_t inode, struct myfs_info *sys_info)
+{
+	struct myfs_entry file = get_file_entry(inode);
+	struct myfs_block_info block_info = {0};
+	struct myfs_block block;
+	block_map blocks;
+	uint32_t run_start = 0;
+
+	// Removed files and indexed dirs, which point at their leaves from the index, aren't moved
+	if (file.inode == 0 || (file.flags & ENTRY_FLAG_INDEXED_DIR))
+	{
+		return 0;
+	}
+
+	// Files that are already in a single fragment don't need to move
+	blocks = get_block_map(file.first_block);
+	if (count_fragments(blocks) <= 1)
+	{
+		return 0;
+	}
+
+	// Shared blocks are pointed at by other owners too, so they can't move
+	for (auto &mapped_block : blocks)
+	{
+		if (get_block_info(mapped_block.block_index).ref_count != 1)
+		{
+			return 0;
+		}
+	}
 
-	// If no sys info passed, get it
-	if (sys_info == nullptr)
+	// Find a run of free blocks that can hold the whole file, in the file's group if there is one
+	run_start = find_free_run(blocks.size(), group_first_block(file.group), sys_info);
+	if (run_start == 0)
 	{
-		// Allocate the struct
-		sys_info = new struct myfs_info();
+		return 0;
+	}
 
-		// Get the file system info struct
-		blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)sys_info);
+	// Copy the blocks into the run in order, each block points at the one after it
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		blkdevsim->read(blocks[i].block_index * BLOCK_SIZE, BLOCK_SIZE, (char *)&block);
+		block.next_block = i + 1 < blocks.size() ? run_start + i + 1 : 0;
+		blkdevsim->write((run_start + i) * BLOCK_SIZE, BLOCK_SIZE, (const char *)&block);
+
+		// The next block changed so the fingerprint is no longer valid
+		block_info.ref_count = 1;
+		set_block_info(run_start + i, &block_info);
+		mark_block_used(run_start + i, sys_info);
 	}
 
-	// Increase the inode counter
-	sys_info->inode_count += 1;
+	// Point the file at the copy
+	file.first_block = run_start;
+	update_entry(&file);
 
-	// Set file's properties
-	file_entry.inode = sys_info->inode_count;
-	file_entry.is_dir = is_dir;
+	// Free the old blocks, nothing else points at them
+	block_info.ref_count = 0;
+	for (auto &mapped_block : blocks)
+	{
+		set_block_info(mapped_block.block_index, &block_info);
+		mark_block_free(mapped_block.block_index, sys_info);
+		_data_generation++;
+	}
 
-	// Add the entry to inode table
-	add_entry(&file_entry);
+	return blocks.size();
+}
 
-	// If no sys info was passed, write it to the disk
-	if (sys_info_ptr == nullptr)
+template <typename Geometry>
+uint32_t MyFsVolume<Geometry>::find_free_run(uint32_t size, uint32_t goal, struct myfs_info *sys_info)
+{
+	uint32_t run_length = 0;
+
+	// The blocks kept for the write-back cache can't be taken by the run
+	if (size + _dirty_blocks > sys_info->free_blocks)
 	{
-		// Overwrite the file system info structure
-		blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)sys_info);
+		return 0;
+	}
 
-		// Release memory
-		delete sys_info;
+	// Find the first run of free blocks that is long enough from the goal, and if there is none from the first data block
+	for (uint32_t start : {goal, (uint32_t)FIRST_DATA_BLOCK})
+	{
+		run_length = 0;
+		for (uint32_t block_index = start; block_index < BLOCK_COUNT; block_index++)
+		{
+			run_length = sys_info->block_bitmap.test(block_index) ? 0 : run_length + 1;
+			if (run_length == size)
+			{
+				return block_index + 1 - size;
+			}
+		}
 	}
 
-	return file_entry;
+	return 0;
 }
 
-void MyFs::init_dir(struct MyFs::myfs_entry *dir_entry, struct MyFs::myfs_entry *prev_dir_entry, struct MyFs::myfs_info *sys_info)
+template <typename Geometry>
+void MyFsVolume<Geometry>::remove_file(const std::string &path_str)
 {
-	struct myfs_dir dir = {0};
-	struct myfs_dir_entry current_dir = {0}, prev_dir = {0};
-	struct myfs_block block = {{0}};
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_REMOVE_FILE, path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry dir, file;
+	struct myfs_info sys_info = {0};
 
-	// Set the folder to have 2 entries(current folder and prev folder)
-	dir.amount = 2;
+	// Snapshots are read-only
+	check_writable();
 
-	// Set current dir entry properties
-	current_dir.inode = dir_entry->inode;
-	strcpy(current_dir.name, ".");
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-	// Set prev dir entry properties
-	prev_dir.inode = prev_dir_entry->inode;
-	strcpy(prev_dir.name, "..");
+	// Find the file's entry and it's dir
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	dir = get_dir(path);
 
-	// Copy all dir data
-	memcpy(block.data, &dir, sizeof(dir));
-	memcpy(block.data + sizeof(dir), &current_dir, sizeof(current_dir));
-	memcpy(block.data + sizeof(dir) + sizeof(current_dir), &prev_dir, sizeof(prev_dir));
+	// Detach the file from it's dir and from the inode table
+	remove_dir_entry(&dir, file_name, &sys_info);
+	remove_entry(file.inode, &sys_info);
 
-	// Allocate the block for the dir
-	dir_entry->first_block = allocate_block(&block, sys_info);
-	dir_entry->size = sizeof(dir) + sizeof(current_dir) + sizeof(prev_dir);
+	// Return the file's blocks in the background
+	reclaim_block_chain(file.first_block, &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
 }
 
-void MyFs::create_dir(std::string path, std::string dir_name)
+template <typename Geometry>
+void MyFsVolume<Geometry>::remove_dir(const std::string &path_str)
 {
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_REMOVE_DIR, path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view dir_path = path_str, path, dir_name;
 	struct myfs_entry parent_dir, dir;
+	struct myfs_dir_entry dir_entry;
 	struct myfs_info sys_info = {0};
 
+	// Snapshots are read-only
+	check_writable();
+
 	// Get the file system info struct
 	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-	// Get the dir from the path
-	parent_dir = get_dir(path);
+	// The path of the dir may end with a '/'
+	while (dir_path.length() > 1 && dir_path.back() == '/')
+	{
+		dir_path.remove_suffix(1);
+	}
 
-	// Allocate the dir
-	dir = allocate_file(true, &sys_info);
+	// Find the dir's entry and it's parent dir
+	split_path(dir_path, path, dir_name);
+	if (dir_name.length() == 0 || dir_name == "." || dir_name == "..")
+	{
+		throw MyFsException("Unable to remove the dir '" + std::string(dir_name) + "'!");
+	}
+	parent_dir = get_dir(path);
+	dir_entry = find_dir_entry(parent_dir, dir_name);
+	if (dir_entry.inode == 0 || dir_entry.type != ENTRY_TYPE_DIR)
+	{
+		throw MyFsException("Unable to find the dir '" + std::string(dir_name) + "'!");
+	}
+	dir = get_file_entry(dir_entry.inode);
 
-	// Initialize the directory
-	init_dir(&dir, &parent_dir, &sys_info);
+	// Only empty dirs can be removed, and the current dir can't be removed
+	if (get_dir_entries(dir).size() != 2)
+	{
+		throw MyFsException("The dir '" + std::string(dir_name) + "' isn't empty!");
+	}
+	if (dir.inode == _current_dir_inode)
+	{
+		throw MyFsException("Unable to remove the current dir!");
+	}
 
-	// Update the dir's entry
-	update_entry(&dir);
+	// Detach the dir from it's parent dir and from the inode table
+	remove_dir_entry(&parent_dir, dir_name, &sys_info);
+	remove_entry(dir.inode, &sys_info);
 
-	// Add a dir entry for the dir in the parent dir file
-	add_dir_entry(&parent_dir, &dir, dir_name);
+	// Return the dir's blocks in the background
+	reclaim_block_chain(dir.first_block, &sys_info);
 
 	// Overwrite the file system info structure
 	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
 }
 
-void MyFs::create_file(std::string path, std::string file_name)
+template <typename Geometry>
+void MyFsVolume<Geometry>::truncate(const std::string &path_str, uint32_t size)
 {
-	struct myfs_entry dir, file;
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_TRUNCATE, path_str, size);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view path, file_name;
+	struct myfs_entry file;
+	struct myfs_info sys_info = {0};
 
-	// Get the dir from the path
-	dir = get_dir(path);
+	// Snapshots are read-only
+	check_writable();
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-	// Allocate the file
-	file = allocate_file(false, nullptr);
+	// Find the file's entry, the size is set on the content that was set before it
+	split_path(path_str, path, file_name);
+	file = find_file(path, file_name);
+	write_back(&file, &sys_info);
 
-	// Add a dir entry for the file in the dir file
-	add_dir_entry(&dir, &file, file_name);
+	// Set the file's size
+	truncate_file(&file, size, &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
 }
 
-void MyFs::write_file(std::string path, std::string file_name, std::string content)
+template <typename Geometry>
+void MyFsVolume<Geometry>::rename(const std::string &src_path_str, const std::string &dst_path_str)
 {
-	struct myfs_dir_entry file_entry;
-	struct myfs_entry dir, file;
-	dir_entries entries;
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_RENAME, src_path_str, dst_path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view src_full_path = src_path_str, dst_full_path = dst_path_str;
+	std::string_view src_path, src_name, dst_path, dst_name;
+	struct myfs_entry src_dir, dst_dir, file, dst_file = {0}, ancestor;
+	struct myfs_dir_entry file_dir_entry, dst_dir_entry, parent_dir_entry;
+	struct myfs_info sys_info = {0};
 
-	// Get the dir from the path
-	dir = get_dir(path);
+	// Snapshots are read-only
+	check_writable();
 
-	// Get the entries of the folder
-	entries = get_dir_entries(dir);
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-	// Try to find the file dir entry
-	file_entry = Utils::SearchFile(file_name, entries);
+	// The paths may end with a '/'
+	while (src_full_path.length() > 1 && src_full_path.back() == '/')
+	{
+		src_full_path.remove_suffix(1);
+	}
+	while (dst_full_path.length() > 1 && dst_full_path.back() == '/')
+	{
+		dst_full_path.remove_suffix(1);
+	}
 
-	// If the file isn't found, throw error
-	if (file_entry.inode == 0)
+	// Find the source entry and it's dir
+	split_path(src_full_path, src_path, src_name);
+	if (src_name.length() == 0 || src_name == "." || src_name == "..")
+	{
+		throw MyFsException("Unable to move '" + std::string(src_name) + "'!");
+	}
+	src_dir = get_dir(src_path);
+	file_dir_entry = find_dir_entry(src_dir, src_name);
+	if (file_dir_entry.inode == 0)
 	{
-		throw MyFsException("Unable to find the file '" + file_name + "'!");
+		throw MyFsException("Unable to find the file '" + std::string(src_name) + "'!");
 	}
+	file = get_file_entry(file_dir_entry.inode);
 
-	// Try to get the file entry
-	file = get_file_entry(file_entry.inode);
-	if (file.inode == 0)
+	// Find the destination dir
+	split_path(dst_full_path, dst_path, dst_name);
+	if (dst_name.length() == 0 || dst_name == "." || dst_name == "..")
 	{
-		throw MyFsException("An error occurred while searching the file's entry!");
+		throw MyFsException("Invalid file name '" + std::string(dst_name) + "'!");
 	}
+	dst_dir = get_dir(dst_path);
 
-	// If the file is a dir, throw error
+	// Moving a file to it's own path does nothing
+	if (src_dir.inode == dst_dir.inode && src_name == dst_name)
+	{
+		return;
+	}
+
+	// A dir can't be moved into itself, so make sure it isn't one of the destination dir's ancestors
 	if (file.is_dir)
 	{
-		throw MyFsException("Unable to find the file '" + file_name + "'!");
+		for (ancestor = dst_dir; ancestor.inode != 1; ancestor = get_file_entry(find_dir_entry(ancestor, "..").inode))
+		{
+			if (ancestor.inode == file.inode)
+			{
+				throw MyFsException("Unable to move a dir into itself!");
+			}
+		}
 	}
 
-	// Update the file with it's new content
-	update_file(&file, (char *)content.c_str(), content.size());
-}
+	// If the destination exists, it's replaced by the file
+	dst_dir_entry = find_dir_entry(dst_dir, dst_name);
+	if (dst_dir_entry.inode != 0)
+	{
+		dst_file = get_file_entry(dst_dir_entry.inode);
 
-std::string MyFs::read_file(std::string path, std::string file_name)
-{
-	std::string content_str;
-	char *content = nullptr;
-	struct myfs_dir_entry file_entry;
-	struct myfs_entry dir, file;
-	dir_entries entries;
+		// Only a file can replace a file, and only a dir can replace an empty dir
+		if (dst_file.is_dir != file.is_dir)
+		{
+			throw MyFsException("Unable to replace '" + std::string(dst_name) + "' with '" + std::string(src_name) + "'!");
+		}
+		if (dst_file.is_dir && get_dir_entries(dst_file).size() != 2)
+		{
+			throw MyFsException("The dir '" + std::string(dst_name) + "' isn't empty!");
+		}
+		if (dst_file.inode == _current_dir_inode)
+		{
+			throw MyFsException("Unable to replace the current dir!");
+		}
 
-	// Get the dir from the path
-	dir = get_dir(path);
+		// Point the destination's record at the file in place, the destination is released only after the move succeeded
+		dst_dir_entry.inode = file.inode;
+		dst_dir_entry.name = dst_name;
+		update_dir_entry(&dst_dir, dst_dir_entry, &sys_info);
+	}
+	// Link the file in the destination dir
+	else
+	{
+		add_dir_entry(&dst_dir, &file, dst_name, &sys_info);
+	}
 
-	// Get the entries of the folder
-	entries = get_dir_entries(dir);
+	// Unlink the file from the source dir, which was changed if it's the destination dir
+	if (src_dir.inode == dst_dir.inode)
+	{
+		src_dir = dst_dir;
+	}
+	remove_dir_entry(&src_dir, src_name, &sys_info);
 
-	// Try to find the file dir entry
-	file_entry = Utils::SearchFile(file_name, entries);
+	// If a dir moved to another dir, point it's parent entry at the new parent
+	if (file.is_dir && src_dir.inode != dst_dir.inode)
+	{
+		parent_dir_entry.inode = dst_dir.inode;
+		parent_dir_entry.type = ENTRY_TYPE_DIR;
+		parent_dir_entry.name = "..";
+		update_dir_entry(&file, parent_dir_entry, &sys_info);
+	}
 
-	// If the file isn't found, throw error
-	if (file_entry.inode == 0)
+	// The replaced destination isn't linked anymore, release it and return it's blocks in the background
+	if (dst_file.inode != 0)
 	{
-		throw MyFsException("Unable to find the file '" + file_name + "'!");
+		remove_entry(dst_file.inode, &sys_info);
+		reclaim_block_chain(dst_file.first_block, &sys_info);
 	}
 
-	// Try to get the file entry
-	file = get_file_entry(file_entry.inode);
-	if (file.inode == 0)
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::check_writable()
+{
+	check_mount_writable();
+
+	// If a snapshot is used, throw error
+	if (!_snapshot_name.empty())
 	{
-		throw MyFsException("An error occurred while searching the file's entry!");
+		throw MyFsException("The snapshot '" + _snapshot_name + "' is read-only!");
 	}
+}
 
-	// If the file is a dir, throw error
-	if (file.is_dir)
+template <typename Geometry>
+void MyFsVolume<Geometry>::check_mount_writable()
+{
+	// If the device is read-only, throw error
+	if (_read_only)
 	{
-		throw MyFsException("Unable to find the file '" + file_name + "'!");
+		throw MyFsException("The file system is mounted read-only!");
 	}
+}
+
+template <typename Geometry>
+void MyFsVolume<Geometry>::clone(const std::string &src_path_str, const std::string &dst_path_str)
+{
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_CLONE, src_path_str, dst_path_str);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	std::string_view src_path, src_name, dst_path, dst_name;
+	struct myfs_entry src_file, dst_dir, dst_file;
+	struct myfs_block_info block_info;
+	struct myfs_info sys_info = {0};
 
-	// Allocate memory for file
-	content = new char[file.size];
+	// Snapshots are read-only
+	check_writable();
 
-	// Get the file's content
-	get_file(file, content);
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-	// Copy the content of the file to a string
-	content_str.assign(content, file.size);
+	// Find the source file and the destination dir, the clone shares the source's blocks so they are written back first
+	split_path(src_path_str, src_path, src_name);
+	src_file = find_file(src_path, src_name);
+	write_back(&src_file, &sys_info);
+	split_path(dst_path_str, dst_path, dst_name);
+	dst_dir = get_dir(dst_path);
 
-	// Return the string with the content
-	return content_str;
+	// Check the destination name before anything is allocated for it
+	check_new_name(dst_dir, dst_name);
+
+	// Allocate the new file and point it at the source's blocks
+	dst_file = allocate_file(false, dst_dir.group, &sys_info);
+	dst_file.first_block = src_file.first_block;
+	dst_file.size = src_file.size;
+	update_entry(&dst_file);
+
+	// The new file holds another reference to the first block, the rest of the chain is referenced through it
+	if (dst_file.first_block != 0)
+	{
+		block_info = get_block_info(dst_file.first_block);
+		block_info.ref_count++;
+		set_block_info(dst_file.first_block, &block_info);
+	}
+
+	// Add a dir entry for the file in the dir file
+	add_dir_entry(&dst_dir, &dst_file, dst_name, &sys_info);
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
 }
 
-void MyFs::create_file(std::string path_str, bool directory)
+template <typename Geometry>
+void MyFsVolume<Geometry>::create_snapshot(const std::string &name)
 {
-	std::vector<std::string> tokens;
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_CREATE_SNAPSHOT, name);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+	struct myfs_block_info block_table[BLOCK_COUNT];
+	struct myfs_entry *entries = new struct myfs_entry[(INODE_TABLE_BLOCKS * BLOCK_SIZE) / sizeof(struct myfs_entry)]();
+	struct myfs_snapshot *snapshot = nullptr;
 
-	// If the path has dirs in it
-	if (path_str.find('/') != std::string::npos)
-	{
-		// Split the path into tokens
-		tokens = Utils::Split(path_str, '/');
+	// Snapshots are read-only
+	check_writable();
 
-		// Get the path without the file name
-		path_str = path_str.substr(0, path_str.size() - tokens.back().length());
+	// The snapshot holds the files as they are on the device
+	write_back_all();
+
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-		if (!directory)
+	// Check the name and find a free snapshot slot
+	if (name.length() == 0 || name.length() > MAX_SNAPSHOT_NAME_LENGTH)
+	{
+		delete[] entries;
+		throw MyFsException("Invalid snapshot name '" + name + "'!");
+	}
+	for (auto &current_snapshot : sys_info.snapshots)
+	{
+		if (current_snapshot.name == name)
+		{
+			delete[] entries;
+			throw MyFsException("Snapshot with the name '" + name + "' already exists!");
+		}
+		else if (snapshot == nullptr && current_snapshot.name[0] == 0)
 		{
-			// Create the file
-			create_file(path_str, tokens.back());
-		} else {
-			// Create the dir
-			create_dir(path_str, tokens.back());
-		}		
+			snapshot = &current_snapshot;
+		}
 	}
-	else
+	if (snapshot == nullptr)
+	{
+		delete[] entries;
+		throw MyFsException("Too many snapshots!");
+	}
+
+	// Read the initialized part of the inode table and the block table, the rest of the copy stays empty
+	blkdevsim->read(BLOCK_SIZE, get_header().inode_table_blocks * BLOCK_SIZE, (char *)entries);
+	blkdevsim->read((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, sizeof(block_table), (char *)block_table);
+
+	// Every file in the snapshot takes a reference to it's first block
+	for (uint32_t i = 0; i < (INODE_TABLE_BLOCKS * BLOCK_SIZE) / sizeof(struct myfs_entry); i++)
 	{
-		if (!directory)
+		if (entries[i].inode != 0 && entries[i].first_block != 0)
 		{
-			// Create the file
-			create_file("./", path_str);
-		} else {
-			// Create the dir
-			create_dir("./", path_str);
-		}	
+			block_table[entries[i].first_block].ref_count++;
+		}
 	}
+	blkdevsim->write((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, sizeof(block_table), (const char *)block_table);
+
+	// Save the copy of the inode table, the empty parts of it are left as holes
+	snapshot->inode_table = write_block_chain((const char *)entries, INODE_TABLE_BLOCKS * BLOCK_SIZE, 0, FIRST_DATA_BLOCK, &sys_info);
+	strncpy(snapshot->name, name.c_str(), sizeof(snapshot->name));
+
+	// Release the memory allocated for the inode table
+	delete[] entries;
+
+	// Overwrite the file system info structure
+	blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
 }
 
-std::string MyFs::get_content(std::string path_str)
+template <typename Geometry>
+void MyFsVolume<Geometry>::delete_snapshot(const std::string &name)
 {
-	std::vector<std::string> tokens;
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_DELETE_SNAPSHOT, name);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+	struct myfs_entry table_entry = {0};
+	struct myfs_entry *entries = nullptr;
 
-	// If the path has dirs in it
-	if (path_str.find('/') != std::string::npos)
-	{
-		// Split the path into tokens
-		tokens = Utils::Split(path_str, '/');
+	// Snapshots can be deleted while one is used, but not through a read-only mount
+	check_mount_writable();
 
-		// Get the path without the file name
-		path_str = path_str.substr(0, path_str.size() - tokens.back().length());
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-		// Read the content of the file
-		return read_file(path_str, tokens.back());
-	}
-	else
+	for (auto &snapshot : sys_info.snapshots)
 	{
-		// Read the content of the file
-		return read_file("./", path_str);
+		if (snapshot.name[0] == 0 || snapshot.name != name)
+		{
+			continue;
+		}
+
+		// If the snapshot is used, go back to the live filesystem
+		if (_snapshot_name == name)
+		{
+			use_snapshot("");
+		}
+
+		// Read the snapshot's copy of the inode table
+		table_entry.first_block = snapshot.inode_table;
+		table_entry.size = INODE_TABLE_BLOCKS * BLOCK_SIZE;
+		entries = new struct myfs_entry[(INODE_TABLE_BLOCKS * BLOCK_SIZE) / sizeof(struct myfs_entry)];
+		get_file(table_entry, (char *)entries);
+
+		// Drop the references of the snapshot's files, blocks used only by the snapshot are released in the background
+		for (uint32_t i = 0; i < (INODE_TABLE_BLOCKS * BLOCK_SIZE) / sizeof(struct myfs_entry); i++)
+		{
+			if (entries[i].inode != 0)
+			{
+				reclaim_block_chain(entries[i].first_block, &sys_info);
+			}
+		}
+		reclaim_block_chain(snapshot.inode_table, &sys_info);
+
+		// Free the snapshot's slot
+		memset(&snapshot, 0, sizeof(snapshot));
+
+		// Release the memory allocated for the inode table
+		delete[] entries;
+
+		// Overwrite the file system info structure
+		blkdevsim->write(sizeof(struct myfs_header), sizeof(sys_info), (const char *)&sys_info);
+		return;
 	}
+
+	throw MyFsException("Unable to find the snapshot '" + name + "'!");
 }
 
-void MyFs::set_content(std::string path_str, std::string content)
+template <typename Geometry>
+std::vector<std::string> MyFsVolume<Geometry>::list_snapshots()
 {
-	std::vector<std::string> tokens;
-
-	// If the path has dirs in it
-	if (path_str.find('/') != std::string::npos)
-	{
-		// Split the path into tokens
-		tokens = Utils::Split(path_str, '/');
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_LIST_SNAPSHOTS);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+	std::vector<std::string> names;
 
-		// Get the path without the file name
-		path_str = path_str.substr(0, path_str.size() - tokens.back().length());
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-		// Write the content into the file
-		write_file(path_str, tokens.back(), content);
-	}
-	else
+	// Get the names of the used snapshot slots
+	for (auto &snapshot : sys_info.snapshots)
 	{
-		// Write the content into the file
-		write_file("./", path_str, content);
+		if (snapshot.name[0] != 0)
+		{
+			names.push_back(snapshot.name);
+		}
 	}
+
+	return names;
 }
 
-std::string MyFs::change_directory(std::string path_str)
+template <typename Geometry>
+void MyFsVolume<Geometry>::use_snapshot(const std::string &name)
 {
-	std::vector<std::string> tokens;
+	MyFsTraceScope trace(_trace, MyFsTrace::TRACE_USE_SNAPSHOT, name);
+	std::lock_guard<std::recursive_mutex> lock(_lock);
+	struct myfs_info sys_info = {0};
+	struct myfs_entry table_entry = {0};
 
-	// If the path has dirs in it
-	if (path_str.find('/') != std::string::npos)
+	// The handles refer to the files of the file system that is used
+	for (auto &open_file : _open_files)
 	{
-		// Split the path into tokens
-		tokens = Utils::Split(path_str, '/');
-
-		// Get the path without the file name
-		path_str = path_str.substr(0, path_str.size() - tokens.back().length());
-
-		// Change directory
-		return change_directory(path_str, tokens.back());
+		open_file.second.stale = true;
 	}
-	else
+
+	// If no name was passed, go back to the live filesystem
+	if (name.empty())
 	{
-		// Change directory
-		return change_directory("./", path_str);
+		_snapshot_name.clear();
+		_snapshot_entries.clear();
+		_current_dir_inode = 1;
+		return;
 	}
-}
-
-MyFs::dir_list MyFs::list_dir(std::string path_str)
-{
-	struct myfs_entry dir;
-	struct myfs_entry file_entry;
-	struct dir_list_entry dir_entry;
-	dir_entries entries;
-	dir_list ans;
 
-	// Get the dir from the path
-	dir = get_dir(path_str);
+	// The live file system isn't browsed while the snapshot is used, so it's cache is written back
+	write_back_all();
 
-	// Get the entries of the folder
-	entries = get_dir_entries(dir);
+	// Get the file system info struct
+	blkdevsim->read(sizeof(struct myfs_header), sizeof(sys_info), (char *)&sys_info);
 
-	// For each entry create a dir list item
-	for (auto& entry : entries)
+	for (auto &snapshot : sys_info.snapshots)
 	{
-		// Get the file entry of the dir entry
-		file_entry = get_file_entry(entry.inode);
-		if (file_entry.inode == 0)
+		if (snapshot.name[0] == 0 || snapshot.name != name)
 		{
-			throw MyFsException("Unable to get the file's inode entry!");
+			continue;
 		}
 
-		// Set dir entry properties
-		dir_entry.name = std::string(entry.name);
-		dir_entry.is_dir = file_entry.is_dir;
-		dir_entry.file_size = file_entry.size;
+		// Load the snapshot's copy of the inode table
+		table_entry.first_block = snapshot.inode_table;
+		table_entry.size = INODE_TABLE_BLOCKS * BLOCK_SIZE;
+		_snapshot_entries.resize((INODE_TABLE_BLOCKS * BLOCK_SIZE) / sizeof(struct myfs_entry));
+		get_file(table_entry, (char *)_snapshot_entries.data());
 
-		// Add dir entry
-		ans.push_back(dir_entry);
+		// Browse the snapshot from it's root
+		_snapshot_name = name;
+		_current_dir_inode = 1;
+		return;
 	}
 
-	return ans;
+	throw MyFsException("Unable to find the snapshot '" + name + "'!");
 }
+
+// Every geometry is built, MyFs::mount picks the one of the device
+template class MyFsVolume<myfs_geometry_1k>;
+template class MyFsVolume<myfs_geometry_4k>;
+template class MyFsVolume<myfs_geometry_16k>;
+template class MyFsVolume<myfs_geometry_64k>;
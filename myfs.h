@@ -1,21 +1,64 @@
 #ifndef __MYFS_H__
 #define __MYFS_H__
 
+#include <chrono>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
+#include <functional>
+#include <unordered_map>
 #include <bitset>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <stdint.h>
 #include "blkdev.h"
+#include "myfs_geometry.h"
 
-#define BLOCK_SIZE 4096
-#define BLOCK_DATA_SIZE (BLOCK_SIZE - sizeof(uint32_t))
+#define RECLAIM_QUEUE_SIZE 64
+#define RECLAIM_BATCH_BLOCKS 16
 
-#define INODE_TABLE_BLOCKS 7
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 32
+
+#define WRITEBACK_MAX_BYTES (DEVICE_SIZE / 4)
+#define WRITEBACK_DELAY_MS 50
+
+#define MAX_SNAPSHOTS 8
+#define MAX_SNAPSHOT_NAME_LENGTH 15
+
+class MyFsTrace;
 
 class MyFs
 {
   public:
-	MyFs(BlockDeviceSimulator *blkdevsim_);
+	/**
+	 * mount method
+	 * Mounts the myfs instance of the device, a device without one is
+	 * formatted with blocks of block_size bytes. The instance is mounted
+	 * with the geometry of the block size it was formatted with, and a
+	 * device of a block size myfs has no geometry for is refused, and
+	 * MyFsException is thrown.
+	 * A read-only device is mounted read-only: it's never formatted or
+	 * written, every change throws MyFsException, and the inode table is
+	 * indexed once at mount, so many processes can serve the same image.
+	 * @param blkdevsim_ the device
+	 * @param block_size the block size a new instance is formatted with
+	 * @return the file system, it's unmounted when it's deleted
+	 */
+	static std::unique_ptr<MyFs> mount(BlockDeviceSimulator *blkdevsim_, uint32_t block_size = MYFS_DEFAULT_BLOCK_SIZE);
+
+	/**
+	 * format method
+	 * Formats the device with blocks of block_size bytes, whatever the
+	 * device held before, and mounts it.
+	 * @param blkdevsim_ the device
+	 * @param block_size the block size the device is formatted with
+	 * @return the file system, it's unmounted when it's deleted
+	 */
+	static std::unique_ptr<MyFs> format(BlockDeviceSimulator *blkdevsim_, uint32_t block_size);
+	virtual ~MyFs();
 
 	/**
 	 * dir_list_entry struct
@@ -38,35 +81,123 @@ class MyFs
 		 * File size
 		 */
 		int file_size;
+
+		/**
+		 * The inode of the file, used to list a sub directory without
+		 * resolving it's path again
+		 */
+		uint32_t inode;
 	};
 	typedef std::vector<struct dir_list_entry> dir_list;
 
+	/**
+	 * tree_visitor type
+	 * Called by walk_tree for every file under the walked directory, with
+	 * the depth of the file (0 for the files right in the directory) and
+	 * whether it's the last file of it's directory.
+	 */
+	typedef std::function<void(const struct dir_list_entry &entry, uint32_t depth, bool is_last)> tree_visitor;
+
+	/**
+	 * defrag_progress struct
+	 * This struct is passed to the defrag callback after every file.
+	 */
+	struct defrag_progress
+	{
+		/**
+		 * The amount of files that are checked, and how many were checked
+		 */
+		uint32_t files_total;
+		uint32_t files_done;
+
+		/**
+		 * The amount of files that were relocated and the blocks they moved
+		 */
+		uint32_t files_moved;
+		uint32_t blocks_moved;
+	};
+
+	/**
+	 * defrag_callback type
+	 * Called by defrag after every file. Returning false stops the defrag.
+	 */
+	typedef std::function<bool(const struct defrag_progress &progress)> defrag_callback;
+
+	/**
+	 * The group is the block group the file's blocks are placed in, a file
+	 * is in the group of the dir it was created in.
+	 */
 	struct myfs_entry
 	{
 		uint32_t inode;
 		uint32_t first_block;
 		uint32_t size;
 		bool is_dir;
+		uint8_t flags;
+		uint16_t group;
 	};
 
+	static const uint8_t ENTRY_FLAG_INDEXED_DIR = 0x01;
+
 	struct myfs_dir
 	{
 		uint32_t amount;
 	};
 
+	/**
+	 * Every entry of a directory is saved in the directory's data as a
+	 * myfs_dir_record followed by the entry's name (without a null terminator),
+	 * so the entries are packed one after another without any padding.
+	 */
+	struct __attribute__((packed)) myfs_dir_record
+	{
+		uint32_t inode;
+		uint8_t name_length;
+		uint8_t type;
+	};
+
 	struct myfs_dir_entry
 	{
 		uint32_t inode;
-		char name[10];
+		uint8_t type;
+		std::string name;
 	};
 	typedef std::vector<struct myfs_dir_entry> dir_entries;
 
+	/**
+	 * An operation collected by a Batch, either a create or a content write.
+	 */
+	struct myfs_batch_operation
+	{
+		std::string path;
+		bool is_create;
+		bool is_dir;
+		std::string content;
+	};
+
+	static const uint8_t ENTRY_TYPE_FILE = 0x01;
+	static const uint8_t ENTRY_TYPE_DIR = 0x02;
+
+	static const uint32_t MAX_NAME_LENGTH = 255;
+
+	/**
+	 * Access hints tell how a file is going to be read.
+	 * Sequential files are read ahead with the biggest window right away,
+	 * random files are never read ahead, and the cached blocks of dontneed
+	 * files are dropped after they are read. Other files are read ahead once
+	 * their chain is found to be laid out in order.
+	 */
+	static const uint8_t ACCESS_NORMAL = 0x00;
+	static const uint8_t ACCESS_SEQUENTIAL = 0x01;
+	static const uint8_t ACCESS_RANDOM = 0x02;
+	static const uint8_t ACCESS_DONTNEED = 0x03;
+
 	/**
 	 * format method
 	 * This function discards the current content in the blockdevice and
 	 * create a fresh new MYFS instance in the blockdevice.
 	 */
-	void format();
+	virtual void format() = 0;
 
 	/**
 	 * create_file method
@@ -74,7 +205,7 @@ class MyFs
 	 * @param path_str the file path (e.g. "/newfile")
 	 * @param directory boolean indicating whether this is a file or directory
 	 */
-	void create_file(std::string path_str, bool directory);
+	virtual void create_file(const std::string &path_str, bool directory) = 0;
 
 	/**
 	 * get_content method
@@ -84,17 +215,284 @@ class MyFs
 	 * @param path_str the file path (e.g. "/somefile")
 	 * @return the content of the file
 	 */
-	std::string get_content(std::string path_str);
+	virtual std::string get_content(const std::string &path_str) = 0;
 
 	/**
 	 * set_content method
 	 * Sets the whole content of the file indicated by path_str param.
+	 * The content is kept in the write-back cache, and it's blocks are
+	 * allocated and written only when it's written back: in the background
+	 * after a short delay, when the cache is full, when another operation
+	 * needs the file's blocks, or on sync and unmount. Content that doesn't
+	 * fit in the cache or on the device is written right away.
 	 * Note: this method assumes path_str refers to a file and not a
 	 * directory.
 	 * @param path_str the file path (e.g. "/somefile")
 	 * @param content the file content string
 	 */
-	void set_content(std::string path_str, std::string content);
+	virtual void set_content(const std::string &path_str, const std::string &content) = 0;
+
+	/**
+	 * sync method
+	 * Writes back all the content of the write-back cache.
+	 */
+	virtual void sync() = 0;
+
+	/**
+	 * FileReader class
+	 * Reads a file in chunks, so only the caller's buffer holds the file's
+	 * content. Holes are read as zeros.
+	 */
+	class FileReader
+	{
+	  public:
+		/**
+		 * @param myfs the file system holding the file
+		 * @param path_str the file path (e.g. "/somefile")
+		 */
+		FileReader(MyFs &myfs, const std::string &path_str);
+
+		/**
+		 * read method
+		 * Reads the next chunk of the file.
+		 * @param buffer the buffer to read into
+		 * @param size the size of the buffer
+		 * @return the amount of bytes read, 0 at the end of the file
+		 */
+		uint32_t read(char *buffer, uint32_t size);
+
+		/**
+		 * eof method
+		 * @return whether the whole file was read
+		 */
+		bool eof() const;
+
+	  private:
+		MyFs &_myfs;
+		std::string _path;
+		uint32_t _inode;
+		uint32_t _offset;
+		uint32_t _size;
+	};
+
+	/**
+	 * FileWriter class
+	 * Re-sets the content of a file in chunks. The file is emptied when the
+	 * writer is created, and the chunks are appended to it block by block,
+	 * so only a single block of the content is held in memory.
+	 */
+	class FileWriter
+	{
+	  public:
+		/**
+		 * @param myfs the file system holding the file
+		 * @param path_str the file path (e.g. "/somefile")
+		 */
+		FileWriter(MyFs &myfs, const std::string &path_str);
+		~FileWriter();
+
+		/**
+		 * write method
+		 * Appends a chunk to the file.
+		 * @param data the chunk's data
+		 * @param size the size of the chunk
+		 */
+		void write(const char *data, uint32_t size);
+
+		/**
+		 * close method
+		 * Writes the part of the content that wasn't written yet. Called
+		 * by the destructor if it wasn't called before.
+		 */
+		void close();
+
+	  private:
+		MyFs &_myfs;
+		std::string _path;
+		uint32_t _inode;
+		uint32_t _offset;
+		std::vector<char> _buffer;
+		uint32_t _block_data_size;
+		bool _closed;
+
+		void flush(uint32_t size);
+	};
+
+	/**
+	 * Batch class
+	 * Collects creates and writes, and applies all of them together on
+	 * commit. Every dir on the paths is read once, all the new entries of a
+	 * dir are merged into a single rewrite of it, and the inode table and the
+	 * file system info are written once for the whole batch. Nothing is
+	 * changed before commit, and if commit fails nothing is changed at all.
+	 * Paths may refer to dirs created earlier in the same batch.
+	 */
+	class Batch
+	{
+	  public:
+		/**
+		 * @param myfs the file system the batch is applied to
+		 */
+		Batch(MyFs &myfs);
+
+		/**
+		 * create_file method
+		 * Adds the creation of a file or a dir to the batch.
+		 * @param path_str the file path (e.g. "/newfile")
+		 * @param directory whether this is a file or directory
+		 */
+		void create_file(const std::string &path_str, bool directory);
+
+		/**
+		 * set_content method
+		 * Adds setting the whole content of a file to the batch. The file
+		 * may be created earlier in the same batch.
+		 * @param path_str the file path (e.g. "/somefile")
+		 * @param content the file content string
+		 */
+		void set_content(const std::string &path_str, const std::string &content);
+
+		/**
+		 * commit method
+		 * Applies all the operations of the batch, in the order they were
+		 * added. The batch is empty afterwards, even if the commit failed.
+		 */
+		void commit();
+
+	  private:
+		MyFs &_myfs;
+		std::vector<struct myfs_batch_operation> _operations;
+	};
+
+	/**
+	 * read_content method
+	 * Returns a range of the content of the file indicated by path_str param.
+	 * Holes in the file are read as zeros without touching the device.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @param offset the offset of the range in the file
+	 * @param size the size of the range, it's cut at the end of the file
+	 * @return the content of the range
+	 */
+	virtual std::string read_content(const std::string &path_str, uint32_t offset, uint32_t size) = 0;
+
+	/**
+	 * write_content method
+	 * Writes content at an offset of the file indicated by path_str param,
+	 * growing the file if needed. Blocks that aren't written are left
+	 * unallocated, so writing past the end of the file creates a hole.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @param offset the offset in the file to write at
+	 * @param content the content to write
+	 */
+	virtual void write_content(const std::string &path_str, uint32_t offset, const std::string &content) = 0;
+
+	/**
+	 * seek_data method
+	 * Like lseek's SEEK_DATA, finds the next allocated range of the file.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @param offset the offset to start searching from
+	 * @return the first offset at or after offset that holds data, or the
+	 *	file size if there is no more data
+	 */
+	virtual uint32_t seek_data(const std::string &path_str, uint32_t offset) = 0;
+
+	/**
+	 * seek_hole method
+	 * Like lseek's SEEK_HOLE, finds the next hole of the file. The end of
+	 * the file is considered a hole.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @param offset the offset to start searching from
+	 * @return the first offset at or after offset that is in a hole
+	 */
+	virtual uint32_t seek_hole(const std::string &path_str, uint32_t offset) = 0;
+
+	/**
+	 * open method
+	 * Opens a file for ranged reads and writes. The handle keeps the file's
+	 * entry and the map of it's blocks, so operations on the handle don't
+	 * resolve the path or walk the block chain. The map is loaded again
+	 * only after the file's blocks changed, by the handle or by any other
+	 * operation. The handle refers to the file even if it's renamed, and
+	 * using it after the file is removed throws MyFsException. Format
+	 * closes all the handles.
+	 * Note: this method assumes path_str refers to a file and not a
+	 * directory.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @return the handle of the file
+	 */
+	virtual uint32_t open(const std::string &path_str) = 0;
+
+	/**
+	 * close method
+	 * @param handle a handle returned by open
+	 */
+	virtual void close(uint32_t handle) = 0;
+
+	/**
+	 * read_content method
+	 * Like read_content of a path, for a file opened by open.
+	 * @param handle a handle returned by open
+	 * @param offset the offset of the range in the file
+	 * @param size the size of the range, it's cut at the end of the file
+	 * @return the content of the range
+	 */
+	virtual std::string read_content(uint32_t handle, uint32_t offset, uint32_t size) = 0;
+
+	/**
+	 * write_content method
+	 * Like write_content of a path, for a file opened by open. A range that
+	 * is inside the allocated blocks of the file, which aren't shared with
+	 * other files, is written in place using the map of the handle.
+	 * @param handle a handle returned by open
+	 * @param offset the offset in the file to write at
+	 * @param content the content to write
+	 */
+	virtual void write_content(uint32_t handle, uint32_t offset, const std::string &content) = 0;
+
+	/**
+	 * set_access_hint method
+	 * Sets how a file is going to be read. The hint is kept in memory until
+	 * the file is removed. Setting ACCESS_DONTNEED also drops the cached
+	 * blocks of the file right away.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @param hint one of the ACCESS_ hints
+	 */
+	virtual void set_access_hint(const std::string &path_str, uint8_t hint) = 0;
+
+	/**
+	 * get_free_blocks method
+	 * @return the amount of free data blocks
+	 */
+	virtual uint32_t get_free_blocks() = 0;
+
+	/**
+	 * get_free_inodes method
+	 * @return the amount of files that can still be created
+	 */
+	virtual uint32_t get_free_inodes() = 0;
+
+	/**
+	 * get_fragments method
+	 * Returns the amount of fragments of a file: the amount of runs of
+	 * blocks that are contiguous and ascending on the device.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @return the amount of fragments, 0 for files without blocks
+	 */
+	virtual uint32_t get_fragments(const std::string &path_str) = 0;
+
+	/**
+	 * defrag method
+	 * Relocates the blocks of every fragmented file into a single ascending
+	 * run of blocks. The file system is unlocked between files, so it stays
+	 * usable while it's defragmented. Files that share blocks with other
+	 * files (clones, snapshots, deduplicated blocks) and indexed dirs are
+	 * skipped, since other pointers to their blocks can't be moved.
+	 * @param progress called after every file, may be empty
+	 * @param max_blocks_per_second the maximum rate of blocks to relocate,
+	 *	0 for no limit
+	 * @return the progress at the end of the defrag
+	 */
+	virtual struct defrag_progress defrag(defrag_callback progress, uint32_t max_blocks_per_second) = 0;
 
 	/**
 	 * list_dir method
@@ -105,11 +503,153 @@ class MyFs
 	 * @return a vector of dir_list_entry structures, one for each file in
 	 *	the directory.
 	 */
-	dir_list list_dir(std::string path_str);
+	virtual dir_list list_dir(const std::string &path_str) = 0;
 
-	std::string change_directory(std::string path);
+	/**
+	 * list_dir method
+	 * Returns a list of the files in a directory, found by it's inode.
+	 * The name, the type and the size of all the files are returned in one
+	 * pass over the inode table.
+	 * @param dir_inode the inode of the directory (e.g. the inode of a
+	 *	dir_list_entry)
+	 * @return a vector of dir_list_entry structures, one for each file in
+	 *	the directory.
+	 */
+	virtual dir_list list_dir(uint32_t dir_inode) = 0;
+
+	/**
+	 * walk_tree method
+	 * Walks all the files under a directory, depth first. Sub directories
+	 * are entered by their inode, and the inode table is read only once for
+	 * the whole walk. The "." and ".." entries are skipped.
+	 * @param path_str the directory path (e.g. "/somedir")
+	 * @param visitor the function called for every file
+	 */
+	virtual void walk_tree(const std::string &path_str, tree_visitor visitor) = 0;
+
+	virtual std::string change_directory(const std::string &path_str) = 0;
+
+	/**
+	 * remove_file method
+	 * Removes a file. The file is detached right away, and it's blocks are
+	 * returned to the free blocks in the background.
+	 * Note: this method assumes path_str refers to a file and not a
+	 * directory.
+	 * @param path_str the file path (e.g. "/somefile")
+	 */
+	virtual void remove_file(const std::string &path_str) = 0;
+
+	/**
+	 * remove_dir method
+	 * Removes an empty directory.
+	 * @param path_str the directory path (e.g. "/somedir")
+	 */
+	virtual void remove_dir(const std::string &path_str) = 0;
+
+	/**
+	 * truncate method
+	 * Sets the size of a file. If the file shrinks, the blocks after the new
+	 * end are returned to the free blocks in the background. If it grows,
+	 * the new part is a hole.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @param size the new size of the file
+	 */
+	virtual void truncate(const std::string &path_str, uint32_t size) = 0;
+
+	/**
+	 * rename method
+	 * Moves a file or a directory to a new path, within the same directory
+	 * or across directories, without copying it's content. If the new path
+	 * exists, it is replaced: a file can replace a file and a directory can
+	 * replace an empty directory.
+	 * @param src_path_str the current path (e.g. "/somefile")
+	 * @param dst_path_str the new path (e.g. "/somedir/newname")
+	 */
+	virtual void rename(const std::string &src_path_str, const std::string &dst_path_str) = 0;
+
+	/**
+	 * clone method
+	 * Creates a new file which shares all the blocks of an existing file.
+	 * The blocks are copied only when one of the files is written to.
+	 * Note: this method assumes src_path_str refers to a file and not a
+	 * directory.
+	 * @param src_path_str the path of the file to clone (e.g. "/somefile")
+	 * @param dst_path_str the path of the new file (e.g. "/newfile")
+	 */
+	virtual void clone(const std::string &src_path_str, const std::string &dst_path_str) = 0;
+
+	/**
+	 * create_snapshot method
+	 * Takes a read-only snapshot of the whole filesystem. The snapshot
+	 * shares all the blocks of the filesystem, so only the inode table is
+	 * copied.
+	 * @param name the name of the snapshot
+	 */
+	virtual void create_snapshot(const std::string &name) = 0;
+
+	/**
+	 * delete_snapshot method
+	 * Deletes a snapshot and releases the blocks only it was using.
+	 * @param name the name of the snapshot
+	 */
+	virtual void delete_snapshot(const std::string &name) = 0;
+
+	/**
+	 * list_snapshots method
+	 * @return the names of the existing snapshots
+	 */
+	virtual std::vector<std::string> list_snapshots() = 0;
+
+	/**
+	 * use_snapshot method
+	 * Switches to browsing a snapshot. While a snapshot is used, the
+	 * filesystem is read-only. The current directory is set to the root.
+	 * @param name the name of the snapshot, or an empty string to go back
+	 *	to the live filesystem
+	 */
+	virtual void use_snapshot(const std::string &name) = 0;
+
+	/**
+	 * set_dedup method
+	 * Enables or disables block deduplication. While enabled, every written
+	 * block is fingerprinted and blocks with identical contents are shared
+	 * instead of being allocated again. The blocks are chained through
+	 * themselves, so a block is only shared by files whose content is the
+	 * same from that block to the end, at the same offset (copies of a file
+	 * or of it's tail), not by identical blocks inside different files.
+	 * @param enabled whether dedup mode should be enabled
+	 */
+	virtual void set_dedup(bool enabled) = 0;
+
+	/**
+	 * is_dedup_enabled method
+	 * @return whether dedup mode is enabled on the filesystem
+	 */
+	virtual bool is_dedup_enabled() = 0;
+
+	/**
+	 * get_block_size method
+	 * @return the size of the blocks the filesystem was formatted with
+	 */
+	virtual uint32_t get_block_size() = 0;
+
+	/**
+	 * set_trace method
+	 * Records every public operation of the file system, with it's arguments,
+	 * timing and result, into a trace. Reads and writes of FileReader and
+	 * FileWriter are recorded as ranges of their file.
+	 * @param trace the trace to record into, or nullptr to stop recording.
+	 *	It has to outlive the recording
+	 */
+	virtual void set_trace(MyFsTrace *trace) = 0;
+
+  protected:
+	friend class MyFsChecker;
+	template <typename Geometry>
+	friend class MyFsVolumeChecker;
+
+	MyFs();
 
-  private:
 	/**
 	 * This struct represents the first bytes of a myfs filesystem.
 	 * It holds some magic characters and a number indicating the version.
@@ -117,49 +657,430 @@ class MyFs
 	 * they both exist than the file is assumed to contain a valid myfs
 	 * instance. Otherwise, the blockdevice is formated and a new instance is
 	 * created.
+	 * The header also holds the mount state, and the amount of inode table
+	 * blocks that were initialized. Format initializes only the first
+	 * inode table block, and the next ones are zeroed when the table grows
+	 * into them, so the rest of the table is never read.
+	 * The block size is kept as a power of two, and the device is mounted
+	 * with the geometry of that block size.
+	 * The stripe size and the amount of images the device was spread over
+	 * when it was formatted are kept too, since the blocks end up in the
+	 * wrong places if the images are put together in any other way. A
+	 * single image has a stripe size of 0.
 	 */
 	struct myfs_header
 	{
 		char magic[4];
 		uint8_t version;
+		uint8_t state;
+		uint8_t inode_table_blocks;
+		uint8_t block_shift;
+		uint32_t stripe_size;
+		uint32_t member_count;
+	};
+
+	/**
+	 * A snapshot is a copy of the inode table, saved as a block chain.
+	 * Every file in the snapshot holds a reference to it's first block, so
+	 * the blocks are kept until the snapshot is deleted. An empty name marks
+	 * an unused snapshot slot.
+	 */
+	struct myfs_snapshot
+	{
+		char name[MAX_SNAPSHOT_NAME_LENGTH + 1];
+		uint32_t inode_table;
+	};
+
+	/**
+	 * This struct holds the reference count and the content fingerprint of
+	 * a single block. The block table, placed right after the inode table,
+	 * holds one of these for every block on the device.
+	 * A fingerprint of 0 means the block's content wasn't fingerprinted.
+	 */
+	struct myfs_block_info
+	{
+		uint64_t fingerprint;
+		uint32_t ref_count;
+	};
+	/**
+	 * Big directories are saved as an index: the first block of the dir
+	 * holds a myfs_dir_index followed by an array of myfs_dir_index_entry
+	 * sorted by hash, and every index entry points at a leaf block holding
+	 * the entries whose name hash is between the entry's hash and the next
+	 * entry's hash. Leaves are laid out like a small dir (a myfs_dir followed
+	 * by the records) and are chained after the index block in hash order.
+	 */
+	struct myfs_dir_index
+	{
+		uint32_t amount;
+		uint32_t leaf_count;
+	};
+
+	struct myfs_dir_index_entry
+	{
+		uint32_t hash;
+		uint32_t block;
+	};
+
+	struct myfs_mapped_block
+	{
+		uint32_t logical_block;
+		uint32_t block_index;
+	};
+	typedef std::vector<struct myfs_mapped_block> block_map;
+
+	/**
+	 * A batch is applied to in memory copies of the file system info, the
+	 * inode table and every dir it touches, which are written only once all
+	 * the operations succeeded.
+	 */
+	struct myfs_batch_dir
+	{
+		size_t slot;
+		dir_entries entries;
+		std::unordered_map<std::string, size_t> names;
+		bool changed;
+	};
+
+	/**
+	 * The readahead state of a single walk over a block chain.
+	 * Once consecutive blocks of the chain are found to be next to each
+	 * other on the device, the blocks after them are prefetched, and the
+	 * window grows with every prefetch.
+	 */
+	struct myfs_readahead
+	{
+		uint8_t hint;
+		int32_t stride;
+		uint32_t run;
+		uint32_t window;
+		uint32_t prefetched_start;
+		uint32_t prefetched_end;
+	};
+
+	/**
+	 * The content of a file in the write-back cache. The file's entry and
+	 * blocks on the device are left as they were until it's written back,
+	 * so a file that is set again or removed before that never touches the
+	 * device for this content. Content stays cached until it's written
+	 * back successfully, and content the flusher failed to write back is
+	 * left for the next operation on the file, which reports the error.
+	 */
+	struct myfs_dirty_file
+	{
+		std::string content;
+		std::chrono::steady_clock::time_point dirtied;
+		bool failed;
+	};
+
+	/**
+	 * A file opened by open. Changing the entry or the blocks of a file
+	 * marks it's handles as stale, and a stale handle loads the entry and
+	 * the map again before it's used.
+	 */
+	struct myfs_open_file
+	{
+		struct myfs_entry entry;
+		block_map blocks;
+		bool stale;
 	};
 
+	// Where the operations are recorded, if they are
+	MyFsTrace *_trace;
+
+	static const uint8_t CURR_VERSION = 0x0D;
+	static const char *MYFS_MAGIC;
+
+	static const uint32_t FLAG_DEDUP = 0x01;
+
+	static const uint8_t STATE_CLEAN = 0x01;
+
+	static std::string describe_striping(uint32_t stripe_size, uint32_t member_count);
+
+	/**
+	 * The parts of FileReader, FileWriter and Batch that depend on the
+	 * layout of the device, they take the lock on their own.
+	 */
+	virtual struct myfs_entry begin_read(const std::string &path_str) = 0;
+	virtual uint32_t read_chunk(uint32_t inode, uint32_t offset, uint32_t size, char *buffer, uint32_t *file_size) = 0;
+	virtual uint32_t begin_write(const std::string &path_str) = 0;
+	virtual void write_chunk(uint32_t inode, uint32_t offset, const char *data, uint32_t size) = 0;
+	virtual void commit_batch(const std::vector<struct myfs_batch_operation> &operations) = 0;
+	virtual uint32_t get_block_data_size() = 0;
+
+	void split_path(std::string_view path_str, std::string_view &path, std::string_view &file_name);
+	static size_t find_mapped_block(const block_map &blocks, uint32_t logical_block);
+	static uint32_t count_fragments(const block_map &blocks);
+	static uint32_t pack_dir_entry(char *data, const struct myfs_dir_entry &entry);
+	static uint32_t pack_dir_entries(char *data, const dir_entries &entries);
+	static uint32_t unpack_dir_entries(const char *data, dir_entries &entries);
+	static struct myfs_dir_entry search_dir_records(const char *data, std::string_view name);
+};
+
+/**
+ * MyFsVolume class
+ * The file system of a device formatted with the blocks of the geometry.
+ * Every size and position of the layout is a constant of the geometry, so
+ * the arithmetic of the hot paths is folded into the code. It's built for
+ * every geometry in myfs_geometry.h, and MyFs::mount picks the one the
+ * device was formatted with.
+ */
+template <typename Geometry>
+class MyFsVolume : public MyFs
+{
+  public:
+	/**
+	 * Mounts the myfs instance of the device, a device without one is
+	 * formatted. A device holding myfs of another block size than the
+	 * geometry's is refused, and MyFsException is thrown.
+	 * @param blkdevsim_ the device
+	 */
+	MyFsVolume(BlockDeviceSimulator *blkdevsim_);
+	~MyFsVolume();
+
+	void format() override;
+	void create_file(const std::string &path_str, bool directory) override;
+	std::string get_content(const std::string &path_str) override;
+	void set_content(const std::string &path_str, const std::string &content) override;
+	void sync() override;
+	std::string read_content(const std::string &path_str, uint32_t offset, uint32_t size) override;
+	void write_content(const std::string &path_str, uint32_t offset, const std::string &content) override;
+	uint32_t seek_data(const std::string &path_str, uint32_t offset) override;
+	uint32_t seek_hole(const std::string &path_str, uint32_t offset) override;
+	uint32_t open(const std::string &path_str) override;
+	void close(uint32_t handle) override;
+	std::string read_content(uint32_t handle, uint32_t offset, uint32_t size) override;
+	void write_content(uint32_t handle, uint32_t offset, const std::string &content) override;
+	void set_access_hint(const std::string &path_str, uint8_t hint) override;
+	uint32_t get_free_blocks() override;
+	uint32_t get_free_inodes() override;
+	uint32_t get_fragments(const std::string &path_str) override;
+	struct defrag_progress defrag(defrag_callback progress, uint32_t max_blocks_per_second) override;
+	dir_list list_dir(const std::string &path_str) override;
+	dir_list list_dir(uint32_t dir_inode) override;
+	void walk_tree(const std::string &path_str, tree_visitor visitor) override;
+	std::string change_directory(const std::string &path_str) override;
+	void remove_file(const std::string &path_str) override;
+	void remove_dir(const std::string &path_str) override;
+	void truncate(const std::string &path_str, uint32_t size) override;
+	void rename(const std::string &src_path_str, const std::string &dst_path_str) override;
+	void clone(const std::string &src_path_str, const std::string &dst_path_str) override;
+	void create_snapshot(const std::string &name) override;
+	void delete_snapshot(const std::string &name) override;
+	std::vector<std::string> list_snapshots() override;
+	void use_snapshot(const std::string &name) override;
+	void set_dedup(bool enabled) override;
+	bool is_dedup_enabled() override;
+	uint32_t get_block_size() override;
+	void set_trace(MyFsTrace *trace) override;
+
+  private:
+	template <typename VolumeGeometry>
+	friend class MyFsVolumeChecker;
+
+	static constexpr uint32_t BLOCK_SIZE = Geometry::BLOCK_SIZE;
+	static constexpr uint32_t BLOCK_DATA_SIZE = Geometry::BLOCK_DATA_SIZE;
+	static constexpr uint32_t BLOCK_COUNT = Geometry::BLOCK_COUNT;
+
+	static constexpr uint32_t INODE_TABLE_BLOCKS = Geometry::INODE_TABLE_BLOCKS;
+	static constexpr uint32_t BLOCK_TABLE_BLOCKS = Geometry::BLOCK_TABLE_BLOCKS;
+	static constexpr uint32_t FIRST_DATA_BLOCK = Geometry::FIRST_DATA_BLOCK;
+
+	static constexpr uint32_t BLOCKS_PER_GROUP = Geometry::BLOCKS_PER_GROUP;
+	static constexpr uint32_t BLOCK_GROUP_COUNT = Geometry::BLOCK_GROUP_COUNT;
+
+	static constexpr uint32_t INODE_TABLE_ENTRIES = (INODE_TABLE_BLOCKS * BLOCK_SIZE) / sizeof(struct myfs_entry);
+
+	/**
+	 * The reclaim queue holds the heads of block chains that are no longer
+	 * used by any file, but weren't returned to the block bitmap yet.
+	 * It's saved with the rest of the info, so reclamation resumes after
+	 * the filesystem is mounted again.
+	 * The free counters are kept up to date with the block bitmap and the
+	 * inode table, and are counted again only after an unclean unmount.
+	 * The block bitmap is made of the bitmaps of the block groups one after
+	 * another, and every group has it's own counters of free blocks and of
+	 * dirs, so allocation skips full groups and new dirs go to the groups
+	 * with the fewest dirs.
+	 */
 	struct myfs_info
 	{
 		uint32_t inode_count;
-		std::bitset<DEVICE_SIZE / BLOCK_SIZE> block_bitmap;
+		uint32_t flags;
+		std::bitset<BLOCK_COUNT> block_bitmap;
+		uint32_t reclaim_count;
+		uint32_t reclaim_queue[RECLAIM_QUEUE_SIZE];
+		struct myfs_snapshot snapshots[MAX_SNAPSHOTS];
+		uint32_t free_blocks;
+		uint32_t free_inodes;
+		uint32_t group_free_blocks[BLOCK_GROUP_COUNT];
+		uint32_t group_dirs[BLOCK_GROUP_COUNT];
 	};
+	static_assert(sizeof(struct myfs_header) + sizeof(struct myfs_info) <= BLOCK_SIZE, "The info doesn't fit in the header block");
 
+	static_assert(sizeof(struct myfs_block_info) * BLOCK_COUNT <= BLOCK_TABLE_BLOCKS * BLOCK_SIZE, "Block table doesn't fit in it's blocks");
+
+	/**
+	 * A file is a chain of blocks sorted by their logical block number.
+	 * Logical blocks that are missing from the chain are holes.
+	 */
 	struct myfs_block
 	{
 		char data[BLOCK_DATA_SIZE];
+		uint32_t logical_block;
 		uint32_t next_block;
 	};
 
+	/**
+	 * The in memory copies a batch is applied to, see myfs_batch_dir
+	 */
+	struct myfs_batch_state
+	{
+		struct myfs_info sys_info;
+		std::vector<struct myfs_entry> table;
+		uint8_t table_blocks;
+		size_t free_slot;
+		std::unordered_map<uint32_t, size_t> slots;
+		std::unordered_map<uint32_t, struct myfs_batch_dir> dirs;
+		std::vector<uint32_t> changed_dirs;
+		std::unordered_map<uint32_t, const std::string *> contents;
+	};
+
 	BlockDeviceSimulator *blkdevsim;
 
+	// Whether the device is read-only, the entries of a read-only mount never change so they are kept by inode
+	bool _read_only;
+	std::unordered_map<uint32_t, struct myfs_entry> _inodes;
+
 	uint32_t _current_dir_inode;
 
-	static const uint8_t CURR_VERSION = 0x03;
-	static const char *MYFS_MAGIC;
+	std::unordered_map<uint32_t, uint8_t> _access_hints;
+
+	std::string _snapshot_name;
+	std::vector<struct myfs_entry> _snapshot_entries;
+
+	// Set contents that weren't written back yet, by inode, with the bytes and the blocks they take
+	std::unordered_map<uint32_t, struct myfs_dirty_file> _dirty_files;
+	size_t _dirty_bytes;
+	uint32_t _dirty_blocks;
+
+	// The open files by handle, handles aren't reused
+	std::unordered_map<uint32_t, struct myfs_open_file> _open_files;
+	uint32_t _next_handle;
+
+	// Changed whenever the data of an allocated block is rewritten or released, so
+	// data that was read without the lock can be checked to be untouched
+	uint64_t _data_generation;
+
+	// The used blocks by their fingerprint, for dedup to find identical blocks without reading the block
+	// table, and the fingerprint every block is indexed by (0 if it isn't). Built at mount, and kept up to
+	// date by set_block_info
+	std::unordered_multimap<uint64_t, uint32_t> _fingerprints;
+	std::vector<uint64_t> _block_fingerprints;
+
+	std::recursive_mutex _lock;
+	std::condition_variable_any _reclaim_cond;
+
+	bool _stop_reclaimer;
+	std::thread _reclaimer;
+
+	std::condition_variable_any _writeback_cond;
+	bool _stop_flusher;
+	std::thread _flusher;
+
+	static constexpr uint32_t INDEXED_DIR_THRESHOLD = BLOCK_DATA_SIZE;
+	static constexpr uint32_t MAX_DIR_INDEX_ENTRIES = (BLOCK_DATA_SIZE - sizeof(struct myfs_dir_index)) / sizeof(struct myfs_dir_index_entry);
+
+	struct myfs_entry begin_read(const std::string &path_str) override;
+	uint32_t read_chunk(uint32_t inode, uint32_t offset, uint32_t size, char *buffer, uint32_t *file_size) override;
+	uint32_t begin_write(const std::string &path_str) override;
+	void write_chunk(uint32_t inode, uint32_t offset, const char *data, uint32_t size) override;
+	void commit_batch(const std::vector<struct myfs_batch_operation> &operations) override;
+	uint32_t get_block_data_size() override;
 
-	std::string change_directory(std::string path, std::string dir_name);
-	void create_dir(std::string path, std::string dir_name);
+	std::string change_directory(std::string_view path, std::string_view dir_name);
+	void create_dir(std::string_view path, std::string_view dir_name);
 	void init_dir(struct myfs_entry *dir_entry, struct myfs_entry *prev_dir_entry, struct myfs_info *sys_info);
-	std::string read_file(std::string path, std::string file_name);
-	void deallocate_block_chain(uint32_t block_chain_head);
-	void write_file(std::string path, std::string file_name, std::string content);
-	void add_dir_entry(struct myfs_entry *dir, struct myfs_entry *file_entry, std::string file_name);
-	void create_file(std::string path, std::string file_name);
+	struct myfs_entry find_file(std::string_view path, std::string_view file_name);
+	std::string read_file(std::string_view path, std::string_view file_name);
+	std::string read_file(std::string_view path, std::string_view file_name, std::unique_lock<std::recursive_mutex> &lock);
+	void read_file_range(const myfs_entry file_entry, uint32_t offset, uint32_t size, char *data);
+	void read_file_range(const myfs_entry &file_entry, const block_map &blocks, uint32_t offset, uint32_t size, char *data);
+	bool overwrite_file_range(const struct myfs_open_file &file, uint32_t offset, const char *data, uint32_t size);
+	struct myfs_open_file &get_open_file(uint32_t handle);
+	void invalidate_handles(uint32_t inode);
+	void write_file_range(struct myfs_entry *file_entry, uint32_t offset, const char *data, uint32_t size, struct myfs_info *sys_info);
+	void append_blocks(struct myfs_entry *file_entry, uint32_t offset, const char *data, uint32_t size, struct myfs_info *sys_info);
+	block_map get_block_map(uint32_t block_chain_head);
+	block_map get_block_map(uint32_t block_chain_head, uint8_t hint);
+	struct myfs_readahead init_readahead(uint8_t hint);
+	void readahead(struct myfs_readahead *state, uint32_t block_index, uint32_t next_block);
+	void drop_blocks(const block_map &blocks);
+	uint32_t defrag_file(uint32_t inode, struct myfs_info *sys_info);
+	uint32_t find_free_run(uint32_t size, uint32_t goal, struct myfs_info *sys_info);
+	static uint32_t find_free_block(uint32_t start, uint32_t end, const struct myfs_info *sys_info);
+	static void mark_block_used(uint32_t block_index, struct myfs_info *sys_info);
+	static void mark_block_free(uint32_t block_index, struct myfs_info *sys_info);
+	static uint32_t group_first_block(uint16_t group);
+	static uint16_t find_dir_group(uint16_t parent_group, const struct myfs_info *sys_info);
+	uint8_t get_access_hint(uint32_t inode);
+	struct myfs_header get_header();
+	void set_header(const struct myfs_header *header);
+	void zero_block(uint32_t block_index);
+	void set_next_block(uint32_t block_index, uint32_t next_block);
+	void deallocate_block_chain(uint32_t block_chain_head, struct myfs_info *sys_info);
+	uint32_t release_blocks(uint32_t block_chain_head, uint32_t max_blocks, struct myfs_info *sys_info);
+	void reclaim_block_chain(uint32_t block_chain_head, struct myfs_info *sys_info);
+	void reclaimer_loop();
+	bool cache_content(const struct myfs_entry &file_entry, const std::string &content);
+	void discard_dirty(uint32_t inode);
+	void write_back(struct myfs_entry *file_entry, struct myfs_info *sys_info);
+	void retry_write_back(struct myfs_entry *file_entry);
+	void write_back_all();
+	void flusher_loop();
+	void remove_entry(uint32_t inode, struct myfs_info *sys_info);
+	void remove_dir_entry(struct myfs_entry *dir, std::string_view name, struct myfs_info *sys_info);
+	void remove_indexed_dir_entry(struct myfs_entry *dir, std::string_view name, struct myfs_info *sys_info);
+	void update_dir_entry(struct myfs_entry *dir, const struct myfs_dir_entry &entry, struct myfs_info *sys_info);
+	void truncate_file(struct myfs_entry *file_entry, uint32_t size, struct myfs_info *sys_info);
+	void write_file(std::string_view path, std::string_view file_name, const std::string &content);
+	void check_new_name(const struct myfs_entry &dir, std::string_view file_name);
+	void add_dir_entry(struct myfs_entry *dir, struct myfs_entry *file_entry, std::string_view file_name, struct myfs_info *sys_info);
+	void add_indexed_dir_entry(struct myfs_entry *dir, const struct myfs_dir_entry &entry, struct myfs_info *sys_info);
+	void build_dir_index(struct myfs_entry *dir, dir_entries entries, struct myfs_info *sys_info);
+	uint32_t find_dir_leaf(const struct myfs_block *index_block, uint32_t hash);
+	struct myfs_dir_entry find_dir_entry(const struct myfs_entry &dir, std::string_view name);
+	void overwrite_block(uint32_t block_index, const struct myfs_block *block);
+	void create_file(std::string_view path, std::string_view file_name);
 	void update_entry(struct myfs_entry *file_entry);
-	void add_entry(struct myfs_entry *file_entry);
-	void update_file(struct myfs_entry *file_entry, char *data, uint32_t size);
-	struct myfs_entry allocate_file(bool is_dir, struct myfs_info *sys_info);
-	uint32_t allocate_block(struct myfs_block* block, struct myfs_info *sys_info);
-	struct myfs_entry get_dir(const std::string &path_str);
+	void add_entry(struct myfs_entry *file_entry, struct myfs_info *sys_info);
+	void update_file(struct myfs_entry *file_entry, char *data, uint32_t size, struct myfs_info *sys_info);
+	uint32_t write_block_chain(const char *data, uint32_t size, uint32_t first_logical_block, uint32_t goal, struct myfs_info *sys_info);
+	bool is_block_chain_shared(uint32_t block_chain_head);
+	struct myfs_entry allocate_file(bool is_dir, uint16_t group, struct myfs_info *sys_info);
+	uint32_t allocate_block(struct myfs_block* block, uint32_t goal, struct myfs_info *sys_info);
+	uint32_t allocate_new_block(struct myfs_block* block, uint32_t goal, struct myfs_info *sys_info);
+	uint32_t reserve_block(uint32_t goal, struct myfs_info *sys_info);
+	uint32_t write_dir_index(dir_entries entries, uint32_t *size, uint32_t goal, struct myfs_info *sys_info);
+	struct myfs_batch_dir &get_batch_dir(struct myfs_batch_state *state, uint32_t inode);
+	uint32_t resolve_batch_dir(struct myfs_batch_state *state, std::string_view path);
+	uint32_t allocate_batch_entry(struct myfs_batch_state *state, bool is_dir, uint16_t group);
+	void unshare_blocks(struct myfs_entry *file_entry, uint32_t last_logical_block, struct myfs_info *sys_info);
+	void check_writable();
+	void check_mount_writable();
+	uint32_t find_block(const struct myfs_block *block, uint64_t fingerprint);
+	struct myfs_block_info get_block_info(uint32_t block_index);
+	void set_block_info(uint32_t block_index, const struct myfs_block_info *block_info);
+	void index_fingerprint(uint32_t block_index, const struct myfs_block_info *block_info);
+	void load_fingerprints();
+	struct myfs_entry get_dir(std::string_view path_str);
 	dir_entries get_dir_entries(myfs_entry dir_entry);
+	dir_list read_dir_plus(const struct myfs_entry &dir, const std::unordered_map<uint32_t, struct myfs_entry> &inodes);
+	void walk_dir_tree(const struct myfs_entry &dir, uint32_t depth, const std::unordered_map<uint32_t, struct myfs_entry> &inodes, const tree_visitor &visitor);
+	std::unordered_map<uint32_t, struct myfs_entry> get_file_entries();
 	struct myfs_entry get_file_entry(const uint32_t inode);
 	void get_file(const myfs_entry file_entry, char *file_data);
+	std::vector<struct io_request> get_file_requests(const myfs_entry &file_entry, const block_map &blocks, char *file_data);
 };
 
 #endif // __MYFS_H__
@@ -0,0 +1,169 @@
+#include "myfs_async.h"
+
+#include <algorithm>
+#include <cassert>
+
+thread_local MyFsAsync *MyFsAsync::_current_pool = nullptr;
+thread_local size_t MyFsAsync::_current_queue = 0;
+
+MyFsAsync::MyFsAsync(MyFs &myfs, unsigned int threads) : _myfs(myfs), _pending(0), _idle_workers(0), _next_queue(0), _stop(false)
+{
+	// Use a worker per cpu if no amount was given
+	if (threads == 0)
+	{
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	// Every worker has it's own queue
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		_queues.push_back(std::unique_ptr<struct worker_queue>(new struct worker_queue()));
+	}
+
+	// Start the workers only after all the queues exist, since they steal from each other
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		_workers.push_back(std::thread(&MyFsAsync::worker_loop, this, i));
+	}
+}
+
+MyFsAsync::~MyFsAsync()
+{
+	// Tell the workers to stop once the queues are empty
+	{
+		std::lock_guard<std::mutex> lock(_idle_lock);
+		_stop = true;
+	}
+	_idle_cond.notify_all();
+
+	// Wait for the submitted operations to finish
+	for (auto &worker : _workers)
+	{
+		worker.join();
+	}
+}
+
+std::future<std::string> MyFsAsync::read(std::string path_str)
+{
+	return submit<std::string>([this, path_str]() { return _myfs.get_content(path_str); });
+}
+
+std::future<void> MyFsAsync::write(std::string path_str, std::string content)
+{
+	return submit<void>([this, path_str, content]() { _myfs.set_content(path_str, content); });
+}
+
+std::future<void> MyFsAsync::create(std::string path_str, bool directory)
+{
+	return submit<void>([this, path_str, directory]() { _myfs.create_file(path_str, directory); });
+}
+
+std::future<MyFs::dir_list> MyFsAsync::list(std::string path_str)
+{
+	return submit<MyFs::dir_list>([this, path_str]() { return _myfs.list_dir(path_str); });
+}
+
+void MyFsAsync::push(MyFsAsync::task operation)
+{
+	size_t queue_index = 0;
+
+	// Operations submitted by a worker stay on it's own queue, others are spread over the queues in turns
+	if (_current_pool == this)
+	{
+		queue_index = _current_queue;
+	}
+	else
+	{
+		queue_index = _next_queue++ % _queues.size();
+	}
+
+	// Count the operation before it's queued, a worker may take it right away and the count can't go below zero.
+	// The count is changed under the idle lock so the wake up isn't missed
+	{
+		std::lock_guard<std::mutex> lock(_idle_lock);
+		_pending++;
+	}
+
+	// Queue the operation
+	{
+		std::lock_guard<std::mutex> lock(_queues[queue_index]->lock);
+		_queues[queue_index]->tasks.push_back(std::move(operation));
+	}
+
+	// Wake up an idle worker
+	std::unique_lock<std::mutex> lock(_idle_lock);
+	if (_idle_workers != 0)
+	{
+		lock.unlock();
+		_idle_cond.notify_one();
+	}
+}
+
+bool MyFsAsync::pop(size_t queue_index, MyFsAsync::task &operation)
+{
+	// Take the oldest operation of the worker's own queue, so operations finish in the order they were submitted
+	{
+		std::lock_guard<std::mutex> lock(_queues[queue_index]->lock);
+		if (!_queues[queue_index]->tasks.empty())
+		{
+			operation = std::move(_queues[queue_index]->tasks.front());
+			_queues[queue_index]->tasks.pop_front();
+			take_pending();
+			return true;
+		}
+	}
+
+	// Steal the newest operation of another worker's queue, the owner of the queue is the furthest from it
+	for (size_t i = 1; i < _queues.size(); i++)
+	{
+		struct worker_queue &victim = *_queues[(queue_index + i) % _queues.size()];
+		std::lock_guard<std::mutex> lock(victim.lock);
+		if (!victim.tasks.empty())
+		{
+			operation = std::move(victim.tasks.back());
+			victim.tasks.pop_back();
+			take_pending();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void MyFsAsync::take_pending()
+{
+	// Every operation is counted once before it's queued and is taken once, so the count can't be zero here
+	size_t pending = _pending--;
+	assert(pending != 0);
+	(void)pending;
+}
+
+void MyFsAsync::worker_loop(size_t queue_index)
+{
+	task operation;
+
+	// Let operations submitted from this worker find it's queue
+	_current_pool = this;
+	_current_queue = queue_index;
+
+	while (true)
+	{
+		// Run operations while there are any
+		if (pop(queue_index, operation))
+		{
+			operation();
+			operation = nullptr;
+			continue;
+		}
+
+		// Sleep until an operation is queued, stop only after all of them ran
+		std::unique_lock<std::mutex> lock(_idle_lock);
+		_idle_workers++;
+		_idle_cond.wait(lock, [this]() { return _pending != 0 || _stop; });
+		_idle_workers--;
+		if (_pending == 0 && _stop)
+		{
+			return;
+		}
+	}
+}
@@ -0,0 +1,124 @@
+#ifndef __MYFS_ASYNC_H__
+#define __MYFS_ASYNC_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "myfs.h"
+
+/**
+ * MyFsAsync class
+ * Runs the operations of a myfs instance on an internal pool of threads, and
+ * returns a future for every operation instead of blocking the caller.
+ * Every worker of the pool has it's own queue of operations, and idle
+ * workers steal operations from the queues of the others. Reads don't hold
+ * the file system lock while their blocks are transferred, so reads of
+ * different files overlap with each other and with the other operations.
+ * Relative paths are resolved from the current dir of the myfs instance, at
+ * the time the operation runs.
+ */
+class MyFsAsync
+{
+  public:
+	/**
+	 * @param myfs the file system to run the operations on, it has to
+	 *	outlive the pool
+	 * @param threads the amount of workers, 0 for one per cpu
+	 */
+	MyFsAsync(MyFs &myfs, unsigned int threads);
+
+	/**
+	 * The operations that were already submitted are finished before the
+	 * workers are stopped.
+	 */
+	~MyFsAsync();
+
+	/**
+	 * read method
+	 * Reads the whole content of a file, like MyFs::get_content.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @return the future content of the file
+	 */
+	std::future<std::string> read(std::string path_str);
+
+	/**
+	 * write method
+	 * Sets the whole content of a file, like MyFs::set_content.
+	 * @param path_str the file path (e.g. "/somefile")
+	 * @param content the file content string
+	 * @return a future that is ready once the content was written
+	 */
+	std::future<void> write(std::string path_str, std::string content);
+
+	/**
+	 * create method
+	 * Creates a new file or directory, like MyFs::create_file.
+	 * @param path_str the file path (e.g. "/newfile")
+	 * @param directory whether this is a file or directory
+	 * @return a future that is ready once the file was created
+	 */
+	std::future<void> create(std::string path_str, bool directory);
+
+	/**
+	 * list method
+	 * Lists the files of a directory, like MyFs::list_dir.
+	 * @param path_str the directory path (e.g. "/somedir")
+	 * @return the future list of the files in the directory
+	 */
+	std::future<MyFs::dir_list> list(std::string path_str);
+
+  private:
+	typedef std::function<void()> task;
+
+	struct worker_queue
+	{
+		std::mutex lock;
+		std::deque<task> tasks;
+	};
+
+	MyFs &_myfs;
+
+	std::vector<std::unique_ptr<struct worker_queue>> _queues;
+	std::vector<std::thread> _workers;
+
+	std::mutex _idle_lock;
+	std::condition_variable _idle_cond;
+	std::atomic<size_t> _pending;
+	size_t _idle_workers;
+	std::atomic<size_t> _next_queue;
+	bool _stop;
+
+	// The pool and the queue of the worker running on the current thread
+	static thread_local MyFsAsync *_current_pool;
+	static thread_local size_t _current_queue;
+
+	template <typename T>
+	std::future<T> submit(std::function<T()> operation);
+	void push(task operation);
+	bool pop(size_t queue_index, task &operation);
+	void take_pending();
+	void worker_loop(size_t queue_index);
+};
+
+template <typename T>
+std::future<T> MyFsAsync::submit(std::function<T()> operation)
+{
+	// The task is shared, since a queued function has to be copyable
+	auto job = std::make_shared<std::packaged_task<T()>>(std::move(operation));
+	std::future<T> result = job->get_future();
+
+	// Exceptions thrown by the operation are passed to the future
+	push([job]() { (*job)(); });
+
+	return result;
+}
+
+#endif // __MYFS_ASYNC_H__
@@ -0,0 +1,419 @@
+#include "blkdev.h"
+#include "myfs.h"
+#include "myfs_async.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+const std::string USAGE_STRING = "Usage: myfs-bench [-j <threads>] [-c <concurrency>] [-n <operations>] [-b <block size>] [-p hdd|ssd|nvme] [-s] <image>\nThe image is formatted. \n-j <threads> - the amount of workers of the async pool, and of the processes reading the image read-only together. \n-c <concurrency> - the amount of operations in flight, the sync API runs them on this many threads. \n-n <operations> - the amount of operations of every run. \n-b <block size> - the block size the image is formatted with. \n-p hdd|ssd|nvme - emulate the speed of a device. \n-s - count the requests the device sees, and show them after every run. \n";
+
+const uint32_t BENCH_FILE_SIZE = 40 * 1024;
+// Devices of big blocks have room for fewer files, it's set by the block size of the run
+static uint32_t bench_files = 16;
+const uint32_t BULK_LOAD_FILES = 1000;
+const uint32_t RANGED_READ_SIZE = 1024;
+
+enum bench_operation { BENCH_READ, BENCH_WRITE, BENCH_LIST };
+
+// Every allocation of the process is counted, so the runs can show how many an operation makes
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+	void *pointer = malloc(size == 0 ? 1 : size);
+
+	allocations++;
+	if (pointer == nullptr)
+		throw std::bad_alloc();
+
+	return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+	free(pointer);
+}
+
+void operator delete(void *pointer, size_t size) noexcept
+{
+	free(pointer);
+}
+
+// The same mix of operations is run with both APIs: 80% reads, 10% writes and 10% lists
+static std::vector<std::pair<bench_operation, uint32_t>> make_operations(uint32_t count)
+{
+	std::mt19937 random(1);
+	std::vector<std::pair<bench_operation, uint32_t>> operations;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t kind = random() % 10;
+		operations.push_back(std::make_pair(kind < 8 ? BENCH_READ : kind == 8 ? BENCH_WRITE : BENCH_LIST, (uint32_t)(random() % bench_files)));
+	}
+
+	return operations;
+}
+
+static std::string file_path(uint32_t file)
+{
+	return "/bench/f" + std::to_string(file);
+}
+
+static double run_sync(MyFs &myfs, size_t clients, const std::vector<std::pair<bench_operation, uint32_t>> &operations, const std::string &content)
+{
+	std::atomic<size_t> next_operation(0);
+	std::vector<std::thread> client_threads;
+	auto start = std::chrono::steady_clock::now();
+
+	// Every client blocks a thread until it's operation is done, like a server with a thread per request
+	for (size_t i = 0; i < clients; i++)
+	{
+		client_threads.push_back(std::thread([&]()
+		{
+			for (size_t index = next_operation++; index < operations.size(); index = next_operation++)
+			{
+				if (operations[index].first == BENCH_READ)
+					myfs.get_content(file_path(operations[index].second));
+				else if (operations[index].first == BENCH_WRITE)
+					myfs.set_content(file_path(operations[index].second), content);
+				else
+					myfs.list_dir("/bench");
+			}
+		}));
+	}
+
+	for (auto &client : client_threads)
+		client.join();
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double run_async(MyFs &myfs, unsigned int threads, size_t concurrency, const std::vector<std::pair<bench_operation, uint32_t>> &operations, const std::string &content)
+{
+	MyFsAsync async(myfs, threads);
+	std::deque<std::future<void>> in_flight;
+	auto start = std::chrono::steady_clock::now();
+
+	for (auto &operation : operations)
+	{
+		// Keep at most concurrency operations in flight, like a server with that many open requests. The
+		// window is refilled once half of it is done, so the caller doesn't wake up for every operation
+		if (in_flight.size() == concurrency)
+		{
+			in_flight[concurrency / 2].wait();
+			while (in_flight.size() > concurrency / 2)
+			{
+				in_flight.front().get();
+				in_flight.pop_front();
+			}
+		}
+
+		if (operation.first == BENCH_READ)
+			in_flight.push_back(std::async(std::launch::deferred, [](std::future<std::string> result) { result.get(); }, async.read(file_path(operation.second))));
+		else if (operation.first == BENCH_WRITE)
+			in_flight.push_back(async.write(file_path(operation.second), content));
+		else
+			in_flight.push_back(std::async(std::launch::deferred, [](std::future<MyFs::dir_list> result) { result.get(); }, async.list("/bench")));
+	}
+
+	while (!in_flight.empty())
+	{
+		in_flight.front().get();
+		in_flight.pop_front();
+	}
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The allocations made per operation since the last call
+static double take_allocations(uint64_t operations)
+{
+	static uint64_t last = 0;
+	uint64_t current = allocations;
+	double per_operation = (double)(current - last) / std::max((uint64_t)1, operations);
+
+	last = current;
+
+	return per_operation;
+}
+
+// Looks up the paths of the files, setting the normal hint does nothing else
+static double run_lookups(MyFs &myfs, const std::vector<std::pair<bench_operation, uint32_t>> &operations)
+{
+	std::vector<std::string> paths;
+
+	// The paths are made before the run, so only the lookups are counted
+	for (uint32_t i = 0; i < bench_files; i++)
+		paths.push_back(file_path(i));
+	take_allocations(0);
+
+	auto start = std::chrono::steady_clock::now();
+	for (auto &operation : operations)
+		myfs.set_access_hint(paths[operation.second], MyFs::ACCESS_NORMAL);
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Reads a range of the file of every operation, through it's path or through a handle opened before the run
+static double run_ranged_reads(MyFs &myfs, const std::vector<std::pair<bench_operation, uint32_t>> &operations, bool handles)
+{
+	std::vector<std::string> paths;
+	std::vector<uint32_t> file_handles;
+
+	for (uint32_t i = 0; i < bench_files; i++)
+	{
+		paths.push_back(file_path(i));
+		if (handles)
+			file_handles.push_back(myfs.open(paths.back()));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < operations.size(); i++)
+	{
+		uint32_t offset = (i * 4099) % (BENCH_FILE_SIZE - RANGED_READ_SIZE);
+
+		if (handles)
+			myfs.read_content(file_handles[operations[i].second], offset, RANGED_READ_SIZE);
+		else
+			myfs.read_content(paths[operations[i].second], offset, RANGED_READ_SIZE);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (uint32_t handle : file_handles)
+		myfs.close(handle);
+
+	return seconds;
+}
+
+// Reader processes that mount the image read-only at the same time, and do the ranged reads by path each
+static double run_readers(const std::string &image, unsigned int processes, const std::vector<std::pair<bench_operation, uint32_t>> &operations, const struct device_profile *profile)
+{
+	std::vector<pid_t> children;
+	bool failed = false;
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < processes; i++)
+	{
+		pid_t pid = fork();
+		if (pid == -1)
+		{
+			failed = true;
+			break;
+		}
+		if (pid == 0)
+		{
+			int status = 0;
+			try
+			{
+				BlockDeviceSimulator device(image, DEVICE_SIZE, true);
+				device.set_profile(profile);
+				std::unique_ptr<MyFs> myfs = MyFs::mount(&device);
+				run_ranged_reads(*myfs, operations, false);
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << e.what() << std::endl;
+				status = 1;
+			}
+			_exit(status);
+		}
+		children.push_back(pid);
+	}
+
+	for (pid_t pid : children)
+	{
+		int status = 0;
+		waitpid(pid, &status, 0);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	return failed ? 0 : seconds;
+}
+
+// The requests the device saw during a run, which are then forgotten
+static std::string take_io_stats(BlockDeviceSimulator *blkdevptr)
+{
+	struct io_stats stats = blkdevptr->get_io_stats();
+	uint64_t requests = stats.sequential + stats.random;
+	std::ostringstream line;
+
+	// The requests aren't counted unless they are shown
+	if (!blkdevptr->is_recording())
+		return "";
+
+	blkdevptr->reset_io_stats();
+	line << std::fixed << std::setprecision(0) << "  (" << stats.reads << " reads, " << stats.writes << " writes, "
+		<< (requests == 0 ? 0 : stats.sequential * 100 / requests) << "% sequential, " << stats.device_time_us / 1000 << " ms device time)";
+
+	return line.str();
+}
+
+// Creates the files of a bulk load into a fresh file system, one by one or in a single batch
+static double run_bulk_load(MyFs &myfs, bool batched)
+{
+	MyFs::Batch batch(myfs);
+
+	myfs.format();
+	auto start = std::chrono::steady_clock::now();
+
+	if (batched)
+	{
+		batch.create_file("/load", true);
+		for (uint32_t i = 0; i < BULK_LOAD_FILES; i++)
+			batch.create_file("/load/f" + std::to_string(i), false);
+		batch.commit();
+	}
+	else
+	{
+		myfs.create_file("/load", true);
+		for (uint32_t i = 0; i < BULK_LOAD_FILES; i++)
+			myfs.create_file("/load/f" + std::to_string(i), false);
+	}
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int threads = std::thread::hardware_concurrency();
+	size_t concurrency = 64;
+	uint32_t count = 20000;
+	uint32_t block_size = MYFS_DEFAULT_BLOCK_SIZE;
+	const struct device_profile *profile = nullptr;
+	bool show_io = false;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "j:c:n:b:p:s")) != -1)
+	{
+		if (opt == 's')
+			show_io = true;
+		else if (opt == 'j')
+			threads = std::stoul(optarg);
+		else if (opt == 'c')
+			concurrency = std::max(1ul, std::stoul(optarg));
+		else if (opt == 'n')
+			count = std::stoul(optarg);
+		else if (opt == 'b')
+			block_size = std::stoul(optarg);
+		else if (opt == 'p' && (profile = BlockDeviceSimulator::find_profile(optarg)) != nullptr)
+			continue;
+		else
+		{
+			std::cerr << USAGE_STRING;
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		std::cerr << USAGE_STRING;
+		return -1;
+	}
+
+	// The root and the bench dir take a block each, the files get the rest of the data blocks
+	if (!visit_geometry(block_size, [](auto geometry) { bench_files = std::min(16u, (geometry.BLOCK_COUNT - geometry.FIRST_DATA_BLOCK - 2) / geometry.blocks_for_size(BENCH_FILE_SIZE)); }))
+	{
+		std::cerr << "There is no geometry for blocks of " << block_size << " bytes" << std::endl;
+		return -1;
+	}
+
+	BlockDeviceSimulator *blkdevptr = new BlockDeviceSimulator(argv[optind]);
+	std::vector<std::pair<bench_operation, uint32_t>> operations = make_operations(count);
+	std::string content(BENCH_FILE_SIZE, 'x');
+	double serial_seconds = 0, sync_seconds = 0, async_seconds = 0, lookup_seconds = 0, single_load_seconds = 0, batch_load_seconds = 0;
+	double path_read_seconds = 0, handle_read_seconds = 0, single_reader_seconds = 0, many_readers_seconds = 0;
+	double serial_allocations = 0, sync_allocations = 0, async_allocations = 0, lookup_allocations = 0;
+	std::string serial_io, sync_io, async_io, single_load_io, batch_load_io;
+
+	{
+		// Start from a fresh file system holding the files
+		std::unique_ptr<MyFs> myfs_ptr = MyFs::format(blkdevptr, block_size);
+		MyFs &myfs = *myfs_ptr;
+
+		myfs.create_file("/bench", true);
+		for (uint32_t i = 0; i < bench_files; i++)
+		{
+			myfs.create_file(file_path(i), false);
+			myfs.set_content(file_path(i), content);
+		}
+
+		// Only the runs are done on the emulated device
+		blkdevptr->set_profile(profile);
+		blkdevptr->set_recording(show_io);
+		blkdevptr->reset_io_stats();
+		take_allocations(0);
+
+		serial_seconds = run_sync(myfs, 1, operations, content);
+		serial_allocations = take_allocations(count);
+		serial_io = take_io_stats(blkdevptr);
+		sync_seconds = run_sync(myfs, concurrency, operations, content);
+		sync_allocations = take_allocations(count);
+		sync_io = take_io_stats(blkdevptr);
+		async_seconds = run_async(myfs, threads, concurrency, operations, content);
+		async_allocations = take_allocations(count);
+		async_io = take_io_stats(blkdevptr);
+		lookup_seconds = run_lookups(myfs, operations);
+		lookup_allocations = take_allocations(count);
+		take_io_stats(blkdevptr);
+
+		// The ranges are read from the device, not from the write-back cache
+		myfs.sync();
+		path_read_seconds = run_ranged_reads(myfs, operations, false);
+		handle_read_seconds = run_ranged_reads(myfs, operations, true);
+		take_io_stats(blkdevptr);
+	}
+
+	// The writer lets go of the image, so the readers can share it
+	delete blkdevptr;
+	single_reader_seconds = run_readers(argv[optind], 1, operations, profile);
+	many_readers_seconds = run_readers(argv[optind], threads, operations, profile);
+
+	blkdevptr = new BlockDeviceSimulator(argv[optind]);
+	blkdevptr->set_profile(profile);
+	blkdevptr->set_recording(show_io);
+	{
+		std::unique_ptr<MyFs> myfs_ptr = MyFs::mount(blkdevptr);
+		MyFs &myfs = *myfs_ptr;
+
+		single_load_seconds = run_bulk_load(myfs, false);
+		single_load_io = take_io_stats(blkdevptr);
+		batch_load_seconds = run_bulk_load(myfs, true);
+		batch_load_io = take_io_stats(blkdevptr);
+	}
+
+	std::cout << std::fixed << std::setprecision(0);
+	std::cout << count << " operations (80% read, 10% write, 10% list) on " << bench_files << " files of " << BENCH_FILE_SIZE << " bytes, in blocks of " << block_size << " bytes";
+	std::cout << (profile == nullptr ? "" : std::string(" on an emulated ") + profile->name) << std::endl;
+	std::cout << "sync, 1 thread:   " << count / serial_seconds << " ops/s, " << std::setprecision(1) << serial_allocations << " allocations/op" << std::setprecision(0) << serial_io << std::endl;
+	std::cout << "sync, " << std::setw(3) << concurrency << " threads: " << count / sync_seconds << " ops/s, " << std::setprecision(1) << sync_allocations << " allocations/op" << std::setprecision(0) << sync_io << std::endl;
+	std::cout << "async:            " << count / async_seconds << " ops/s, " << std::setprecision(1) << async_allocations << " allocations/op" << std::setprecision(0) << " (" << threads << " workers, " << concurrency << " in flight)" << async_io << std::endl;
+	std::cout << std::setprecision(2) << "async vs sync at " << concurrency << " in flight: " << sync_seconds / async_seconds << "x" << std::endl;
+	std::cout << std::endl << std::setprecision(0) << "path lookups:     " << count / lookup_seconds << " ops/s, " << std::setprecision(1) << lookup_allocations << " allocations/op" << std::endl;
+	std::cout << std::setprecision(0) << "ranged reads of " << RANGED_READ_SIZE << " bytes: " << count / path_read_seconds << " ops/s by path, " << count / handle_read_seconds << " ops/s by handle" << std::endl;
+	if (single_reader_seconds == 0 || many_readers_seconds == 0)
+		std::cout << "read-only readers failed" << std::endl;
+	else
+		std::cout << "read-only readers: " << count / single_reader_seconds << " ops/s in 1 process, " << count * threads / many_readers_seconds << " ops/s in " << threads << " processes ("
+			<< std::setprecision(1) << single_reader_seconds * threads / many_readers_seconds << "x)" << std::setprecision(0) << std::endl;
+	std::cout << std::setprecision(2) << std::endl << "creating " << BULK_LOAD_FILES << " files in a dir" << std::endl;
+	std::cout << "one by one: " << single_load_seconds * 1000 << " ms" << single_load_io << std::endl;
+	std::cout << "batch:      " << batch_load_seconds * 1000 << " ms" << batch_load_io << std::endl;
+	std::cout << "speedup: " << std::setprecision(0) << single_load_seconds / batch_load_seconds << "x" << std::endl;
+
+	delete blkdevptr;
+
+	return 0;
+}
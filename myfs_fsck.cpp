@@ -0,0 +1,542 @@
+#include "myfs_fsck.h"
+
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+#include "utils.h"
+
+MyFsChecker::MyFsChecker(BlockDeviceSimulator *blkdevsim_, unsigned int threads) : blkdevsim(blkdevsim_), _threads(threads == 0 ? 1 : threads)
+{
+}
+
+int MyFsChecker::check(bool repair)
+{
+	struct MyFs::myfs_header header;
+	uint32_t block_size = 0;
+	int problems = 0;
+
+	// Without a valid header there is nothing to check
+	blkdevsim->read(0, sizeof(header), (char *)&header);
+	if (strncmp(header.magic, MyFs::MYFS_MAGIC, sizeof(header.magic)) != 0 || header.version != MyFs::CURR_VERSION)
+	{
+		std::cout << "Did not find a myfs instance of the current version on the device" << std::endl;
+		return 1;
+	}
+
+	// The blocks are in the wrong places if the images aren't put together the way they were formatted
+	if (header.stripe_size != (uint32_t)blkdevsim->get_stripe_size() || header.member_count != (uint32_t)blkdevsim->get_member_count())
+	{
+		std::cout << "The device was formatted with " << MyFs::describe_striping(header.stripe_size, header.member_count) << ", but it's opened with " << MyFs::describe_striping(blkdevsim->get_stripe_size(), blkdevsim->get_member_count()) << std::endl;
+		return 1;
+	}
+
+	// The rest of the layout is checked with the geometry of the block size it was made with
+	block_size = header.block_shift < 32 ? 1u << header.block_shift : 0;
+	if (!visit_geometry(block_size, [&](auto geometry) { problems = MyFsVolumeChecker<decltype(geometry)>(blkdevsim, _threads).check(repair); }))
+	{
+		std::cout << "The device has blocks of " << block_size << " bytes, there is no geometry for them" << std::endl;
+		return 1;
+	}
+
+	return problems;
+}
+
+template <typename Geometry>
+MyFsVolumeChecker<Geometry>::MyFsVolumeChecker(BlockDeviceSimulator *blkdevsim_, unsigned int threads) : blkdevsim(blkdevsim_), _threads(threads),
+	_block_refs(BLOCK_COUNT), _block_visited(BLOCK_COUNT), _inode_reached(INODE_TABLE_ENTRIES), _busy_walkers(0), _problems(0)
+{
+}
+
+template <typename Geometry>
+int MyFsVolumeChecker<Geometry>::check(bool repair)
+{
+	struct MyFs::myfs_header header;
+	std::vector<std::thread> walkers;
+	std::vector<struct MyFs::myfs_entry> snapshot_entries(INODE_TABLE_ENTRIES);
+	std::vector<size_t> orphans;
+	uint32_t max_inode = 0, free_blocks = 0, free_inodes = 0;
+	uint32_t group_free_blocks[BLOCK_GROUP_COUNT] = {0}, group_dirs[BLOCK_GROUP_COUNT] = {0};
+
+	// The header was checked by MyFsChecker
+	blkdevsim->read(0, sizeof(header), (char *)&header);
+
+	// Only the initialized blocks of the inode table hold entries
+	if (header.inode_table_blocks == 0 || header.inode_table_blocks > INODE_TABLE_BLOCKS)
+	{
+		report("The header has " + std::to_string(header.inode_table_blocks) + " initialized inode table blocks");
+		return _problems;
+	}
+
+	// Read the sys info, the block table and the initialized part of the inode table
+	_block_table.resize(BLOCK_COUNT);
+	_inode_table.resize(header.inode_table_blocks * BLOCK_SIZE / sizeof(struct MyFs::myfs_entry));
+	blkdevsim->read(sizeof(header), sizeof(_sys_info), (char *)&_sys_info);
+	blkdevsim->read((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, BLOCK_COUNT * sizeof(struct MyFs::myfs_block_info), (char *)_block_table.data());
+	blkdevsim->read(BLOCK_SIZE, header.inode_table_blocks * BLOCK_SIZE, (char *)_inode_table.data());
+
+	// Map every inode to it's slot in the inode table
+	for (size_t i = 0; i < _inode_table.size(); i++)
+	{
+		if (_inode_table[i].inode == 0)
+		{
+			continue;
+		}
+
+		if (!_inode_slots.insert(std::make_pair(_inode_table[i].inode, i)).second)
+		{
+			report("Inode " + std::to_string(_inode_table[i].inode) + " appears more than once in the inode table");
+		}
+		max_inode = std::max(max_inode, _inode_table[i].inode);
+
+		// The group is only where the file's blocks are placed, so a bad one is reset to the first group
+		if (_inode_table[i].group >= BLOCK_GROUP_COUNT)
+		{
+			report("Inode " + std::to_string(_inode_table[i].inode) + " is in group " + std::to_string(_inode_table[i].group) + " but there are " + std::to_string(BLOCK_GROUP_COUNT) + " groups");
+			_inode_table[i].group = 0;
+		}
+	}
+	if (max_inode > _sys_info.inode_count)
+	{
+		report("Inode " + std::to_string(max_inode) + " is bigger than the inode count " + std::to_string(_sys_info.inode_count));
+	}
+
+	// The walk starts at the root dir
+	if (_inode_slots.find(1) == _inode_slots.end() || !_inode_table[_inode_slots[1]].is_dir)
+	{
+		report("The root dir is missing from the inode table");
+	}
+	else
+	{
+		_inode_reached[_inode_slots[1]] = true;
+		_pending_dirs.push_back({1, 1, "/"});
+	}
+
+	// Every thread walks the dirs found by all of them, so independent sub trees are walked in parallel at any depth
+	for (unsigned int i = 0; i < _threads; i++)
+	{
+		walkers.push_back(std::thread(&MyFsVolumeChecker::walk_pending_dirs, this));
+	}
+	for (auto &walker : walkers)
+	{
+		walker.join();
+	}
+
+	// Inodes that weren't reached from the root dir are orphans
+	for (size_t i = 0; i < _inode_table.size(); i++)
+	{
+		if (_inode_table[i].inode != 0 && !_inode_reached[i])
+		{
+			report("Inode " + std::to_string(_inode_table[i].inode) + " isn't linked to any dir");
+			orphans.push_back(i);
+
+			// When only checking, the orphan still holds it's blocks
+			if (!repair)
+			{
+				walk_chain(_inode_table[i].first_block, "orphan inode " + std::to_string(_inode_table[i].inode), Utils::CalcAmountOfBlocksForFile<Geometry>(_inode_table[i].size), true);
+			}
+		}
+	}
+
+	// Every chain in the reclaim queue holds a reference to it's head
+	if (_sys_info.reclaim_count > RECLAIM_QUEUE_SIZE)
+	{
+		report("The reclaim queue holds " + std::to_string(_sys_info.reclaim_count) + " chains, more than it's size");
+		_sys_info.reclaim_count = RECLAIM_QUEUE_SIZE;
+	}
+	for (uint32_t i = 0; i < _sys_info.reclaim_count; i++)
+	{
+		walk_chain(_sys_info.reclaim_queue[i], "the reclaim queue", UINT32_MAX, true);
+	}
+
+	// Every snapshot holds it's copy of the inode table and the files in it
+	for (auto &snapshot : _sys_info.snapshots)
+	{
+		if (snapshot.name[0] == 0)
+		{
+			continue;
+		}
+
+		std::string owner = "snapshot '" + std::string(snapshot.name, strnlen(snapshot.name, sizeof(snapshot.name))) + "'";
+		walk_chain(snapshot.inode_table, owner, INODE_TABLE_BLOCKS * BLOCK_SIZE / BLOCK_DATA_SIZE + 1, true);
+		read_chain(snapshot.inode_table, (char *)snapshot_entries.data(), INODE_TABLE_BLOCKS * BLOCK_SIZE);
+		for (auto &entry : snapshot_entries)
+		{
+			if (entry.inode != 0)
+			{
+				walk_chain(entry.first_block, owner + " inode " + std::to_string(entry.inode), Utils::CalcAmountOfBlocksForFile<Geometry>(entry.size), true);
+			}
+		}
+	}
+
+	// The metadata blocks are always taken
+	for (uint32_t i = 0; i < FIRST_DATA_BLOCK; i++)
+	{
+		if (!_sys_info.block_bitmap.test(i))
+		{
+			report("Metadata block " + std::to_string(i) + " is marked as free");
+		}
+	}
+
+	// Compare the references found to the saved bitmap and reference counts
+	for (uint32_t i = FIRST_DATA_BLOCK; i < BLOCK_COUNT; i++)
+	{
+		uint32_t refs = _block_refs[i];
+		std::string block = "Block " + std::to_string(i);
+
+		if (refs != 0 && !_sys_info.block_bitmap.test(i))
+		{
+			report(block + " is used but marked as free");
+		}
+		else if (refs == 0 && _sys_info.block_bitmap.test(i))
+		{
+			report(block + " is marked as used but isn't referenced (leaked)");
+		}
+
+		if (refs > _block_table[i].ref_count)
+		{
+			report(block + " has " + std::to_string(refs) + " references but it's reference count is " + std::to_string(_block_table[i].ref_count) + " (cross-linked)");
+		}
+		else if (refs < _block_table[i].ref_count)
+		{
+			report(block + " has " + std::to_string(refs) + " references but it's reference count is " + std::to_string(_block_table[i].ref_count));
+		}
+
+		if (refs == 0 && _block_table[i].fingerprint != 0)
+		{
+			report(block + " is free but has a fingerprint");
+		}
+
+		free_blocks += refs == 0 ? 1 : 0;
+		group_free_blocks[i / BLOCKS_PER_GROUP] += refs == 0 ? 1 : 0;
+	}
+
+	// Count the dirs of every group, the orphans are left out if they are removed
+	for (size_t i = 0; i < _inode_table.size(); i++)
+	{
+		if (_inode_table[i].inode != 0 && _inode_table[i].is_dir && (_inode_reached[i] || !repair))
+		{
+			group_dirs[_inode_table[i].group]++;
+		}
+	}
+
+	// The free counters are trusted by mounts after a clean unmount
+	free_inodes = INODE_TABLE_ENTRIES - (_inode_slots.size() - (repair ? orphans.size() : 0));
+	if (_sys_info.free_blocks != free_blocks)
+	{
+		report("The free blocks counter is " + std::to_string(_sys_info.free_blocks) + " but " + std::to_string(free_blocks) + " blocks are free");
+	}
+	if (_sys_info.free_inodes != free_inodes)
+	{
+		report("The free inodes counter is " + std::to_string(_sys_info.free_inodes) + " but " + std::to_string(free_inodes) + " inodes are free");
+	}
+	for (uint32_t i = 0; i < BLOCK_GROUP_COUNT; i++)
+	{
+		if (_sys_info.group_free_blocks[i] != group_free_blocks[i])
+		{
+			report("The free blocks counter of group " + std::to_string(i) + " is " + std::to_string(_sys_info.group_free_blocks[i]) + " but " + std::to_string(group_free_blocks[i]) + " blocks are free");
+		}
+		if (_sys_info.group_dirs[i] != group_dirs[i])
+		{
+			report("The dirs counter of group " + std::to_string(i) + " is " + std::to_string(_sys_info.group_dirs[i]) + " but the group has " + std::to_string(group_dirs[i]) + " dirs");
+		}
+	}
+
+	if (!repair || _problems == 0)
+	{
+		return _problems;
+	}
+
+	// Rebuild the bitmap and the block table from the references found
+	for (uint32_t i = FIRST_DATA_BLOCK; i < BLOCK_COUNT; i++)
+	{
+		_sys_info.block_bitmap.set(i, _block_refs[i] != 0);
+		_block_table[i].ref_count = _block_refs[i];
+		if (_block_refs[i] == 0)
+		{
+			_block_table[i].fingerprint = 0;
+		}
+	}
+	for (uint32_t i = 0; i < FIRST_DATA_BLOCK; i++)
+	{
+		_sys_info.block_bitmap.set(i);
+	}
+
+	// Remove the orphans, their blocks were left out of the references
+	for (size_t slot : orphans)
+	{
+		memset(&_inode_table[slot], 0, sizeof(struct MyFs::myfs_entry));
+	}
+	_sys_info.inode_count = std::max(_sys_info.inode_count, max_inode);
+	_sys_info.free_blocks = free_blocks;
+	_sys_info.free_inodes = free_inodes;
+	memcpy(_sys_info.group_free_blocks, group_free_blocks, sizeof(group_free_blocks));
+	memcpy(_sys_info.group_dirs, group_dirs, sizeof(group_dirs));
+
+	// Save the repaired metadata
+	blkdevsim->write(sizeof(header), sizeof(_sys_info), (const char *)&_sys_info);
+	blkdevsim->write((1 + INODE_TABLE_BLOCKS) * BLOCK_SIZE, BLOCK_COUNT * sizeof(struct MyFs::myfs_block_info), (const char *)_block_table.data());
+	blkdevsim->write(BLOCK_SIZE, header.inode_table_blocks * BLOCK_SIZE, (const char *)_inode_table.data());
+
+	return _problems;
+}
+
+template <typename Geometry>
+void MyFsVolumeChecker<Geometry>::report(const std::string &problem)
+{
+	std::lock_guard<std::mutex> lock(_report_lock);
+
+	std::cout << problem << std::endl;
+	_problems++;
+}
+
+template <typename Geometry>
+void MyFsVolumeChecker<Geometry>::walk_chain(uint32_t block_chain_head, const std::string &owner, uint32_t max_blocks, bool sorted)
+{
+	uint32_t block_index = block_chain_head;
+	int64_t prev_logical_block = -1;
+	myfs_block block;
+
+	while (block_index != 0)
+	{
+		if (!is_valid_block(block_index))
+		{
+			report("The chain of " + owner + " points at invalid block " + std::to_string(block_index));
+			return;
+		}
+
+		// Count the pointer to the block, but follow the block's own pointer only once
+		_block_refs[block_index]++;
+		if (_block_visited[block_index].exchange(true))
+		{
+			return;
+		}
+
+		blkdevsim->read(block_index * BLOCK_SIZE, sizeof(block), (char *)&block);
+
+		// The chain is sorted by logical block and doesn't pass the end of the file
+		if (sorted && (int64_t)block.logical_block <= prev_logical_block)
+		{
+			report("The chain of " + owner + " isn't sorted at block " + std::to_string(block_index));
+		}
+		else if (block.logical_block >= max_blocks)
+		{
+			report("The chain of " + owner + " has block " + std::to_string(block_index) + " past the end of the file");
+		}
+		prev_logical_block = block.logical_block;
+
+		block_index = block.next_block;
+	}
+}
+
+template <typename Geometry>
+void MyFsVolumeChecker<Geometry>::walk_dir(uint32_t inode, uint32_t parent_inode, const std::string &path)
+{
+	const struct MyFs::myfs_entry &dir = _inode_table[_inode_slots.at(inode)];
+	MyFs::dir_entries entries;
+
+	// The leaves of indexed dirs are chained in hash order and aren't bound by the dir's size
+	if (dir.flags & MyFs::ENTRY_FLAG_INDEXED_DIR)
+	{
+		walk_chain(dir.first_block, "dir '" + path + "'", UINT32_MAX, false);
+	}
+	else
+	{
+		walk_chain(dir.first_block, "dir '" + path + "'", Utils::CalcAmountOfBlocksForFile<Geometry>(dir.size), true);
+	}
+
+	// Parse the dir's records, a corrupted dir still gives the records before the corruption
+
+	if (!read_dir(dir, entries))
+	{
+		report("The records of dir '" + path + "' are corrupted");
+	}
+
+	for (auto &entry : entries)
+	{
+		auto slot = _inode_slots.find(entry.inode);
+
+		// The dot entries point at the dir itself and at it's parent
+		if (entry.name == "." || entry.name == "..")
+		{
+			if (entry.inode != (entry.name == "." ? inode : parent_inode))
+			{
+				report("Entry '" + entry.name + "' of dir '" + path + "' points at inode " + std::to_string(entry.inode));
+			}
+			continue;
+		}
+
+		if (slot == _inode_slots.end())
+		{
+			report("Entry '" + path + entry.name + "' points at missing inode " + std::to_string(entry.inode));
+			continue;
+		}
+
+		const struct MyFs::myfs_entry &file = _inode_table[slot->second];
+		if ((entry.type == MyFs::ENTRY_TYPE_DIR) != (bool)file.is_dir)
+		{
+			report("Entry '" + path + entry.name + "' has a different type than inode " + std::to_string(entry.inode));
+		}
+
+		// Every inode is linked from a single dir entry
+		if (_inode_reached[slot->second].exchange(true))
+		{
+			report("Inode " + std::to_string(entry.inode) + " is linked more than once, at '" + path + entry.name + "'");
+			continue;
+		}
+
+		if (!file.is_dir)
+		{
+			walk_chain(file.first_block, "file '" + path + entry.name + "'", Utils::CalcAmountOfBlocksForFile<Geometry>(file.size), true);
+		}
+		// Sub dirs are queued, so any idle walker can take them
+		else
+		{
+			std::lock_guard<std::mutex> lock(_pending_lock);
+			_pending_dirs.push_back({entry.inode, inode, path + entry.name + "/"});
+			_pending_cond.notify_one();
+		}
+	}
+}
+
+template <typename Geometry>
+void MyFsVolumeChecker<Geometry>::walk_pending_dirs()
+{
+	std::unique_lock<std::mutex> lock(_pending_lock);
+	struct pending_dir dir;
+
+	while (true)
+	{
+		// Wait for a dir, the walk is over when none is queued and no walker can queue more
+		_pending_cond.wait(lock, [this]() { return !_pending_dirs.empty() || _busy_walkers == 0; });
+		if (_pending_dirs.empty())
+		{
+			break;
+		}
+
+		// Take the next dir, and walk it without the lock
+		dir = std::move(_pending_dirs.front());
+		_pending_dirs.pop_front();
+		_busy_walkers++;
+		lock.unlock();
+		walk_dir(dir.inode, dir.parent_inode, dir.path);
+		lock.lock();
+		_busy_walkers--;
+
+		// Wake the idle walkers up if this was the last of the walk
+		if (_busy_walkers == 0 && _pending_dirs.empty())
+		{
+			_pending_cond.notify_all();
+		}
+	}
+}
+
+template <typename Geometry>
+bool MyFsVolumeChecker<Geometry>::read_dir(const struct MyFs::myfs_entry &dir, MyFs::dir_entries &entries)
+{
+	myfs_block block;
+	struct MyFs::myfs_dir_index *index = (struct MyFs::myfs_dir_index *)block.data;
+	uint32_t amount = 0, leaf_count = 0, expected_amount = 0, expected_leaf_count = 0;
+	bool valid = true;
+
+	// Small dirs are a single list of records
+	if (!(dir.flags & MyFs::ENTRY_FLAG_INDEXED_DIR))
+	{
+		std::vector<char> data(dir.size);
+		read_chain(dir.first_block, data.data(), dir.size);
+		return parse_dir_records(data.data(), dir.size, entries);
+	}
+
+	// Indexed dirs have the leaves chained after the index block
+	if (!is_valid_block(dir.first_block))
+	{
+		return false;
+	}
+	blkdevsim->read(dir.first_block * BLOCK_SIZE, sizeof(block), (char *)&block);
+	expected_amount = index->amount;
+	expected_leaf_count = index->leaf_count;
+
+	while (block.next_block != 0 && leaf_count < BLOCK_COUNT)
+	{
+		if (!is_valid_block(block.next_block))
+		{
+			return false;
+		}
+		blkdevsim->read(block.next_block * BLOCK_SIZE, sizeof(block), (char *)&block);
+
+		valid = parse_dir_records(block.data, BLOCK_DATA_SIZE, entries) && valid;
+		leaf_count++;
+	}
+	amount = entries.size();
+
+	return valid && amount == expected_amount && leaf_count == expected_leaf_count;
+}
+
+template <typename Geometry>
+bool MyFsVolumeChecker<Geometry>::parse_dir_records(const char *data, uint32_t size, MyFs::dir_entries &entries)
+{
+	struct MyFs::myfs_dir dir;
+	struct MyFs::myfs_dir_record record;
+	struct MyFs::myfs_dir_entry entry;
+	uint32_t record_pointer = sizeof(struct MyFs::myfs_dir);
+
+	if (size < sizeof(dir))
+	{
+		return false;
+	}
+	memcpy(&dir, data, sizeof(dir));
+
+	// Unlike MyFs::unpack_dir_entries, never read past the end of the data
+	for (uint32_t i = 0; i < dir.amount; i++)
+	{
+		if (record_pointer + sizeof(record) > size)
+		{
+			return false;
+		}
+		memcpy(&record, data + record_pointer, sizeof(record));
+		if (record.name_length == 0 || record_pointer + sizeof(record) + record.name_length > size)
+		{
+			return false;
+		}
+
+		entry.inode = record.inode;
+		entry.type = record.type;
+		entry.name.assign(data + record_pointer + sizeof(record), record.name_length);
+		entries.push_back(entry);
+
+		record_pointer += sizeof(record) + record.name_length;
+	}
+
+	return true;
+}
+
+template <typename Geometry>
+void MyFsVolumeChecker<Geometry>::read_chain(uint32_t block_chain_head, char *data, uint32_t size)
+{
+	uint32_t block_index = block_chain_head, file_pointer = 0;
+	myfs_block block;
+
+	// Holes are read as zeros
+	memset(data, 0, size);
+
+	// Invalid pointers and loops were already reported by walk_chain, just stop on them
+	for (uint32_t i = 0; i < BLOCK_COUNT && is_valid_block(block_index); i++)
+	{
+		blkdevsim->read(block_index * BLOCK_SIZE, sizeof(block), (char *)&block);
+
+		file_pointer = block.logical_block * BLOCK_DATA_SIZE;
+		if (block.logical_block < size / BLOCK_DATA_SIZE + 1 && file_pointer < size)
+		{
+			memcpy(data + file_pointer, block.data, size - file_pointer < BLOCK_DATA_SIZE ? size - file_pointer : BLOCK_DATA_SIZE);
+		}
+
+		block_index = block.next_block;
+	}
+}
+
+template <typename Geometry>
+bool MyFsVolumeChecker<Geometry>::is_valid_block(uint32_t block_index)
+{
+	return block_index >= FIRST_DATA_BLOCK && block_index < BLOCK_COUNT;
+}
@@ -0,0 +1,121 @@
+#ifndef __MYFS_FSCK_H__
+#define __MYFS_FSCK_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "blkdev.h"
+#include "myfs.h"
+
+/**
+ * MyFsChecker class
+ * Checks an unmounted myfs instance, with the geometry of the block size
+ * the instance was formatted with.
+ */
+class MyFsChecker
+{
+  public:
+	/**
+	 * @param blkdevsim_ the device holding the myfs instance
+	 * @param threads the amount of threads walking the directory tree
+	 */
+	MyFsChecker(BlockDeviceSimulator *blkdevsim_, unsigned int threads);
+
+	/**
+	 * check method
+	 * Checks the filesystem and prints every problem found.
+	 * @param repair whether the problems should be fixed: the block bitmap
+	 *	and the reference counts are rebuilt and orphan inodes are removed
+	 * @return the amount of problems found
+	 */
+	int check(bool repair);
+
+  private:
+	BlockDeviceSimulator *blkdevsim;
+	unsigned int _threads;
+};
+
+/**
+ * MyFsVolumeChecker class
+ * Checks a myfs instance formatted with the blocks of the geometry. The
+ * checker walks the directory tree from the root dir, follows every block
+ * chain (of the files, the reclaim queue and the snapshots) and rebuilds
+ * the expected block bitmap and block reference counts, then compares them
+ * with the ones saved on the device.
+ */
+template <typename Geometry>
+class MyFsVolumeChecker
+{
+  public:
+	/**
+	 * @param blkdevsim_ the device holding the myfs instance
+	 * @param threads the amount of threads walking the directory tree
+	 */
+	MyFsVolumeChecker(BlockDeviceSimulator *blkdevsim_, unsigned int threads);
+
+	/**
+	 * check method
+	 * Like MyFsChecker::check, for a device of the geometry's block size.
+	 */
+	int check(bool repair);
+
+  private:
+	typedef typename MyFsVolume<Geometry>::myfs_info myfs_info;
+	typedef typename MyFsVolume<Geometry>::myfs_block myfs_block;
+
+	static constexpr uint32_t BLOCK_SIZE = Geometry::BLOCK_SIZE;
+	static constexpr uint32_t BLOCK_DATA_SIZE = Geometry::BLOCK_DATA_SIZE;
+	static constexpr uint32_t BLOCK_COUNT = Geometry::BLOCK_COUNT;
+	static constexpr uint32_t INODE_TABLE_BLOCKS = Geometry::INODE_TABLE_BLOCKS;
+	static constexpr uint32_t FIRST_DATA_BLOCK = Geometry::FIRST_DATA_BLOCK;
+	static constexpr uint32_t BLOCKS_PER_GROUP = Geometry::BLOCKS_PER_GROUP;
+	static constexpr uint32_t BLOCK_GROUP_COUNT = Geometry::BLOCK_GROUP_COUNT;
+	static constexpr uint32_t INODE_TABLE_ENTRIES = MyFsVolume<Geometry>::INODE_TABLE_ENTRIES;
+
+	/**
+	 * A dir found by a walker, that is waiting to be walked.
+	 */
+	struct pending_dir
+	{
+		uint32_t inode;
+		uint32_t parent_inode;
+		std::string path;
+	};
+
+	BlockDeviceSimulator *blkdevsim;
+	unsigned int _threads;
+
+	myfs_info _sys_info;
+	std::vector<struct MyFs::myfs_block_info> _block_table;
+	std::vector<struct MyFs::myfs_entry> _inode_table;
+	std::unordered_map<uint32_t, size_t> _inode_slots;
+
+	std::vector<std::atomic<uint32_t>> _block_refs;
+	std::vector<std::atomic<bool>> _block_visited;
+	std::vector<std::atomic<bool>> _inode_reached;
+
+	std::deque<struct pending_dir> _pending_dirs;
+	unsigned int _busy_walkers;
+	std::mutex _pending_lock;
+	std::condition_variable _pending_cond;
+
+	std::mutex _report_lock;
+	int _problems;
+
+	void report(const std::string &problem);
+	void walk_chain(uint32_t block_chain_head, const std::string &owner, uint32_t max_blocks, bool sorted);
+	void walk_dir(uint32_t inode, uint32_t parent_inode, const std::string &path);
+	void walk_pending_dirs();
+	bool read_dir(const struct MyFs::myfs_entry &dir, MyFs::dir_entries &entries);
+	bool parse_dir_records(const char *data, uint32_t size, MyFs::dir_entries &entries);
+	void read_chain(uint32_t block_chain_head, char *data, uint32_t size);
+	static bool is_valid_block(uint32_t block_index);
+};
+
+#endif // __MYFS_FSCK_H__
@@ -0,0 +1,77 @@
+#include "blkdev.h"
+#include "stripedev.h"
+#include "myfs_fsck.h"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+const std::string USAGE_STRING = "Usage: myfs-fsck [-r] [-j <threads>] [-w <stripe KB>] <image> [<image> ...]\n-r - repair the problems found. \n-j <threads> - the amount of threads walking the file system. \n-w <stripe KB> - the stripe width the images were written with. \n";
+
+int main(int argc, char **argv)
+{
+	bool repair = false;
+	unsigned int threads = std::thread::hardware_concurrency();
+	int stripe_kb = MYFS_DEFAULT_BLOCK_SIZE / 1024;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "rj:w:")) != -1)
+	{
+		if (opt == 'r')
+			repair = true;
+		else if (opt == 'j')
+			threads = std::stoul(optarg);
+		else if (opt == 'w')
+			stripe_kb = std::stoi(optarg);
+		else
+		{
+			std::cerr << USAGE_STRING;
+			return -1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		std::cerr << USAGE_STRING;
+		return -1;
+	}
+
+	// Don't let the device create a new image
+	for (int i = optind; i < argc; i++)
+	{
+		if (access(argv[i], R_OK | W_OK) != 0)
+		{
+			std::cerr << "Unable to open the image '" << argv[i] << "'" << std::endl;
+			return -1;
+		}
+	}
+
+	BlockDeviceSimulator *blkdevptr = nullptr;
+	try
+	{
+		if (argc - optind == 1)
+			blkdevptr = new BlockDeviceSimulator(argv[optind]);
+		else
+			blkdevptr = new StripedDeviceSimulator(std::vector<std::string>(argv + optind, argv + argc), stripe_kb * 1024);
+	}
+	catch (const std::runtime_error &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	MyFsChecker checker(blkdevptr, threads);
+	int problems = checker.check(repair);
+
+	if (problems == 0)
+		std::cout << "The file system is clean" << std::endl;
+	else if (repair)
+		std::cout << "Repaired " << problems << " problems" << std::endl;
+	else
+		std::cout << "Found " << problems << " problems" << std::endl;
+
+	delete blkdevptr;
+
+	return problems == 0 ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#ifndef __MYFS_GEOMETRY_H__
+#define __MYFS_GEOMETRY_H__
+
+#include <stdint.h>
+
+#include "blkdev.h"
+
+/**
+ * The block size new images are formatted with, unless another one is
+ * asked for. Images record the block size they were formatted with, and
+ * are mounted with the geometry of that block size.
+ */
+#define MYFS_DEFAULT_BLOCK_SIZE 4096
+
+/**
+ * myfs_geometry struct
+ * The layout of a myfs device with blocks of the given size. Every size
+ * and position the layout is made of is a compile time constant, so the
+ * arithmetic of the hot paths is folded into the code.
+ * The device starts with the header block, followed by the inode table,
+ * the block table and the data blocks. The inode table keeps it's size in
+ * bytes whatever the block size is, and the block table has an entry for
+ * every block of the device.
+ */
+template <uint32_t BlockSize, uint32_t DeviceSize = DEVICE_SIZE>
+struct myfs_geometry
+{
+	static_assert(BlockSize >= 1024 && (BlockSize & (BlockSize - 1)) == 0, "The block size must be a power of two of at least 1K");
+	static_assert(DeviceSize % BlockSize == 0, "The device must be made of whole blocks");
+
+	static constexpr uint32_t BLOCK_SIZE = BlockSize;
+	static constexpr uint32_t BLOCK_DATA_SIZE = BlockSize - 2 * sizeof(uint32_t);
+	static constexpr uint32_t BLOCK_COUNT = DeviceSize / BlockSize;
+
+	/**
+	 * The block size as a power of two, which is how the header records it
+	 */
+	static constexpr uint8_t BLOCK_SHIFT = __builtin_ctz(BlockSize);
+
+	static constexpr uint32_t INODE_TABLE_SIZE = 7 * 4096;
+	static constexpr uint32_t BLOCK_TABLE_ENTRY_SIZE = 16;
+
+	static constexpr uint32_t INODE_TABLE_BLOCKS = (INODE_TABLE_SIZE + BlockSize - 1) / BlockSize;
+	static constexpr uint32_t BLOCK_TABLE_BLOCKS = (BLOCK_COUNT * BLOCK_TABLE_ENTRY_SIZE + BlockSize - 1) / BlockSize;
+	static constexpr uint32_t FIRST_DATA_BLOCK = 1 + INODE_TABLE_BLOCKS + BLOCK_TABLE_BLOCKS;
+
+	static_assert(FIRST_DATA_BLOCK < BLOCK_COUNT, "The metadata blocks take the whole device");
+
+	/**
+	 * The device is split into groups of blocks, a dir and the files in it
+	 * are placed in the same group. There are up to 8 groups, and a group
+	 * has at least 16 blocks. The metadata blocks are in the first group.
+	 */
+	static constexpr uint32_t BLOCKS_PER_GROUP = BLOCK_COUNT / 8 > 16 ? BLOCK_COUNT / 8 : 16;
+	static constexpr uint32_t BLOCK_GROUP_COUNT = (BLOCK_COUNT + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+
+	/**
+	 * blocks_for_size method
+	 * @param size the size of a file
+	 * @return the amount of blocks the file takes, holes aside
+	 */
+	static constexpr uint32_t blocks_for_size(uint32_t size)
+	{
+		return size / BLOCK_DATA_SIZE + (size % BLOCK_DATA_SIZE == 0 ? 0 : 1);
+	}
+};
+
+/**
+ * The geometries myfs is built for, an image can be formatted with any of
+ * them
+ */
+typedef myfs_geometry<1024> myfs_geometry_1k;
+typedef myfs_geometry<4096> myfs_geometry_4k;
+typedef myfs_geometry<16384> myfs_geometry_16k;
+typedef myfs_geometry<65536> myfs_geometry_64k;
+
+/**
+ * visit_geometry function
+ * Calls the visitor with the geometry of the block size, so the code built
+ * for every geometry is picked by the block size an image was formatted
+ * with.
+ * @param block_size the size of the blocks
+ * @param visitor called with a value of the geometry's type
+ * @return whether there is a geometry of the block size
+ */
+template <typename Visitor>
+bool visit_geometry(uint32_t block_size, Visitor &&visitor)
+{
+	switch (block_size)
+	{
+	case myfs_geometry_1k::BLOCK_SIZE:
+		visitor(myfs_geometry_1k());
+		return true;
+	case myfs_geometry_4k::BLOCK_SIZE:
+		visitor(myfs_geometry_4k());
+		return true;
+	case myfs_geometry_16k::BLOCK_SIZE:
+		visitor(myfs_geometry_16k());
+		return true;
+	case myfs_geometry_64k::BLOCK_SIZE:
+		visitor(myfs_geometry_64k());
+		return true;
+	default:
+		return false;
+	}
+}
+
+#endif // __MYFS_GEOMETRY_H__
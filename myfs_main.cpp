@@ -1,11 +1,15 @@
 #include "blkdev.h"
+#include "stripedev.h"
 #include "myfs.h"
+#include "myfs_trace.h"
+#include "myfs_exception.h"
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <iomanip>
+#include <unistd.h>
 
 const std::string FS_NAME = "myfs";
 
@@ -15,11 +19,25 @@ const std::string CONTENT_CMD = "cat";
 const std::string CREATE_FILE_CMD = "touch";
 const std::string CREATE_DIR_CMD = "mkdir";
 const std::string EDIT_CMD = "edit";
+const std::string WRITE_CMD = "write";
+const std::string MAP_CMD = "map";
+const std::string HINT_CMD = "hint";
+const std::string DEFRAG_CMD = "defrag";
+const std::string FREE_CMD = "df";
+const std::string IOSTAT_CMD = "iostat";
+const std::string SYNC_CMD = "sync";
+const std::string REMOVE_CMD = "rm";
+const std::string REMOVE_DIR_CMD = "rmdir";
+const std::string TRUNCATE_CMD = "truncate";
+const std::string MOVE_CMD = "mv";
+const std::string CLONE_CMD = "clone";
+const std::string SNAPSHOT_CMD = "snapshot";
 const std::string TREE_CMD = "tree";
+const std::string DEDUP_CMD = "dedup";
 const std::string HELP_CMD = "help";
 const std::string EXIT_CMD = "exit";
 
-const std::string HELP_STRING = "The following commands are supported: \n" + LIST_CMD + " [<directory>] - list directory content. \n" + CHANGE_DIRECTORY_CMD + " [<directory>] - change directory. \n" + CONTENT_CMD + " <path> - show file content. \n" + CREATE_FILE_CMD + " <path> - create empty file. \n" + CREATE_DIR_CMD + " <path> - create empty directory. \n" + EDIT_CMD + " <path> - re-set file content. \n" + TREE_CMD + " - show the hierarchy of the file system. \n" + HELP_CMD + " - show this help messege. \n" + EXIT_CMD + " - gracefully exit. \n";
+const std::string HELP_STRING = "The following commands are supported: \n" + LIST_CMD + " [<directory>] - list directory content. \n" + CHANGE_DIRECTORY_CMD + " [<directory>] - change directory. \n" + CONTENT_CMD + " <path> - show file content. \n" + CREATE_FILE_CMD + " <path> - create empty file. \n" + CREATE_DIR_CMD + " <path> - create empty directory. \n" + EDIT_CMD + " <path> - re-set file content. \n" + WRITE_CMD + " <path> <offset> - write content at an offset of a file. \n" + MAP_CMD + " <path> - show the allocated ranges of a file. \n" + HINT_CMD + " <path> normal|sequential|random|dontneed - set how a file is going to be read. \n" + DEFRAG_CMD + " [<blocks per second>] - relocate the blocks of fragmented files. \n" + FREE_CMD + " - show the free blocks and inodes. \n" + IOSTAT_CMD + " [on|off] - show the requests the device saw since the last " + IOSTAT_CMD + ", they are counted once it's on. \n" + SYNC_CMD + " - write the cached file contents to the device. \n" + REMOVE_CMD + " <path> - remove a file. \n" + REMOVE_DIR_CMD + " <path> - remove an empty directory. \n" + TRUNCATE_CMD + " <path> <size> - set the size of a file. \n" + MOVE_CMD + " <path> <new path> - move or rename a file or a directory. \n" + CLONE_CMD + " <path> <new path> - clone a file without copying it's content. \n" + SNAPSHOT_CMD + " create|delete|use <name> / list / use - manage and browse read-only snapshots. \n" + TREE_CMD + " - show the hierarchy of the file system. \n" + DEDUP_CMD + " [on|off] - show or set block deduplication, files share the blocks of identical tails (the same content from a block to the end). \n" + HELP_CMD + " - show this help messege. \n" + EXIT_CMD + " - gracefully exit. \n";
 
 std::vector<std::string> split_cmd(std::string cmd)
 {
@@ -33,53 +51,107 @@ std::vector<std::string> split_cmd(std::string cmd)
 	return ans;
 }
 
-static void recursive_print(MyFs &myfs, std::string path, std::string prefix = "")
+static void print_tree(MyFs &myfs, std::string path)
 {
-	MyFs::dir_list dlist = myfs.list_dir(path);
+	// The prefix of every depth, by whether the dirs above it were the last in their dir
+	std::vector<std::string> prefixes(1, "");
 
-	for (size_t i = 0; i < dlist.size(); i++)
+	myfs.walk_tree(path, [&prefixes](const MyFs::dir_list_entry &entry, uint32_t depth, bool is_last)
 	{
-		MyFs::dir_list_entry &curr_entry = dlist[i];
+		std::cout << prefixes[depth] << (is_last ? "└── " : "├── ") << entry.name << std::endl;
 
-		if (curr_entry.name == "." || curr_entry.name == "..")
+		// The files in the dir are printed right after it
+		if (entry.is_dir)
 		{
-			continue;
+			prefixes.resize(depth + 2);
+			prefixes[depth + 1] = prefixes[depth] + (is_last ? "    " : "│   ");
 		}
+	});
+}
 
-		std::string entry_prefix = prefix;
-		if (i == dlist.size() - 1)
-			entry_prefix += "└── ";
-		else
-			entry_prefix += "├── ";
-
-		std::cout << entry_prefix << curr_entry.name << std::endl;
+int main(int argc, char **argv)
+{
+	// The width of a stripe in KB, when the file system is spread over several images
+	int stripe_kb = MYFS_DEFAULT_BLOCK_SIZE / 1024;
+	// The block size a new file system is formatted with
+	uint32_t block_size = MYFS_DEFAULT_BLOCK_SIZE;
+	// The emulated device, the images are used at memory speed without one
+	const struct device_profile *profile = nullptr;
+	// Where the operations are recorded, for replaying them with myfs-replay
+	std::string trace_name;
+	// Whether the images are mounted read-only, they are shared with other readers then
+	bool read_only = false;
+	int opt = 0;
 
-		if (curr_entry.is_dir)
+	while ((opt = getopt(argc, argv, "w:b:p:t:r")) != -1)
+	{
+		if (opt == 'r')
+			read_only = true;
+		else if (opt == 'w')
+			stripe_kb = std::stoi(optarg);
+		else if (opt == 'b')
+			block_size = std::stoul(optarg);
+		else if (opt == 't')
+			trace_name = optarg;
+		else if (opt == 'p' && (profile = BlockDeviceSimulator::find_profile(optarg)) != nullptr)
+			continue;
+		else
 		{
-			std::string dir_prefix = prefix;
-
-			if (i == dlist.size() - 1)
-				dir_prefix += "    ";
-			else
-				dir_prefix += "│   ";
-			recursive_print(myfs, path + curr_entry.name + "/", dir_prefix);
+			std::cerr << "Usage: " << FS_NAME << " [-r] [-w <stripe KB>] [-b <block size>] [-p hdd|ssd|nvme] [-t <trace>] <image> [<image> ...]" << std::endl;
+			return -1;
 		}
 	}
-}
 
-int main(int argc, char **argv)
-{
-	if (argc != 2)
+	if (optind >= argc)
 	{
 		std::cerr << "Please provide the file to operate on" << std::endl;
 		return -1;
 	}
 
-	BlockDeviceSimulator *blkdevptr = new BlockDeviceSimulator(argv[1]);
+	BlockDeviceSimulator *blkdevptr = nullptr;
+	try
+	{
+		if (argc - optind == 1)
+			blkdevptr = new BlockDeviceSimulator(argv[optind], DEVICE_SIZE, read_only);
+		else
+			blkdevptr = new StripedDeviceSimulator(std::vector<std::string>(argv + optind, argv + argc), stripe_kb * 1024, read_only);
+	}
+	catch (const std::runtime_error &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+	blkdevptr->set_profile(profile);
+
+	std::unique_ptr<MyFsTrace> trace;
+	try
+	{
+		if (!trace_name.empty())
+			trace.reset(new MyFsTrace(trace_name));
+	}
+	catch (const MyFsException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	std::unique_ptr<MyFs> myfs_ptr;
+	try
+	{
+		myfs_ptr = MyFs::mount(blkdevptr, block_size);
+	}
+	catch (const MyFsException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
 	std::string current_dir_name = "/";
-	MyFs myfs(blkdevptr);
+	MyFs &myfs = *myfs_ptr;
 	bool exit = false;
 
+	myfs.set_trace(trace.get());
+
 	std::cout << "Welcome to " << FS_NAME << std::endl;
 	std::cout << "To get help, please type 'help' on the prompt below." << std::endl;
 	std::cout << std::endl;
@@ -132,7 +204,14 @@ int main(int argc, char **argv)
 			else if (cmd[0] == CONTENT_CMD)
 			{
 				if (cmd.size() == 2)
-					std::cout << myfs.get_content(cmd[1]) << std::endl;
+				{
+					// Print the file block by block
+					MyFs::FileReader reader(myfs, cmd[1]);
+					std::vector<char> buffer(myfs.get_block_size());
+					while (!reader.eof())
+						std::cout.write(buffer.data(), reader.read(buffer.data(), buffer.size()));
+					std::cout << std::endl;
+				}
 				else
 					std::cout << CONTENT_CMD << ": file path requested" << std::endl;
 			}
@@ -145,13 +224,50 @@ int main(int argc, char **argv)
 			}
 			else if (cmd[0] == TREE_CMD)
 			{
-				recursive_print(myfs, "/");
+				print_tree(myfs, "/");
 			}
 			else if (cmd[0] == EDIT_CMD)
 			{
 				if (cmd.size() == 2)
 				{
+					// The content is written line by line, errors are shown after all of it was entered
+					std::unique_ptr<MyFs::FileWriter> writer;
+					std::string error;
+					try
+					{
+						writer.reset(new MyFs::FileWriter(myfs, cmd[1]));
+					}
+					catch (std::exception &e)
+					{
+						error = e.what();
+					}
+
 					std::cout << "Enter new file content" << std::endl;
+					std::string curr_line;
+					std::getline(std::cin, curr_line);
+					while (curr_line != "")
+					{
+						curr_line += "\n";
+						if (writer)
+							writer->write(curr_line.c_str(), curr_line.size());
+						std::getline(std::cin, curr_line);
+					}
+
+					if (writer)
+						writer->close();
+					else
+						std::cout << error << std::endl;
+				}
+				else
+				{
+					std::cout << EDIT_CMD << ": file path requested" << std::endl;
+				}
+			}
+			else if (cmd[0] == WRITE_CMD)
+			{
+				if (cmd.size() == 3)
+				{
+					std::cout << "Enter content to write" << std::endl;
 					std::string content;
 					std::string curr_line;
 					std::getline(std::cin, curr_line);
@@ -160,12 +276,163 @@ int main(int argc, char **argv)
 						content += curr_line + "\n";
 						std::getline(std::cin, curr_line);
 					}
-					myfs.set_content(cmd[1], content);
+					myfs.write_content(cmd[1], std::stoul(cmd[2]), content);
 				}
 				else
 				{
-					std::cout << EDIT_CMD << ": file path requested" << std::endl;
+					std::cout << WRITE_CMD << ": file path and offset requested" << std::endl;
+				}
+			}
+			else if (cmd[0] == MAP_CMD)
+			{
+				if (cmd.size() == 2)
+				{
+					uint32_t data_start = myfs.seek_data(cmd[1], 0);
+					uint32_t data_end = myfs.seek_hole(cmd[1], data_start);
+					while (data_start != data_end)
+					{
+						std::cout << "data: " << data_start << " - " << data_end << std::endl;
+						data_start = myfs.seek_data(cmd[1], data_end);
+						data_end = myfs.seek_hole(cmd[1], data_start);
+					}
+					std::cout << "fragments: " << myfs.get_fragments(cmd[1]) << std::endl;
+				}
+				else
+				{
+					std::cout << MAP_CMD << ": file path requested" << std::endl;
+				}
+			}
+			else if (cmd[0] == FREE_CMD)
+			{
+				std::cout << "free blocks: " << myfs.get_free_blocks() << std::endl;
+				std::cout << "free inodes: " << myfs.get_free_inodes() << std::endl;
+			}
+			else if (cmd[0] == SYNC_CMD)
+			{
+				myfs.sync();
+			}
+			else if (cmd[0] == IOSTAT_CMD && cmd.size() == 2)
+			{
+				if (cmd[1] == "on" || cmd[1] == "off")
+				{
+					blkdevptr->reset_io_stats();
+					blkdevptr->set_recording(cmd[1] == "on");
+				}
+				else
+					std::cout << IOSTAT_CMD << ": 'on' or 'off' requested" << std::endl;
+			}
+			else if (cmd[0] == IOSTAT_CMD && !blkdevptr->is_recording())
+			{
+				std::cout << "The requests aren't counted, turn it on with '" << IOSTAT_CMD << " on'" << std::endl;
+			}
+			else if (cmd[0] == IOSTAT_CMD)
+			{
+				struct io_stats stats = blkdevptr->get_io_stats();
+				uint64_t requests = stats.sequential + stats.random;
+				blkdevptr->reset_io_stats();
+
+				std::cout << "reads: " << stats.reads << " (" << stats.read_bytes << " bytes)" << std::endl;
+				std::cout << "writes: " << stats.writes << " (" << stats.written_bytes << " bytes)" << std::endl;
+				std::cout << "sequential: " << (requests == 0 ? 0 : stats.sequential * 100 / requests) << "%" << std::endl;
+				if (profile != nullptr)
+					std::cout << "device time (" << profile->name << "): " << std::fixed << std::setprecision(0) << stats.device_time_us << " us" << std::endl;
+			}
+			else if (cmd[0] == DEFRAG_CMD)
+			{
+				if (cmd.size() <= 2)
+				{
+					MyFs::defrag_progress progress = myfs.defrag([](const MyFs::defrag_progress &progress)
+					{
+						std::cout << "\r" << DEFRAG_CMD << ": " << progress.files_done << "/" << progress.files_total << " files" << std::flush;
+						return true;
+					}, cmd.size() == 2 ? std::stoul(cmd[1]) : 0);
+					std::cout << std::endl << progress.files_moved << " files defragmented, " << progress.blocks_moved << " blocks moved" << std::endl;
+				}
+				else
+				{
+					std::cout << DEFRAG_CMD << ": zero or one arguments requested" << std::endl;
+				}
+			}
+			else if (cmd[0] == HINT_CMD)
+			{
+				if (cmd.size() == 3 && (cmd[2] == "normal" || cmd[2] == "sequential" || cmd[2] == "random" || cmd[2] == "dontneed"))
+				{
+					if (cmd[2] == "normal")
+						myfs.set_access_hint(cmd[1], MyFs::ACCESS_NORMAL);
+					else if (cmd[2] == "sequential")
+						myfs.set_access_hint(cmd[1], MyFs::ACCESS_SEQUENTIAL);
+					else if (cmd[2] == "random")
+						myfs.set_access_hint(cmd[1], MyFs::ACCESS_RANDOM);
+					else
+						myfs.set_access_hint(cmd[1], MyFs::ACCESS_DONTNEED);
 				}
+				else
+				{
+					std::cout << HINT_CMD << ": file path and normal, sequential, random or dontneed requested" << std::endl;
+				}
+			}
+			else if (cmd[0] == REMOVE_CMD)
+			{
+				if (cmd.size() == 2)
+					myfs.remove_file(cmd[1]);
+				else
+					std::cout << REMOVE_CMD << ": file path requested" << std::endl;
+			}
+			else if (cmd[0] == REMOVE_DIR_CMD)
+			{
+				if (cmd.size() == 2)
+					myfs.remove_dir(cmd[1]);
+				else
+					std::cout << REMOVE_DIR_CMD << ": one argument requested" << std::endl;
+			}
+			else if (cmd[0] == TRUNCATE_CMD)
+			{
+				if (cmd.size() == 3)
+					myfs.truncate(cmd[1], std::stoul(cmd[2]));
+				else
+					std::cout << TRUNCATE_CMD << ": file path and size requested" << std::endl;
+			}
+			else if (cmd[0] == MOVE_CMD)
+			{
+				if (cmd.size() == 3)
+					myfs.rename(cmd[1], cmd[2]);
+				else
+					std::cout << MOVE_CMD << ": source and destination paths requested" << std::endl;
+			}
+			else if (cmd[0] == CLONE_CMD)
+			{
+				if (cmd.size() == 3)
+					myfs.clone(cmd[1], cmd[2]);
+				else
+					std::cout << CLONE_CMD << ": source and destination paths requested" << std::endl;
+			}
+			else if (cmd[0] == SNAPSHOT_CMD)
+			{
+				if (cmd.size() == 3 && cmd[1] == "create")
+					myfs.create_snapshot(cmd[2]);
+				else if (cmd.size() == 3 && cmd[1] == "delete")
+					myfs.delete_snapshot(cmd[2]);
+				else if (cmd.size() == 2 && cmd[1] == "list")
+				{
+					for (auto &name : myfs.list_snapshots())
+						std::cout << name << std::endl;
+				}
+				else if (cmd.size() <= 3 && cmd.size() >= 2 && cmd[1] == "use")
+				{
+					myfs.use_snapshot(cmd.size() == 3 ? cmd[2] : "");
+					current_dir_name = "/";
+				}
+				else
+					std::cout << SNAPSHOT_CMD << ": create, delete, list or use requested" << std::endl;
+			}
+			else if (cmd[0] == DEDUP_CMD)
+			{
+				if (cmd.size() == 1)
+					std::cout << "dedup is " << (myfs.is_dedup_enabled() ? "on" : "off") << std::endl;
+				else if (cmd.size() == 2 && (cmd[1] == "on" || cmd[1] == "off"))
+					myfs.set_dedup(cmd[1] == "on");
+				else
+					std::cout << DEDUP_CMD << ": 'on' or 'off' requested" << std::endl;
 			}
 			else if (cmd[0] == CREATE_DIR_CMD)
 			{
@@ -0,0 +1,151 @@
+#include "blkdev.h"
+#include "myfs.h"
+#include "myfs_trace.h"
+#include "myfs_exception.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+const std::string USAGE_STRING = "Usage: myfs-replay [-r] [-b <block size>] [-p hdd|ssd|nvme] <trace> <image>\nThe image is formatted, and the operations of the trace are run on it one after another, in the order they started. \n-r - keep the original timing, an operation isn't started before it's time in the trace. \n-b <block size> - the block size the image is formatted with. \n-p hdd|ssd|nvme - emulate the speed of a device. \n";
+
+// The latency below which the given part of the latencies are
+static uint32_t percentile(const std::vector<uint32_t> &sorted, uint32_t percent)
+{
+	return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+static void print_latencies(const std::string &name, std::vector<uint32_t> replayed, std::vector<uint32_t> recorded)
+{
+	std::sort(replayed.begin(), replayed.end());
+	std::sort(recorded.begin(), recorded.end());
+
+	std::cout << std::left << std::setw(22) << name << std::right << std::setw(8) << replayed.size();
+	std::cout << std::setw(9) << percentile(replayed, 50) << std::setw(9) << percentile(replayed, 90) << std::setw(9) << percentile(replayed, 99) << std::setw(9) << replayed.back();
+	std::cout << std::setw(12) << percentile(recorded, 50) << std::setw(12) << percentile(recorded, 99) << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	bool original_timing = false;
+	uint32_t block_size = MYFS_DEFAULT_BLOCK_SIZE;
+	const struct device_profile *profile = nullptr;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "rb:p:")) != -1)
+	{
+		if (opt == 'r')
+			original_timing = true;
+		else if (opt == 'b')
+			block_size = std::stoul(optarg);
+		else if (opt == 'p' && (profile = BlockDeviceSimulator::find_profile(optarg)) != nullptr)
+			continue;
+		else
+		{
+			std::cerr << USAGE_STRING;
+			return -1;
+		}
+	}
+
+	if (optind != argc - 2)
+	{
+		std::cerr << USAGE_STRING;
+		return -1;
+	}
+
+	std::vector<struct trace_record> records;
+	try
+	{
+		records = MyFsTrace::load(argv[optind]);
+	}
+	catch (const MyFsException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	// Concurrent operations were recorded as they finished
+	std::stable_sort(records.begin(), records.end(), [](const struct trace_record &a, const struct trace_record &b) { return a.start_us < b.start_us; });
+
+	BlockDeviceSimulator *blkdevptr = new BlockDeviceSimulator(argv[optind + 1]);
+	std::vector<std::vector<uint32_t>> replayed(MyFsTrace::TRACE_OPERATIONS), recorded(MyFsTrace::TRACE_OPERATIONS);
+	std::vector<uint32_t> all_replayed, all_recorded;
+	std::unordered_map<uint32_t, uint32_t> handles;
+	uint32_t diverged = 0;
+	double seconds = 0;
+
+	try
+	{
+		// Start from a fresh file system, on the emulated device
+		std::unique_ptr<MyFs> myfs = MyFs::format(blkdevptr, block_size);
+		blkdevptr->set_profile(profile);
+
+		auto start = std::chrono::steady_clock::now();
+		for (auto &record : records)
+		{
+			bool failed = false;
+
+			if (original_timing)
+			{
+				std::this_thread::sleep_until(start + std::chrono::microseconds(record.start_us));
+			}
+
+			// The result is compared to the original one, a different result means the replay went another way
+			auto operation_start = std::chrono::steady_clock::now();
+			try
+			{
+				MyFsTrace::replay(*myfs, record, handles);
+			}
+			catch (const MyFsException &e)
+			{
+				failed = true;
+			}
+			uint32_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - operation_start).count();
+			diverged += failed != record.failed ? 1 : 0;
+
+			replayed[record.operation].push_back(latency);
+			recorded[record.operation].push_back(record.duration_us);
+			all_replayed.push_back(latency);
+			all_recorded.push_back(record.duration_us);
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	catch (const MyFsException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		delete blkdevptr;
+		return -1;
+	}
+
+	std::cout << records.size() << " operations replayed in " << std::fixed << std::setprecision(3) << seconds << " s";
+	std::cout << (profile == nullptr ? "" : std::string(" on an emulated ") + profile->name) << std::endl;
+	if (diverged != 0)
+	{
+		std::cout << diverged << " operations succeeded or failed unlike in the trace" << std::endl;
+	}
+	if (records.empty())
+	{
+		delete blkdevptr;
+		return 0;
+	}
+
+	std::cout << std::endl << "latency (us)             count      p50      p90      p99      max  traced p50  traced p99" << std::endl;
+	for (uint8_t operation = 0; operation < MyFsTrace::TRACE_OPERATIONS; operation++)
+	{
+		if (!replayed[operation].empty())
+		{
+			print_latencies(MyFsTrace::operation_name(operation), replayed[operation], recorded[operation]);
+		}
+	}
+	print_latencies("all", all_replayed, all_recorded);
+
+	delete blkdevptr;
+
+	return 0;
+}
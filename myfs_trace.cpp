@@ -0,0 +1,368 @@
+#include "myfs_trace.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "utils.h"
+#include "myfs_exception.h"
+
+const char *MyFsTrace::TRACE_MAGIC = "MYTR";
+
+thread_local uint32_t MyFsTraceScope::_depth = 0;
+
+// The name and the amount of strings and numbers of every operation
+static const struct
+{
+	const char *name;
+	uint32_t strings;
+	uint32_t numbers;
+} TRACE_OPERATION_ARGS[MyFsTrace::TRACE_OPERATIONS] = {
+	{"format", 0, 0},
+	{"create_file", 1, 1},
+	{"get_content", 1, 0},
+	{"set_content", 1, 2},
+	{"read_content", 1, 2},
+	{"write_content", 1, 3},
+	{"seek_data", 1, 1},
+	{"seek_hole", 1, 1},
+	{"set_access_hint", 1, 1},
+	{"get_free_blocks", 0, 0},
+	{"get_free_inodes", 0, 0},
+	{"get_fragments", 1, 0},
+	{"defrag", 0, 1},
+	{"list_dir", 1, 0},
+	{"list_dir_inode", 0, 1},
+	{"walk_tree", 1, 0},
+	{"change_directory", 1, 0},
+	{"remove_file", 1, 0},
+	{"remove_dir", 1, 0},
+	{"truncate", 1, 1},
+	{"rename", 2, 0},
+	{"clone", 2, 0},
+	{"create_snapshot", 1, 0},
+	{"delete_snapshot", 1, 0},
+	{"list_snapshots", 0, 0},
+	{"use_snapshot", 1, 0},
+	{"set_dedup", 0, 1},
+	{"is_dedup_enabled", 0, 0},
+	{"commit_batch", 0, 0},
+	{"sync", 0, 0},
+	{"open", 1, 1},
+	{"close", 0, 1},
+	{"read_content_handle", 0, 3},
+	{"write_content_handle", 0, 4},
+};
+
+// Numbers are written in 7 bit groups, so small offsets and sizes take a byte or two
+static void write_varint(std::string &buffer, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		buffer.push_back((char)(value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	buffer.push_back((char)value);
+}
+
+static uint64_t read_varint(std::istream &file)
+{
+	uint64_t value = 0;
+	int byte = 0;
+
+	for (uint32_t shift = 0; shift < 64; shift += 7)
+	{
+		byte = file.get();
+		if (byte == EOF)
+		{
+			throw MyFsException("The trace is truncated!");
+		}
+
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+		{
+			return value;
+		}
+	}
+
+	throw MyFsException("The trace is corrupted!");
+}
+
+MyFsTrace::MyFsTrace(std::string fname) : _file(fname, std::ios::binary | std::ios::trunc), _start(std::chrono::steady_clock::now())
+{
+	if (!_file)
+	{
+		throw MyFsException("Unable to create the trace '" + fname + "'!");
+	}
+
+	// The trace starts with it's magic and version
+	_file.write(TRACE_MAGIC, strlen(TRACE_MAGIC));
+	_file.put(TRACE_VERSION);
+}
+
+void MyFsTrace::write(const struct trace_record &record)
+{
+	std::string buffer;
+
+	// Encode the record: the operation, whether it failed, it's timing and it's arguments
+	buffer.push_back(record.operation);
+	buffer.push_back(record.failed ? 1 : 0);
+	write_varint(buffer, record.start_us);
+	write_varint(buffer, record.duration_us);
+	write_varint(buffer, record.numbers.size());
+	for (uint32_t number : record.numbers)
+	{
+		write_varint(buffer, number);
+	}
+	write_varint(buffer, record.strings.size());
+	for (auto &value : record.strings)
+	{
+		write_varint(buffer, value.size());
+		buffer += value;
+	}
+
+	// The records of concurrent operations aren't interleaved
+	std::lock_guard<std::mutex> lock(_lock);
+	_file.write(buffer.data(), buffer.size());
+}
+
+uint64_t MyFsTrace::now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+}
+
+std::vector<struct trace_record> MyFsTrace::load(std::string fname)
+{
+	std::ifstream file(fname, std::ios::binary);
+	std::vector<struct trace_record> records;
+	struct trace_record record;
+	char magic[4] = {0};
+	int byte = 0;
+
+	if (!file)
+	{
+		throw MyFsException("Unable to open the trace '" + fname + "'!");
+	}
+
+	// Check the trace was written by a version we know
+	file.read(magic, sizeof(magic));
+	if (!file || strncmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 || file.get() != TRACE_VERSION)
+	{
+		throw MyFsException("'" + fname + "' isn't a myfs trace!");
+	}
+
+	// Read records until the end of the file
+	while ((byte = file.get()) != EOF)
+	{
+		record.operation = byte;
+		if (record.operation >= TRACE_OPERATIONS || (byte = file.get()) == EOF)
+		{
+			throw MyFsException("The trace is corrupted!");
+		}
+		record.failed = byte != 0;
+		record.start_us = read_varint(file);
+		record.duration_us = read_varint(file);
+
+		record.numbers.resize(read_varint(file));
+		for (auto &number : record.numbers)
+		{
+			number = read_varint(file);
+		}
+
+		record.strings.resize(read_varint(file));
+		for (auto &value : record.strings)
+		{
+			value.resize(read_varint(file));
+			file.read(&value[0], value.size());
+		}
+		if (!file)
+		{
+			throw MyFsException("The trace is truncated!");
+		}
+
+		// Check the operation got the arguments it's replayed with, a batch has three numbers per string
+		if (record.operation == TRACE_COMMIT_BATCH ? record.numbers.size() != record.strings.size() * 3 :
+			(record.strings.size() != TRACE_OPERATION_ARGS[record.operation].strings || record.numbers.size() != TRACE_OPERATION_ARGS[record.operation].numbers))
+		{
+			throw MyFsException("The trace is corrupted!");
+		}
+
+		records.push_back(record);
+	}
+
+	return records;
+}
+
+void MyFsTrace::replay(MyFs &myfs, const struct trace_record &record, std::unordered_map<uint32_t, uint32_t> &handles)
+{
+	const std::vector<std::string> &strings = record.strings;
+	const std::vector<uint32_t> &numbers = record.numbers;
+	MyFs::Batch batch(myfs);
+
+	switch (record.operation)
+	{
+	case TRACE_FORMAT:
+		myfs.format();
+		break;
+	case TRACE_CREATE_FILE:
+		myfs.create_file(strings[0], numbers[0] != 0);
+		break;
+	case TRACE_GET_CONTENT:
+		myfs.get_content(strings[0]);
+		break;
+	case TRACE_SET_CONTENT:
+		myfs.set_content(strings[0], make_content(numbers[0], numbers[1]));
+		break;
+	case TRACE_READ_CONTENT:
+		myfs.read_content(strings[0], numbers[0], numbers[1]);
+		break;
+	case TRACE_WRITE_CONTENT:
+		myfs.write_content(strings[0], numbers[0], make_content(numbers[1], numbers[2]));
+		break;
+	case TRACE_SEEK_DATA:
+		myfs.seek_data(strings[0], numbers[0]);
+		break;
+	case TRACE_SEEK_HOLE:
+		myfs.seek_hole(strings[0], numbers[0]);
+		break;
+	case TRACE_SET_ACCESS_HINT:
+		myfs.set_access_hint(strings[0], numbers[0]);
+		break;
+	case TRACE_GET_FREE_BLOCKS:
+		myfs.get_free_blocks();
+		break;
+	case TRACE_GET_FREE_INODES:
+		myfs.get_free_inodes();
+		break;
+	case TRACE_GET_FRAGMENTS:
+		myfs.get_fragments(strings[0]);
+		break;
+	case TRACE_DEFRAG:
+		myfs.defrag(nullptr, numbers[0]);
+		break;
+	case TRACE_LIST_DIR:
+		myfs.list_dir(strings[0]);
+		break;
+	case TRACE_LIST_DIR_INODE:
+		myfs.list_dir(numbers[0]);
+		break;
+	case TRACE_WALK_TREE:
+		myfs.walk_tree(strings[0], [](const MyFs::dir_list_entry &entry, uint32_t depth, bool is_last) {});
+		break;
+	case TRACE_CHANGE_DIRECTORY:
+		myfs.change_directory(strings[0]);
+		break;
+	case TRACE_REMOVE_FILE:
+		myfs.remove_file(strings[0]);
+		break;
+	case TRACE_REMOVE_DIR:
+		myfs.remove_dir(strings[0]);
+		break;
+	case TRACE_TRUNCATE:
+		myfs.truncate(strings[0], numbers[0]);
+		break;
+	case TRACE_RENAME:
+		myfs.rename(strings[0], strings[1]);
+		break;
+	case TRACE_CLONE:
+		myfs.clone(strings[0], strings[1]);
+		break;
+	case TRACE_CREATE_SNAPSHOT:
+		myfs.create_snapshot(strings[0]);
+		break;
+	case TRACE_DELETE_SNAPSHOT:
+		myfs.delete_snapshot(strings[0]);
+		break;
+	case TRACE_LIST_SNAPSHOTS:
+		myfs.list_snapshots();
+		break;
+	case TRACE_USE_SNAPSHOT:
+		myfs.use_snapshot(strings[0]);
+		break;
+	case TRACE_SET_DEDUP:
+		myfs.set_dedup(numbers[0] != 0);
+		break;
+	case TRACE_IS_DEDUP_ENABLED:
+		myfs.is_dedup_enabled();
+		break;
+	case TRACE_COMMIT_BATCH:
+		// Every operation of the batch has a path, a kind and a content
+		for (size_t i = 0; i < strings.size(); i++)
+		{
+			if (numbers[i * 3] == BATCH_SET_CONTENT)
+			{
+				batch.set_content(strings[i], make_content(numbers[i * 3 + 1], numbers[i * 3 + 2]));
+			}
+			else
+			{
+				batch.create_file(strings[i], numbers[i * 3] == BATCH_CREATE_DIR);
+			}
+		}
+		batch.commit();
+		break;
+	case TRACE_SYNC:
+		myfs.sync();
+		break;
+	case TRACE_OPEN:
+		handles[numbers[0]] = myfs.open(strings[0]);
+		break;
+	case TRACE_CLOSE:
+		// Handles that weren't opened by the replay are 0, which is never a handle
+		myfs.close(handles[numbers[0]]);
+		handles.erase(numbers[0]);
+		break;
+	case TRACE_READ_CONTENT_HANDLE:
+		myfs.read_content(handles[numbers[0]], numbers[1], numbers[2]);
+		break;
+	case TRACE_WRITE_CONTENT_HANDLE:
+		myfs.write_content(handles[numbers[0]], numbers[1], make_content(numbers[2], numbers[3]));
+		break;
+	default:
+		throw MyFsException("Unknown trace operation!");
+	}
+}
+
+const char *MyFsTrace::operation_name(uint8_t operation)
+{
+	return operation < TRACE_OPERATIONS ? TRACE_OPERATION_ARGS[operation].name : "unknown";
+}
+
+uint32_t MyFsTrace::content_hash(const char *data, uint32_t size)
+{
+	uint64_t fingerprint = 0;
+	uint32_t hash = 0;
+
+	// 0 is reserved for zeroed content
+	if (Utils::IsZero(data, size))
+	{
+		return 0;
+	}
+
+	fingerprint = Utils::Fingerprint(data, size);
+	hash = uint32_t(fingerprint ^ (fingerprint >> 32));
+
+	return hash == 0 ? 1 : hash;
+}
+
+std::string MyFsTrace::make_content(uint32_t size, uint32_t hash)
+{
+	std::string content(size, '\0');
+	uint64_t state = hash | ((uint64_t)size << 32) | 1;
+
+	// Zeroed content is kept, since zeroed blocks aren't allocated
+	if (hash == 0)
+	{
+		return content;
+	}
+
+	// Writes of the same original content get the same made up content, it's made a word at a time with
+	// xorshift so making it doesn't weigh on the latency of the write
+	for (uint32_t offset = 0; offset < size; offset += sizeof(state))
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		memcpy(&content[offset], &state, std::min((uint32_t)sizeof(state), size - offset));
+	}
+
+	return content;
+}
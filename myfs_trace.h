@@ -0,0 +1,278 @@
+#ifndef __MYFS_TRACE_H__
+#define __MYFS_TRACE_H__
+
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "myfs.h"
+
+/**
+ * trace_record struct
+ * A single operation of a trace. The arguments of the operation are kept as
+ * strings (paths and names) and numbers (offsets, sizes and flags), the
+ * content of writes is kept only by it's size and hash.
+ */
+struct trace_record
+{
+	uint8_t operation;
+
+	/**
+	 * Whether the operation threw
+	 */
+	bool failed;
+
+	/**
+	 * When the operation started, from the start of the trace
+	 */
+	uint64_t start_us;
+	uint32_t duration_us;
+
+	std::vector<std::string> strings;
+	std::vector<uint32_t> numbers;
+};
+
+/**
+ * MyFsTrace class
+ * Records the public operations of a myfs instance into a compact binary
+ * trace file, and replays the operations of such a file on another
+ * instance. Every record is written once it's operation returns, so the
+ * records of concurrent operations are in the order they finished.
+ */
+class MyFsTrace
+{
+  public:
+	/**
+	 * The operations of a trace, the content of a batch is a string and three
+	 * numbers per operation: it's kind, and the size and the hash of it's
+	 * content. An open is recorded with the handle it returned, which the
+	 * operations on the handle are recorded with.
+	 */
+	static const uint8_t TRACE_FORMAT = 0;
+	static const uint8_t TRACE_CREATE_FILE = 1;
+	static const uint8_t TRACE_GET_CONTENT = 2;
+	static const uint8_t TRACE_SET_CONTENT = 3;
+	static const uint8_t TRACE_READ_CONTENT = 4;
+	static const uint8_t TRACE_WRITE_CONTENT = 5;
+	static const uint8_t TRACE_SEEK_DATA = 6;
+	static const uint8_t TRACE_SEEK_HOLE = 7;
+	static const uint8_t TRACE_SET_ACCESS_HINT = 8;
+	static const uint8_t TRACE_GET_FREE_BLOCKS = 9;
+	static const uint8_t TRACE_GET_FREE_INODES = 10;
+	static const uint8_t TRACE_GET_FRAGMENTS = 11;
+	static const uint8_t TRACE_DEFRAG = 12;
+	static const uint8_t TRACE_LIST_DIR = 13;
+	static const uint8_t TRACE_LIST_DIR_INODE = 14;
+	static const uint8_t TRACE_WALK_TREE = 15;
+	static const uint8_t TRACE_CHANGE_DIRECTORY = 16;
+	static const uint8_t TRACE_REMOVE_FILE = 17;
+	static const uint8_t TRACE_REMOVE_DIR = 18;
+	static const uint8_t TRACE_TRUNCATE = 19;
+	static const uint8_t TRACE_RENAME = 20;
+	static const uint8_t TRACE_CLONE = 21;
+	static const uint8_t TRACE_CREATE_SNAPSHOT = 22;
+	static const uint8_t TRACE_DELETE_SNAPSHOT = 23;
+	static const uint8_t TRACE_LIST_SNAPSHOTS = 24;
+	static const uint8_t TRACE_USE_SNAPSHOT = 25;
+	static const uint8_t TRACE_SET_DEDUP = 26;
+	static const uint8_t TRACE_IS_DEDUP_ENABLED = 27;
+	static const uint8_t TRACE_COMMIT_BATCH = 28;
+	static const uint8_t TRACE_SYNC = 29;
+	static const uint8_t TRACE_OPEN = 30;
+	static const uint8_t TRACE_CLOSE = 31;
+	static const uint8_t TRACE_READ_CONTENT_HANDLE = 32;
+	static const uint8_t TRACE_WRITE_CONTENT_HANDLE = 33;
+	static const uint8_t TRACE_OPERATIONS = 34;
+
+	static const uint8_t BATCH_SET_CONTENT = 0;
+	static const uint8_t BATCH_CREATE_FILE = 1;
+	static const uint8_t BATCH_CREATE_DIR = 2;
+
+	/**
+	 * @param fname the trace file, it's created or emptied
+	 */
+	MyFsTrace(std::string fname);
+
+	/**
+	 * write method
+	 * Appends a record to the trace, it may be called from several threads.
+	 * @param record the operation that was done
+	 */
+	void write(const struct trace_record &record);
+
+	/**
+	 * now method
+	 * @return the time from the start of the trace in microseconds
+	 */
+	uint64_t now();
+
+	/**
+	 * load method
+	 * Reads all the records of a trace file.
+	 * @param fname the trace file
+	 * @return the records in the order they were written
+	 */
+	static std::vector<struct trace_record> load(std::string fname);
+
+	/**
+	 * replay method
+	 * Runs the operation of a record again, the content of writes is made up
+	 * from it's hash, so the same content is written for the same original
+	 * content. Errors of the operation are thrown like they were by the
+	 * original one.
+	 * @param myfs the file system to run the operation on
+	 * @param record the operation to run
+	 * @param handles the handles opened by the replay, by the handles of the
+	 *	trace, it's updated by opens and closes
+	 */
+	static void replay(MyFs &myfs, const struct trace_record &record, std::unordered_map<uint32_t, uint32_t> &handles);
+
+	/**
+	 * operation_name method
+	 * @param operation one of the TRACE_ operations
+	 * @return the name of the MyFs method of the operation
+	 */
+	static const char *operation_name(uint8_t operation);
+
+	/**
+	 * content_hash method
+	 * @param data the content of a write
+	 * @param size the size of the content
+	 * @return the hash the content is recorded with, 0 for zeroed content
+	 */
+	static uint32_t content_hash(const char *data, uint32_t size);
+
+  private:
+	static const char *TRACE_MAGIC;
+	static const uint8_t TRACE_VERSION = 1;
+
+	std::mutex _lock;
+	std::ofstream _file;
+	std::chrono::steady_clock::time_point _start;
+
+	static std::string make_content(uint32_t size, uint32_t hash);
+};
+
+/**
+ * trace_content struct
+ * The content of a write as it's passed to a trace scope. It only points at
+ * the content, which is hashed when the write is recorded, so writes that
+ * aren't traced don't pay for the hash.
+ */
+struct trace_content
+{
+	explicit trace_content(const std::string &content) : trace_content(content.data(), content.size())
+	{
+	}
+
+	trace_content(const char *data, uint32_t size) : data(data), size(size)
+	{
+	}
+
+	const char *data;
+	uint32_t size;
+};
+
+/**
+ * MyFsTraceScope class
+ * Records a public operation of myfs when it returns, it's put at the start
+ * of the operation. Operations that are called by other operations aren't
+ * recorded, and nothing is done while the file system isn't traced.
+ */
+class MyFsTraceScope
+{
+  public:
+	template <typename... Args>
+	MyFsTraceScope(MyFsTrace *trace, uint8_t operation, const Args &... args) : _trace(_depth++ == 0 ? trace : nullptr), _exceptions(std::uncaught_exceptions())
+	{
+		if (_trace == nullptr)
+		{
+			return;
+		}
+
+		_record.operation = operation;
+		add(args...);
+		_record.start_us = _trace->now();
+	}
+
+	~MyFsTraceScope()
+	{
+		_depth--;
+		if (_trace == nullptr)
+		{
+			return;
+		}
+
+		// The scope is left by an exception when the operation failed, it may run while another exception unwinds
+		_record.duration_us = _trace->now() - _record.start_us;
+		_record.failed = std::uncaught_exceptions() > _exceptions;
+		_trace->write(_record);
+	}
+
+	/**
+	 * set_result method
+	 * Records the result of the operation in place of the last number, which
+	 * is passed as 0 when the scope is created.
+	 * @param value the result
+	 */
+	void set_result(uint32_t value)
+	{
+		if (_trace != nullptr)
+		{
+			_record.numbers.back() = value;
+		}
+	}
+
+  private:
+	MyFsTrace *_trace;
+	int _exceptions;
+	struct trace_record _record;
+
+	// The operations the current thread is inside of
+	static thread_local uint32_t _depth;
+
+	void add()
+	{
+	}
+
+	template <typename... Args>
+	void add(const std::string &value, const Args &... args)
+	{
+		_record.strings.push_back(value);
+		add(args...);
+	}
+
+	template <typename... Args>
+	void add(uint32_t value, const Args &... args)
+	{
+		_record.numbers.push_back(value);
+		add(args...);
+	}
+
+	template <typename... Args>
+	void add(const struct trace_content &value, const Args &... args)
+	{
+		_record.numbers.push_back(value.size);
+		_record.numbers.push_back(MyFsTrace::content_hash(value.data, value.size));
+		add(args...);
+	}
+
+	template <typename... Args>
+	void add(const std::vector<struct MyFs::myfs_batch_operation> &value, const Args &... args)
+	{
+		for (auto &operation : value)
+		{
+			_record.strings.push_back(operation.path);
+			_record.numbers.push_back(!operation.is_create ? MyFsTrace::BATCH_SET_CONTENT : operation.is_dir ? MyFsTrace::BATCH_CREATE_DIR : MyFsTrace::BATCH_CREATE_FILE);
+			add(trace_content(operation.content));
+		}
+		add(args...);
+	}
+};
+
+#endif // __MYFS_TRACE_H__
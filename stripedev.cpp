@@ -0,0 +1,204 @@
+#include "stripedev.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+StripedDeviceSimulator::StripedDeviceSimulator(const std::vector<std::string> &fnames, int stripe_size_, bool read_only_) : stripe_size(stripe_size_) {
+	if (fnames.empty())
+		throw std::runtime_error("A striped device needs at least one image");
+	if (stripe_size <= 0 || DEVICE_SIZE % stripe_size != 0)
+		throw std::runtime_error("The stripe size must divide the device size");
+
+	// Every member holds it's share of the stripes, rounded up to a whole stripe
+	int stripes = DEVICE_SIZE / stripe_size;
+	int member_size = ((stripes + fnames.size() - 1) / fnames.size()) * stripe_size;
+
+	read_only = read_only_;
+	for (auto &fname : fnames)
+		members.push_back(std::unique_ptr<BlockDeviceSimulator>(new BlockDeviceSimulator(fname, member_size, read_only_)));
+
+	// The workers live as long as the device, so a batch doesn't pay for starting threads
+	for (size_t i = 0; i < members.size(); i++) {
+		workers.push_back(std::unique_ptr<struct member_worker>(new struct member_worker()));
+		workers.back()->stop = false;
+		workers.back()->thread = std::thread(&StripedDeviceSimulator::worker_loop, this, workers.back().get());
+	}
+}
+
+StripedDeviceSimulator::~StripedDeviceSimulator() {
+	// The workers finish the parts they were given before they stop
+	for (auto &worker : workers) {
+		{
+			std::lock_guard<std::mutex> lock(worker->lock);
+			worker->stop = true;
+		}
+		worker->cond.notify_one();
+		worker->thread.join();
+	}
+}
+
+void StripedDeviceSimulator::worker_loop(struct member_worker *worker) {
+	std::unique_lock<std::mutex> lock(worker->lock);
+
+	while (true) {
+		worker->cond.wait(lock, [worker]() { return !worker->parts.empty() || worker->stop; });
+		if (worker->parts.empty())
+			return;
+
+		// Run the part without the lock, so the next part can be queued meanwhile
+		std::packaged_task<void()> part = std::move(worker->parts.front());
+		worker->parts.pop_front();
+		lock.unlock();
+		part();
+		lock.lock();
+	}
+}
+
+int StripedDeviceSimulator::get_stripe_size() const {
+	return stripe_size;
+}
+
+int StripedDeviceSimulator::get_member_count() const {
+	return members.size();
+}
+
+void StripedDeviceSimulator::read(int addr, int size, char *ans) {
+	read_batch(std::vector<struct io_request>(1, {addr, size, ans}));
+}
+
+void StripedDeviceSimulator::write(int addr, int size, const char *data) {
+	write_batch(std::vector<struct io_request>(1, {addr, size, (char *)data}));
+}
+
+void StripedDeviceSimulator::read_batch(const std::vector<struct io_request> &requests) {
+	transfer(requests, false);
+}
+
+void StripedDeviceSimulator::write_batch(const std::vector<struct io_request> &requests) {
+	transfer(requests, true);
+}
+
+void StripedDeviceSimulator::prefetch(int addr, int size) {
+	std::vector<std::vector<struct io_request>> parts = split(std::vector<struct io_request>(1, {addr, size, NULL}));
+
+	for (size_t i = 0; i < members.size(); i++)
+		for (auto &part : parts[i])
+			members[i]->prefetch(part.addr, part.size);
+}
+
+void StripedDeviceSimulator::drop(int addr, int size) {
+	std::vector<std::vector<struct io_request>> parts = split(std::vector<struct io_request>(1, {addr, size, NULL}));
+
+	for (size_t i = 0; i < members.size(); i++)
+		for (auto &part : parts[i])
+			members[i]->drop(part.addr, part.size);
+}
+
+void StripedDeviceSimulator::set_profile(const struct device_profile *profile_) {
+	for (auto &member : members)
+		member->set_profile(profile_);
+}
+
+struct io_stats StripedDeviceSimulator::get_io_stats() {
+	struct io_stats stats = BlockDeviceSimulator::get_io_stats();
+
+	// The members spend the time, the requests are counted before they are split
+	for (auto &member : members)
+		stats.device_time_us += member->get_io_stats().device_time_us;
+
+	return stats;
+}
+
+void StripedDeviceSimulator::reset_io_stats() {
+	BlockDeviceSimulator::reset_io_stats();
+	for (auto &member : members)
+		member->reset_io_stats();
+}
+
+std::vector<std::vector<struct io_request>> StripedDeviceSimulator::split(const std::vector<struct io_request> &requests) {
+	std::vector<std::vector<struct io_request>> parts(members.size());
+
+	for (auto &request : requests) {
+		int addr = request.addr;
+		int end = request.addr + request.size;
+
+		// Cut the request at the stripe borders, and move every piece to the member holding it's stripe
+		while (addr < end) {
+			int stripe = addr / stripe_size;
+			int piece_size = std::min(end, (stripe + 1) * stripe_size) - addr;
+			struct io_request piece = {
+				(int)(stripe / members.size()) * stripe_size + addr % stripe_size,
+				piece_size,
+				request.data == NULL ? NULL : request.data + (addr - request.addr)
+			};
+
+			parts[stripe % members.size()].push_back(piece);
+			addr += piece_size;
+		}
+	}
+
+	return parts;
+}
+
+void StripedDeviceSimulator::transfer(const std::vector<struct io_request> &requests, bool is_write) {
+	std::vector<std::vector<struct io_request>> parts = split(requests);
+	std::vector<std::future<void>> done;
+	size_t busy_members = 0;
+	long total_size = 0;
+
+	// Checked before the members are reached, their writes may run on the workers
+	if (is_write && is_read_only())
+		throw std::runtime_error("The device is read-only");
+
+	record(requests.data(), requests.size(), is_write);
+
+	for (auto &request : requests)
+		total_size += request.size;
+	for (auto &part : parts)
+		busy_members += part.empty() ? 0 : 1;
+
+	// Small batches and batches of a single member aren't worth handing to the workers
+	bool parallel = busy_members > 1 && total_size >= STRIPE_PARALLEL_MIN_SIZE;
+	std::packaged_task<void()> own_part;
+
+	for (size_t i = 0; i < members.size(); i++) {
+		if (parts[i].empty())
+			continue;
+
+		BlockDeviceSimulator *member = members[i].get();
+		const std::vector<struct io_request> &part = parts[i];
+		auto run = [member, &part, is_write]() {
+			if (is_write)
+				member->write_batch(part);
+			else
+				member->read_batch(part);
+		};
+
+		if (!parallel) {
+			run();
+			continue;
+		}
+
+		// The calling thread runs the first busy member's part itself, the workers run the rest
+		std::packaged_task<void()> task(run);
+		done.push_back(task.get_future());
+		if (!own_part.valid()) {
+			own_part = std::move(task);
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> lock(workers[i]->lock);
+			workers[i]->parts.push_back(std::move(task));
+		}
+		workers[i]->cond.notify_one();
+	}
+
+	if (own_part.valid())
+		own_part();
+
+	// Wait for all the parts, they reference the split requests. A failed part is reported once all of them ended
+	for (auto &part_done : done)
+		part_done.wait();
+	for (auto &part_done : done)
+		part_done.get();
+}
@@ -0,0 +1,62 @@
+#ifndef __STRIPEDEV__H__
+#define __STRIPEDEV__H__
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "blkdev.h"
+
+// Batches smaller than this are transferred on the calling thread
+#define STRIPE_PARALLEL_MIN_SIZE (64 * 1024)
+
+// A device made of several image files. The device is split into stripes of
+// stripe_size bytes, and the stripes are spread over the members in turns.
+class StripedDeviceSimulator : public BlockDeviceSimulator {
+public:
+	StripedDeviceSimulator(const std::vector<std::string> &fnames, int stripe_size_, bool read_only_ = false);
+	~StripedDeviceSimulator();
+
+	int get_stripe_size() const;
+	int get_member_count() const;
+
+	void read(int addr, int size, char *ans);
+	void write(int addr, int size, const char *data);
+
+	// The requests are split between the members, and every member runs it's part on it's own worker
+	void read_batch(const std::vector<struct io_request> &requests);
+	void write_batch(const std::vector<struct io_request> &requests);
+
+	void prefetch(int addr, int size);
+	void drop(int addr, int size);
+
+	// Every member emulates the profile on it's own, the requests are counted before they are split
+	void set_profile(const struct device_profile *profile_);
+	struct io_stats get_io_stats();
+	void reset_io_stats();
+
+private:
+	// The thread of a member, it runs the member's parts of the batches one after another
+	struct member_worker {
+		std::thread thread;
+		std::mutex lock;
+		std::condition_variable cond;
+		std::deque<std::packaged_task<void()>> parts;
+		bool stop;
+	};
+
+	std::vector<std::unique_ptr<BlockDeviceSimulator>> members;
+	std::vector<std::unique_ptr<struct member_worker>> workers;
+	int stripe_size;
+
+	void worker_loop(struct member_worker *worker);
+
+	std::vector<std::vector<struct io_request>> split(const std::vector<struct io_request> &requests);
+	void transfer(const std::vector<struct io_request> &requests, bool is_write);
+};
+
+#endif // __STRIPEDEV__H__
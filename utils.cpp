@@ -1,30 +1,46 @@
 #include "utils.h"
 
-#include <sstream>
+#include <string.h>
 
-std::vector<std::string> Utils::Split(const std::string &s, char delimiter)
+std::vector<std::string> Utils::Split(std::string_view s, char delimiter)
 {
     std::vector<std::string> tokens;
-    std::string token;
-    std::istringstream token_stream(s);
+    std::string_view token;
 
-    // While the string hasn't ended, get a "line" from it ending with the delimeter
-    while (std::getline(token_stream, token, delimiter))
+    // While the string hasn't ended, get a token from it ending with the delimeter
+    while (NextToken(s, delimiter, token))
     {
-        // Save "line"/token in tokens vector
-        tokens.push_back(token);
+        // Save the token in tokens vector
+        tokens.emplace_back(token);
     }
 
     return tokens;
 }
 
-MyFs::myfs_dir_entry Utils::SearchFile(std::string file_name, MyFs::dir_entries entries)
+bool Utils::NextToken(std::string_view &s, char delimiter, std::string_view &token)
+{
+    size_t end = s.find(delimiter);
+
+    // Nothing is left after the last delimeter, like getline at the end of a stream
+    if (s.empty())
+    {
+        return false;
+    }
+
+    // Cut the token and move after it's delimeter
+    token = s.substr(0, end);
+    s.remove_prefix(end == std::string_view::npos ? s.size() : end + 1);
+
+    return true;
+}
+
+MyFs::myfs_dir_entry Utils::SearchFile(std::string_view file_name, const MyFs::dir_entries &entries)
 {
     // Go through the entries
-    for (struct MyFs::myfs_dir_entry entry : entries)
+    for (const struct MyFs::myfs_dir_entry &entry : entries)
     {
         // Check if the entry's name matches the file's name
-        if (std::string(entry.name) == file_name)
+        if (entry.name == file_name)
         {
             return entry;
         }
@@ -34,10 +50,10 @@ MyFs::myfs_dir_entry Utils::SearchFile(std::string file_name, MyFs::dir_entries
     return { 0 };
 }
 
-MyFs::myfs_dir_entry Utils::SearchFile(uint32_t inode, MyFs::dir_entries entries)
+MyFs::myfs_dir_entry Utils::SearchFile(uint32_t inode, const MyFs::dir_entries &entries)
 {
     // Go through the entries
-    for (struct MyFs::myfs_dir_entry entry : entries)
+    for (const struct MyFs::myfs_dir_entry &entry : entries)
     {
         // Check if the entry's inode matches the file's inode
         if (entry.inode == inode)
@@ -50,7 +66,31 @@ MyFs::myfs_dir_entry Utils::SearchFile(uint32_t inode, MyFs::dir_entries entries
     return { 0 };
 }
 
-int Utils::CalcAmountOfBlocksForFile(uint32_t size)
+uint64_t Utils::Fingerprint(const char *data, uint32_t size)
 {
-    return int(size / BLOCK_DATA_SIZE) + (size % BLOCK_DATA_SIZE == 0 ? 0 : 1);
+    uint64_t hash = 0xcbf29ce484222325;
+
+    // FNV-1a over every byte of the data
+    for (uint32_t i = 0; i < size; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3;
+    }
+
+    // 0 is reserved for blocks without a fingerprint
+    return hash == 0 ? 1 : hash;
+}
+
+bool Utils::IsZero(const char *data, uint32_t size)
+{
+    // Check the first byte, then compare the data with itself shifted by one byte
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+uint32_t Utils::HashName(std::string_view name)
+{
+    // Fold the name's fingerprint into 32 bits
+    uint64_t fingerprint = Fingerprint(name.data(), name.length());
+
+    return uint32_t(fingerprint ^ (fingerprint >> 32));
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "myfs.h"
@@ -8,8 +9,16 @@
 class Utils
 {
   public:
-    static std::vector<std::string> Split(const std::string &s, char delimiter);
-    static MyFs::myfs_dir_entry SearchFile(std::string file_name, MyFs::dir_entries entries);
-    static MyFs::myfs_dir_entry SearchFile(uint32_t inode, MyFs::dir_entries entries);
-    static int CalcAmountOfBlocksForFile(uint32_t size);
+    static std::vector<std::string> Split(std::string_view s, char delimiter);
+    static bool NextToken(std::string_view &s, char delimiter, std::string_view &token);
+    static MyFs::myfs_dir_entry SearchFile(std::string_view file_name, const MyFs::dir_entries &entries);
+    static MyFs::myfs_dir_entry SearchFile(uint32_t inode, const MyFs::dir_entries &entries);
+    template <typename Geometry>
+    static int CalcAmountOfBlocksForFile(uint32_t size)
+    {
+        return int(Geometry::blocks_for_size(size));
+    }
+    static uint64_t Fingerprint(const char *data, uint32_t size);
+    static bool IsZero(const char *data, uint32_t size);
+    static uint32_t HashName(std::string_view name);
 };
\ No newline at end of file